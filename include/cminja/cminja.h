@@ -0,0 +1,164 @@
+/*
+  cMinja C API: compile templates, load data and render without spawning the cminja binary.
+
+  Compiled templates and data are immutable: one of each can be rendered from several threads at once.
+  Functions that fail return NULL (or a non-zero status) and leave a message in cminja_last_error().
+*/
+#ifndef CMINJA_H
+#define CMINJA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(CMINJA_BUILDING_SHARED)
+#define CMINJA_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(CMINJA_SHARED)
+#define CMINJA_API __declspec(dllimport)
+#else
+#define CMINJA_API
+#endif
+
+typedef struct cminja_template cminja_template;
+typedef struct cminja_data cminja_data;
+typedef struct cminja_incremental cminja_incremental;
+typedef struct cminja_patch_render cminja_patch_render;
+typedef struct cminja_tokenizer cminja_tokenizer;
+
+/* Status codes. */
+#define CMINJA_OK 0
+#define CMINJA_ERROR 1
+#define CMINJA_BUFFER_TOO_SMALL 2
+#define CMINJA_LIMIT_EXCEEDED 3
+
+/* Template flags (the cminja CLI uses CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS). */
+#define CMINJA_TRIM_BLOCKS 1            /* Removes the first newline after a block. */
+#define CMINJA_LSTRIP_BLOCKS 2          /* Removes leading whitespace on the line of a block. */
+#define CMINJA_KEEP_TRAILING_NEWLINE 4  /* Doesn't remove the last newline. */
+
+/* Receives the rendered text, in one or more chunks. Returning non-zero aborts the render. */
+typedef int (*cminja_sink)(void* user_data, const char* chunk, size_t size);
+
+/* Receives token ids (see cminja_render_tokens_to), in one or more chunks. Returning non-zero fails the call. */
+typedef int (*cminja_token_sink)(void* user_data, const int32_t* ids, size_t count);
+
+CMINJA_API const char* cminja_version(void);
+
+/* Message of the last error on the calling thread ("" if none). Valid until the next failing call on that thread. */
+CMINJA_API const char* cminja_last_error(void);
+
+CMINJA_API cminja_template* cminja_template_compile(const char* source, size_t size, int flags);
+CMINJA_API void cminja_template_free(cminja_template* tmpl);
+
+CMINJA_API cminja_data* cminja_data_from_json(const char* buffer, size_t size);
+CMINJA_API cminja_data* cminja_data_from_yaml(const char* buffer, size_t size);
+CMINJA_API void cminja_data_free(cminja_data* data);
+
+/*
+  Renders into [buffer, buffer + capacity) and sets *size to the length of the whole output.
+  Returns CMINJA_BUFFER_TOO_SMALL (having written its first `capacity` bytes) if it doesn't fit: pass a NULL buffer
+  and a zero capacity to query the size. A query renders the whole template (only counting the output): for output
+  of unknown size, cminja_render_to avoids rendering twice. The output isn't NUL-terminated.
+*/
+CMINJA_API int cminja_render(const cminja_template* tmpl, const cminja_data* data, char* buffer, size_t capacity, size_t* size);
+
+/*
+  Renders the iterations of loops over at least `min_items` items on up to `threads` threads (0: one per core) when
+  nothing in their body depends on the order they run in. 0 items (the default) turns it off. Applies to all renders
+  of the process: a server already rendering on every core gains nothing from it. The threads are started by the
+  first loops that need them and kept until the process exits.
+*/
+CMINJA_API void cminja_set_parallel_loops(size_t min_items, unsigned threads);
+
+/*
+  Renders to a sink, in chunks sent as the output is rendered: a sink returning non-zero stops the render there.
+  Returns CMINJA_OK, or CMINJA_ERROR if rendering failed (the sink may have received part of the output) or the
+  sink aborted.
+*/
+CMINJA_API int cminja_render_to(const cminja_template* tmpl, const cminja_data* data, cminja_sink sink, void* user_data);
+
+/* Limits of a render (see cminja_render_limited). 0 means no limit. */
+typedef struct cminja_limits {
+    uint64_t timeout_ms;  /* Wall-clock time. */
+    uint64_t max_output;  /* Bytes written by text and expressions, including into {% set %} blocks and macro results. */
+    uint64_t max_steps;   /* Loop iterations, macro calls and items of range(). */
+    uint64_t max_depth;   /* Nesting of macro calls and of recursive loop() calls. */
+} cminja_limits;
+
+/*
+  Renders like cminja_render_to, but aborts as soon as the render goes over one of `limits` (checked as it goes, so a
+  runaway template doesn't hold the thread): returns CMINJA_LIMIT_EXCEEDED then. The sink may already have received
+  the start of the output.
+*/
+CMINJA_API int cminja_render_limited(const cminja_template* tmpl, const cminja_data* data, const cminja_limits* limits,
+                                     cminja_sink sink, void* user_data);
+
+/*
+  Renders like cminja_render_to, then once the render succeeded sends to `spans_sink` the byte ranges in the output of the {% generation %} blocks
+  and of the iterations of the outermost loops, as JSON:
+  {"generation": [[start, end], ...], "loops": [{"line": <line of the for>, "iterations": [[start, end], ...]}, ...]}
+*/
+CMINJA_API int cminja_render_spans(const cminja_template* tmpl, const cminja_data* data, cminja_sink sink, cminja_sink spans_sink, void* user_data);
+
+/*
+  State kept between the renders of one conversation (see cminja_render_incremental).
+  Not thread-safe: use one per conversation.
+*/
+CMINJA_API cminja_incremental* cminja_incremental_new(void);
+CMINJA_API void cminja_incremental_free(cminja_incremental* state);
+
+/*
+  Renders like cminja_render_to, but resumes the previous render of `state` when it was for the same template
+  and `data` only appends messages to its "messages" array: the cost is that of the new messages.
+  Sets *stable_prefix to the number of leading bytes of the output identical to the previous output (0 if
+  rendered in full) and only sends the rest to the sink.
+*/
+CMINJA_API int cminja_render_incremental(cminja_incremental* state, const cminja_template* tmpl, const cminja_data* data,
+                                         size_t* stable_prefix, cminja_sink sink, void* user_data);
+
+/*
+  Renders `tmpl` with a copy of the JSON `data` in full, and keeps both to render again after patches to the data
+  (see cminja_patch_render_apply). Returns NULL on error. Not thread-safe.
+*/
+CMINJA_API cminja_patch_render* cminja_patch_render_new(const cminja_template* tmpl, const char* data, size_t size);
+CMINJA_API void cminja_patch_render_free(cminja_patch_render* state);
+
+/*
+  Applies a JSON Patch (RFC 6902) to the data and renders again only the top-level template nodes that read what
+  changed (or use variables they set). Sets *rerendered to the number of such nodes. If the patch fails, returns
+  CMINJA_ERROR and `state` must be freed: the data may be partly patched.
+*/
+CMINJA_API int cminja_patch_render_apply(cminja_patch_render* state, const char* patch, size_t size, size_t* rerendered);
+
+/* Current output of `state` (not NUL-terminated), valid until its next apply. */
+CMINJA_API const char* cminja_patch_render_output(const cminja_patch_render* state, size_t* size);
+
+/*
+  Loads a byte-level BPE tokenizer from the contents of a Hugging Face tokenizer.json (GPT-2, Llama 3 and Qwen2 style
+  tokenizers). Returns NULL if it can't be read or isn't supported.
+*/
+CMINJA_API cminja_tokenizer* cminja_tokenizer_load(const char* json, size_t size);
+CMINJA_API void cminja_tokenizer_free(cminja_tokenizer* tokenizer);
+
+/*
+  Tokenizes the constant text of `tmpl` ahead of time, for cminja_render_tokens. Call it before rendering `tmpl` from
+  several threads. The template keeps what it needs of the tokenizer, which can be freed.
+*/
+CMINJA_API int cminja_template_set_tokenizer(cminja_template* tmpl, const cminja_tokenizer* tokenizer);
+
+/*
+  Renders straight to the token ids of the output (those of encoding it without adding BOS / EOS tokens), only
+  tokenizing the text written by expressions. Same conventions as cminja_render, in ids rather than bytes.
+  Fails if the template has no tokenizer.
+*/
+CMINJA_API int cminja_render_tokens(const cminja_template* tmpl, const cminja_data* data, int32_t* ids, size_t capacity, size_t* count);
+CMINJA_API int cminja_render_tokens_to(const cminja_template* tmpl, const cminja_data* data, cminja_token_sink sink, void* user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CMINJA_H */
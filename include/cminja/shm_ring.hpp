@@ -0,0 +1,274 @@
+#pragma once
+
+// Shared-memory transport for render requests from co-located processes (see `cminja --serve-shm`).
+//
+// The shared region holds a fixed ring of slots. A producer claims a free slot, writes the template
+// path and the JSON data straight into it and submits it; a daemon worker parses the data in place,
+// renders and writes the output into the same slot, then wakes the producer. Wake-ups use futexes on
+// words of the shared region, so neither side polls or copies through a socket.
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace shm_ring {
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex words must be plain 32-bit atomics");
+
+const uint32_t magic = 0x6a6e696d; // "minj"
+const uint32_t version = 1;
+
+enum SlotState : uint32_t {
+    Free = 0,
+    Claimed,   // A producer is writing the request.
+    Submitted, // Waiting for a worker.
+    Rendering,
+    Done,      // Output (or error message) is ready for the producer.
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    std::atomic<uint32_t> submitted; // Bumped on each submission (workers wait on it).
+    std::atomic<uint32_t> released;  // Bumped when a slot is freed (producers wait on it when all slots are taken).
+    std::atomic<uint32_t> shutdown;
+};
+
+struct Slot {
+    std::atomic<uint32_t> state;
+    uint32_t status;        // 0 = rendered, 1 = error, 2 = over a render limit.
+    uint32_t path_size;     // The request is <template path><JSON data> at the start of the slot data.
+    uint32_t data_size;
+    uint32_t output_offset; // Output (or error message) location in the slot data.
+    uint32_t output_size;
+};
+
+inline size_t align(size_t n) {
+    return (n + 63) & ~size_t(63);
+}
+
+inline void futex_wait(std::atomic<uint32_t>* word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>* word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+class Ring {
+  public:
+    // Creates the shared region /dev/shm/<name>: done by the daemon. Fails if it already exists, as another daemon may be
+    // serving it (one that didn't exit cleanly leaves it behind: remove it then).
+    static Ring create(const std::string& name, uint32_t slot_count, uint32_t slot_size) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            auto reason = errno == EEXIST ? std::string("it already exists (remove it from /dev/shm if no daemon serves it)") : std::strerror(errno);
+            throw std::runtime_error("Could not create shared memory " + name + ": " + reason);
+        }
+        size_t size = align(sizeof(Header)) + size_t(slot_count) * (align(sizeof(Slot)) + align(slot_size));
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            throw std::runtime_error("Could not size shared memory " + name + ": " + std::strerror(errno));
+        }
+        Ring ring(fd, size);
+        auto header = ring.header();
+        header->magic = magic;
+        header->version = version;
+        header->slot_count = ring.slot_count_ = slot_count;
+        header->slot_size = ring.slot_size_ = uint32_t(align(slot_size));
+        return ring;
+    }
+
+    // Maps the region created by the daemon: done by producers.
+    static Ring open(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0) throw std::runtime_error("Could not open shared memory " + name + ": " + std::strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("Invalid shared memory " + name);
+        }
+        Ring ring(fd, st.st_size);
+        auto header = ring.header();
+        if (header->magic != magic || header->version != version) {
+            throw std::runtime_error("Shared memory " + name + " is not a cminja ring");
+        }
+        // The geometry is read once: every slot must lie within the mapping.
+        ring.slot_count_ = header->slot_count;
+        ring.slot_size_ = header->slot_size;
+        auto slots_size = ring.size_ - std::min(ring.size_, align(sizeof(Header)));
+        if (ring.slot_size_ % 64 != 0 || (ring.slot_count_ && slots_size / ring.slot_count_ < align(sizeof(Slot)) + ring.slot_size_)) {
+            throw std::runtime_error("Invalid shared memory " + name + ": slots past the end of the region");
+        }
+        return ring;
+    }
+
+    Ring(Ring&& other) : base_(other.base_), size_(other.size_), slot_count_(other.slot_count_), slot_size_(other.slot_size_) {
+        other.base_ = nullptr;
+    }
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring() {
+        if (base_) munmap(base_, size_);
+    }
+
+    Header* header() const { return reinterpret_cast<Header*>(base_); }
+    uint32_t slot_count() const { return slot_count_; }
+    uint32_t slot_size() const { return slot_size_; }
+    Slot* slot(uint32_t index) const {
+        return reinterpret_cast<Slot*>(base_ + align(sizeof(Header)) + size_t(index) * (align(sizeof(Slot)) + slot_size()));
+    }
+    char* data(Slot* slot) const {
+        return reinterpret_cast<char*>(slot) + align(sizeof(Slot));
+    }
+
+    // Producer side.
+
+    // Claims a free slot, waiting for one if needed. Write the request into data(slot), then submit() it.
+    // Throws once the daemon shut down.
+    Slot* acquire() {
+        auto h = header();
+        for (;;) {
+            auto released = h->released.load();
+            if (h->shutdown.load()) throw std::runtime_error("The render daemon shut down");
+            for (uint32_t i = 0; i < slot_count(); i++) {
+                auto s = slot(i);
+                uint32_t expected = Free;
+                if (s->state.compare_exchange_strong(expected, Claimed)) return s;
+            }
+            futex_wait(&h->released, released);
+        }
+    }
+
+    void submit(Slot* slot, uint32_t path_size, uint32_t data_size) {
+        slot->path_size = path_size;
+        slot->data_size = data_size;
+        slot->state.store(Submitted);
+        header()->submitted.fetch_add(1);
+        futex_wake(&header()->submitted, 1);
+    }
+
+    // Waits for the worker: returns the output (or error message if status is non-zero), valid until release().
+    // A request that no worker took before the daemon shut down fails.
+    std::string_view wait(Slot* slot, uint32_t& status) {
+        uint32_t state;
+        while ((state = slot->state.load()) != Done) {
+            uint32_t expected = Submitted;
+            if (state == Submitted && header()->shutdown.load() && slot->state.compare_exchange_strong(expected, Rendering)) {
+                fail(slot);
+                continue;
+            }
+            futex_wait(&slot->state, state);
+        }
+        status = slot->status;
+        return std::string_view(data(slot) + slot->output_offset, slot->output_size);
+    }
+
+    void release(Slot* slot) {
+        slot->state.store(Free);
+        header()->released.fetch_add(1);
+        futex_wake(&header()->released, 1);
+    }
+
+    // Renders through the daemon in one call; throws if the request doesn't fit in a slot.
+    uint32_t render(std::string_view template_path, std::string_view json_data, std::string& output) {
+        if (template_path.size() + json_data.size() > slot_size()) {
+            throw std::runtime_error("Request too large for a shared memory slot");
+        }
+        auto s = acquire();
+        std::memcpy(data(s), template_path.data(), template_path.size());
+        std::memcpy(data(s) + template_path.size(), json_data.data(), json_data.size());
+        submit(s, uint32_t(template_path.size()), uint32_t(json_data.size()));
+        uint32_t status;
+        output.assign(wait(s, status));
+        release(s);
+        return status;
+    }
+
+    // Worker side.
+
+    // Takes the next submitted slot, waiting for one; returns null once shutdown() was called.
+    Slot* next_request() {
+        auto h = header();
+        for (;;) {
+            auto submitted = h->submitted.load();
+            if (h->shutdown.load()) return nullptr;
+            for (uint32_t i = 0; i < slot_count(); i++) {
+                auto s = slot(i);
+                uint32_t expected = Submitted;
+                if (s->state.compare_exchange_strong(expected, Rendering)) return s;
+            }
+            futex_wait(&h->submitted, submitted);
+        }
+    }
+
+    void complete(Slot* slot, uint32_t status, uint32_t output_offset, uint32_t output_size) {
+        slot->status = status;
+        slot->output_offset = output_offset;
+        slot->output_size = output_size;
+        slot->state.store(Done);
+        futex_wake(&slot->state, 1);
+    }
+
+    // Stops the workers (they finish the slot they're rendering) and wakes the producers waiting for a free slot.
+    void shutdown() {
+        auto h = header();
+        h->shutdown.store(1);
+        h->submitted.fetch_add(1);
+        futex_wake(&h->submitted, INT32_MAX);
+        h->released.fetch_add(1);
+        futex_wake(&h->released, INT32_MAX);
+    }
+
+    // Fails the requests still submitted once the workers stopped, so that their producers don't wait forever. Requests
+    // submitted after this see the shutdown flag in wait().
+    void fail_pending() {
+        for (uint32_t i = 0; i < slot_count(); i++) {
+            auto s = slot(i);
+            uint32_t expected = Submitted;
+            if (s->state.compare_exchange_strong(expected, Rendering)) fail(s);
+        }
+    }
+
+  private:
+    char* base_;
+    size_t size_;
+    // Copies of the header's geometry, checked against the mapping: the other side can't change them afterwards.
+    uint32_t slot_count_ = 0;
+    uint32_t slot_size_ = 0;
+
+    Ring(int fd, size_t size) : size_(size) {
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) throw std::runtime_error(std::string("Could not map shared memory: ") + std::strerror(errno));
+        base_ = static_cast<char*>(base);
+    }
+
+    // Completes a slot taken from Submitted after shutdown with an error.
+    void fail(Slot* slot) {
+        std::string_view message = "The render daemon shut down";
+        auto size = std::min(message.size(), size_t(slot_size()));
+        std::memcpy(data(slot), message.data(), size);
+        complete(slot, 1, 0, uint32_t(size));
+    }
+};
+
+} // namespace shm_ring
+
+#endif
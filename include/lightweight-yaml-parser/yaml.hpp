@@ -427,19 +427,14 @@ bool is_valid(const NamedValue &val)
 	return val.value != nullptr;
 }
 
-// Parses the provided YAML file and returns a hashmap representing the YAML data structure
-YAML_map parse(std::string path)
+// Parses the YAML document read from the stream and returns a hashmap representing the YAML data structure
+YAML_map parse(std::istream &f)
 {
 	YAML_map yaml;
 	std::vector<std::string> lines;
 
 	int file_indent=0;	
 
-	std::ifstream f(path);
-    	if (!f.is_open()) {
-        	std::cerr << "Encountered error while trying to open " << path << "\n";
-        	return yaml;
-    	}
     	std::string tmp;
     	while (getline(f, tmp))
 	{
@@ -461,7 +456,6 @@ YAML_map parse(std::string path)
 			lines.at(lines.size()-1) += remove_spaces_after_char(remove_spaces_after_char(truncate_spaces(tmp), ':'), ',');
 		}
 	}
-    	f.close();
 
 	std::stack<void*> scope_stack; // This is used for properly handling nested objects
 	scope_stack.push(&yaml);
@@ -502,6 +496,17 @@ YAML_map parse(std::string path)
 	return yaml;
 }
 
+// Parses the provided YAML file and returns a hashmap representing the YAML data structure
+YAML_map parse(std::string path)
+{
+	std::ifstream f(path);
+    	if (!f.is_open()) {
+        	std::cerr << "Encountered error while trying to open " << path << "\n";
+        	return YAML_map();
+    	}
+	return parse(f);
+}
+
 // Recursively frees every value
 void delete_values(const TypedValue &v)
 {
@@ -550,6 +555,11 @@ public:
 		data = parse(path);
 	}
 
+	YAML(std::istream &in)
+	{
+		data = parse(in);
+	}
+
 	~YAML()
 	{
 		for(auto it : data)
@@ -9,13 +9,28 @@
 #pragma once
 
 #include <iostream>
+#include <list>
+#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <regex>
 #include <memory>
+#include <mutex>
+#include <atomic>
 #include <stdexcept>
 #include <sstream>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <tuple>
+#include <thread>
 #include <json.hpp>
 
 using json = nlohmann::ordered_json;
@@ -32,12 +47,17 @@ struct Options {
 
 struct ArgumentsValue;
 
-inline std::string normalize_newlines(const std::string & s) {
+inline std::string normalize_newlines(std::string_view s) {
 #ifdef _WIN32
-  static const std::regex nl_regex("\r\n");
-  return std::regex_replace(s, nl_regex, "\n");
+  std::string result;
+  result.reserve(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '\r' && i + 1 < s.size() && s[i + 1] == '\n') continue;
+    result += s[i];
+  }
+  return result;
 #else
-  return s;
+  return std::string(s);
 #endif
 }
 
@@ -45,44 +65,310 @@ inline std::string normalize_newlines(const std::string & s) {
 class Value : public std::enable_shared_from_this<Value> {
 public:
   using CallableType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
+  /* Yields the items of a lazy sequence in order, stopping as soon as the callback returns false. */
+  using GeneratorType = std::function<void(const std::function<bool(const Value &)> &)>;
+  /* Step of a select / reject / map chain: may replace the item, and returns false to drop it. */
+  using StageType = std::function<bool(Value &)>;
   using FilterType = std::function<Value(const std::shared_ptr<Context> &, ArgumentsValue &)>;
 
 private:
   using ObjectType = nlohmann::ordered_map<json, Value>;  // Only contains primitive keys
   using ArrayType = std::vector<Value>;
 
+  /* Serializations of the arrays / objects of a parsed JSON document (see json_dump), shared by all its views. */
+  struct JsonDumps {
+    static constexpr size_t max_size = 64 << 20;  // Bytes kept, beyond which new ones aren't
+
+    std::mutex mutex;
+    std::map<std::tuple<const json *, int, bool>, std::shared_ptr<const std::string>> texts;  // By node, indent and to_json (at level 0)
+    size_t size = 0;
+  };
+
+  /* Read-only view of an array / object node of a parsed JSON document: its direct children are converted to Values on first use. */
+  struct JsonNode {
+    std::shared_ptr<const json> node;  // Aliases (and keeps alive) the whole document
+    std::shared_ptr<JsonDumps> dumps;
+    std::once_flag converted;
+    std::shared_ptr<ArrayType> array;
+    std::shared_ptr<ObjectType> object;
+    JsonNode(std::shared_ptr<const json> && node, const std::shared_ptr<JsonDumps> & dumps) : node(std::move(node)), dumps(dumps) {}
+  };
+
+  /* Array whose items are produced on demand (range(), select()...): only stored once accessed by index. */
+  struct Sequence {
+    GeneratorType generate;
+    std::function<size_t()> count;  // Optional, cheaper than running generate
+    std::atomic<int64_t> size { -1 };  // -1 until known
+    std::once_flag materialized;
+    std::atomic<bool> has_array { false };
+    std::shared_ptr<ArrayType> array;
+    // For pipelines: the items of `source` go through each of `stages` in turn.
+    std::shared_ptr<const Value> source;
+    std::vector<StageType> stages;
+    bool keeps_size = false;
+    static constexpr size_t max_reserved = 1 << 16;  // Items reserved ahead when materializing a sequence of known size
+    Sequence(GeneratorType && generate, std::function<size_t()> && count) : generate(std::move(generate)), count(std::move(count)) {}
+  };
+
   std::shared_ptr<ArrayType> array_;
   std::shared_ptr<ObjectType> object_;
   std::shared_ptr<CallableType> callable_;
   json primitive_;
+  bool frozen_ = false;  // array_ / object_ may be shared with other Values: copy it before any mutation
+  std::shared_ptr<JsonNode> json_;  // Set instead of array_ / object_ for lazily converted JSON (always frozen)
+  std::shared_ptr<Sequence> sequence_;  // Set instead of array_ for lazy sequences (always frozen)
+
+  /*
+    Copies of frozen arrays / objects made by the mutations of the current render, by the identity of the frozen
+    container (see CopyScope). The original is kept so that its identity isn't reused during the render.
+  */
+  struct Copies {
+    std::unordered_map<const void *, std::pair<Value, Value>> values;
+    std::vector<std::shared_ptr<const void>> kept;  // Objects that live as long as the render (see keep_alive)
+  };
+  static inline thread_local Copies * copies_ = nullptr;
+
+  const void * frozen_id() const {
+    if (json_) return json_id(*json_->node);
+    if (sequence_) return sequence_.get();
+    if (array_) return array_.get();
+    return object_.get();
+  }
+  /* The copy of this frozen data made by a mutation during the current render, which replaces it for every reader. */
+  const Value * copied() const {
+    if (!frozen_ || !copies_ || copies_->values.empty()) return nullptr;
+    auto it = copies_->values.find(frozen_id());
+    return it == copies_->values.end() ? nullptr : &it->second.second;
+  }
 
   Value(const std::shared_ptr<ArrayType> & array) : array_(array) {}
   Value(const std::shared_ptr<ObjectType> & object) : object_(object) {}
   Value(const std::shared_ptr<CallableType> & callable) : object_(std::make_shared<ObjectType>()), callable_(callable) {}
+  Value(std::shared_ptr<JsonNode> && node) : frozen_(true), json_(std::move(node)) {}
+  Value(std::shared_ptr<Sequence> && sequence) : frozen_(true), sequence_(std::move(sequence)) {}
 
-  /* Python-style string repr */
-  static void dump_string(const json & primitive, std::ostringstream & out, char string_quote = '\'') {
-    if (!primitive.is_string()) throw std::runtime_error("Value is not a string: " + primitive.dump());
-    auto s = primitive.dump();
-    if (string_quote == '"' || s.find('\'') != std::string::npos) {
-      out << s;
+  /* Wraps `node`, which must belong to the same document as this JSON view: containers stay lazy, primitives are copied. */
+  Value json_child(const json & node) const {
+    if (!node.is_structured()) return Value(node);
+    return Value(std::make_shared<JsonNode>(std::shared_ptr<const json>(json_->node, &node), json_->dumps));
+  }
+  void convert_json() const {
+    std::call_once(json_->converted, [&]() {
+      const auto & node = *json_->node;
+      if (node.is_array()) {
+        auto array = std::make_shared<ArrayType>();
+        array->reserve(node.size());
+        for (const auto & item : node) array->push_back(json_child(item));
+        json_->array = std::move(array);
+      } else {
+        auto object = std::make_shared<ObjectType>();
+        object->reserve(node.size());
+        for (auto it = node.begin(); it != node.end(); ++it) object->emplace_back(it.key(), json_child(it.value()));
+        json_->object = std::move(object);
+      }
+    });
+  }
+  /* Backing containers (null if this is not an array / object), converting a JSON view's children if needed. */
+  ArrayType * as_array() const {
+    if (auto copy = copied()) return copy->as_array();
+    if (json_) return json_->node->is_array() ? (read_json(), convert_json(), json_->array.get()) : nullptr;
+    if (sequence_) {
+      std::call_once(sequence_->materialized, [&]() {
+        auto array = std::make_shared<ArrayType>();
+        // Up to a bound: the steps of a render budget must stop a huge sequence (e.g. range(10**9)) before it's allocated.
+        if (sequence_->size >= 0 || sequence_->count) array->reserve(std::min(size(), Sequence::max_reserved));
+        sequence_->generate([&](const Value & item) { array->push_back(item); return true; });
+        sequence_->size = array->size();
+        sequence_->array = std::move(array);
+        sequence_->has_array = true;
+      });
+      return sequence_->array.get();
+    }
+    return array_.get();
+  }
+  ObjectType * as_object() const {
+    if (auto copy = copied()) return copy->as_object();
+    if (json_) return json_->node->is_object() ? (read_json(), convert_json(), json_->object.get()) : nullptr;
+    return object_.get();
+  }
+
+  /*
+    Copy-on-write: gives this Value its own (shallow) copy of a frozen array / object. Elements stay frozen, so nested data is only copied when it is itself mutated.
+    Within a render, all the Values referring to the same frozen data share a single copy, so they all see the mutation (as with mutable data).
+  */
+  void unshare() {
+    if (!frozen_) return;
+    if (auto copy = copied()) {
+      array_ = copy->array_;
+      object_ = copy->object_;
+      json_.reset();
+      sequence_.reset();
+      frozen_ = false;
       return;
     }
-    // Reuse json dump, just changing string quotes
+    auto original = copies_ ? std::make_optional(*this) : std::nullopt;
+    if (json_ || sequence_) {
+      if (auto array = as_array()) array_ = std::make_shared<ArrayType>(*array);
+      else object_ = std::make_shared<ObjectType>(*as_object());
+      json_.reset();
+      sequence_.reset();
+    } else if (array_) {
+      array_ = std::make_shared<ArrayType>(*array_);
+    } else if (object_) {
+      object_ = std::make_shared<ObjectType>(*object_);
+    }
+    frozen_ = false;
+    if (original) {
+      auto id = original->frozen_id();
+      copies_->values.emplace(id, std::make_pair(std::move(*original), *this));
+    }
+  }
+
+public:
+  /*
+    Scope of a render: mutations of frozen data (e.g. JSON input) made while it lives are seen through every Value
+    referring to that data, and not by other renders. Nested scopes use the outermost one; `shared` makes another
+    thread use the scope of the render it works for.
+  */
+  class CopyScope {
+    std::unique_ptr<Copies> own_;
+    Copies * previous_;
+  public:
+    CopyScope() : previous_(copies_) {
+      if (!copies_) {
+        own_ = std::make_unique<Copies>();
+        copies_ = own_.get();
+      }
+    }
+    explicit CopyScope(Copies * shared) : previous_(copies_) { copies_ = shared; }
+    ~CopyScope() { copies_ = previous_; }
+    CopyScope(const CopyScope &) = delete;
+    CopyScope & operator=(const CopyScope &) = delete;
+  };
+  static Copies * current_copies() { return copies_; }
+  /* Keeps `object` alive until the end of the current render (e.g. the scope a macro was defined in). */
+  static void keep_alive(std::shared_ptr<const void> object) {
+    if (!copies_ || (!copies_->kept.empty() && copies_->kept.back() == object)) return;
+    copies_->kept.push_back(std::move(object));
+  }
+  /* Whether frozen data was copied to be mutated in the current scope. */
+  static bool copied_any() { return copies_ && !copies_->values.empty(); }
+
+private:
+
+  /* Length of the UTF-8 sequence at `p` (0 if it isn't valid UTF-8, which nlohmann::json refuses to dump). */
+  static size_t utf8_sequence_length(const unsigned char * p, const unsigned char * end) {
+    size_t n;
+    unsigned char low = 0x80, high = 0xBF;  // Range of the second byte (excludes overlong forms, surrogates and code points past U+10FFFF)
+    if (p[0] >= 0xC2 && p[0] <= 0xDF) n = 2;
+    else if (p[0] >= 0xE0 && p[0] <= 0xEF) n = 3, low = p[0] == 0xE0 ? 0xA0 : 0x80, high = p[0] == 0xED ? 0x9F : 0xBF;
+    else if (p[0] >= 0xF0 && p[0] <= 0xF4) n = 4, low = p[0] == 0xF0 ? 0x90 : 0x80, high = p[0] == 0xF4 ? 0x8F : 0xBF;
+    else return 0;
+    if ((size_t) (end - p) < n || p[1] < low || p[1] > high) return 0;
+    for (size_t i = 2; i < n; ++i) {
+      if (p[i] < 0x80 || p[i] > 0xBF) return 0;
+    }
+    return n;
+  }
+  /*
+    Python-style string repr (or JSON string with string_quote '"'), escaped like nlohmann::json::dump() does. Strings
+    holding a single quote are written with double quotes. Runs of characters that need no escaping are copied whole.
+  */
+  static void dump_string(const json & primitive, std::ostringstream & out, char string_quote = '\'') {
+    if (!primitive.is_string()) throw std::runtime_error("Value is not a string: " + primitive.dump());
+    const auto & s = primitive.get_ref<const std::string &>();
+    if (string_quote != '"' && s.find('\'') != std::string::npos) string_quote = '"';
+    auto p = reinterpret_cast<const unsigned char *>(s.data()), end = p + s.size(), run = p;
+    auto flush = [&]() { out.write(reinterpret_cast<const char *>(run), p - run); };
     out << string_quote;
-    for (size_t i = 1, n = s.size() - 1; i < n; ++i) {
-      if (s[i] == '\\' && s[i + 1] == '"') {
-        out << '"';
-        i++;
-      } else if (s[i] == string_quote) {
-        out << '\\' << string_quote;
-      } else {
-        out << s[i];
+    while (p < end) {
+      auto c = *p;
+      if (c >= 0x80) {
+        auto n = utf8_sequence_length(p, end);
+        if (!n) {
+          (void) primitive.dump();  // Throws nlohmann::json's error for the invalid UTF-8
+          n = 1;
+        }
+        p += n;
+        continue;
+      }
+      if (c >= 0x20 && c != '\\' && c != (unsigned char) string_quote) {
+        ++p;
+        continue;
       }
+      flush();
+      switch (c) {
+        case '\b': out << "\\b"; break;
+        case '\t': out << "\\t"; break;
+        case '\n': out << "\\n"; break;
+        case '\f': out << "\\f"; break;
+        case '\r': out << "\\r"; break;
+        case '\\': out << "\\\\"; break;
+        case '"': out << "\\\""; break;
+        default: {
+          static const char hex[] = "0123456789abcdef";
+          const char escape[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+          out.write(escape, sizeof(escape));
+        }
+      }
+      run = ++p;
     }
+    flush();
     out << string_quote;
   }
+
+public:
+  /* Writes the Python repr of this value (or its JSON with `to_json`) into `out`, nested `level` deep. */
   void dump(std::ostringstream & out, int indent = -1, int level = 0, bool to_json = false) const {
+    if (json_ && !json_reads_ && !copied_any()) {
+      write_indented(out, *json_dump(indent, to_json), indent, level);
+      return;
+    }
+    dump_value(out, indent, level, to_json);
+  }
+
+private:
+  /*
+    Serialization of a JSON view, kept for the document: the data is immutable, and often dumped by every render (e.g.
+    tool definitions). Made at level 0, so the same data dumped on its own and nested in other values shares it (see
+    write_indented). Not used while JSON reads are recorded, as it doesn't read the children, nor once the render
+    copied data to mutate it (see unshare).
+  */
+  std::shared_ptr<const std::string> json_dump(int indent, bool to_json) const {
+    auto key = std::make_tuple(json_->node.get(), indent, to_json);
+    auto & dumps = *json_->dumps;
+    {
+      std::lock_guard<std::mutex> lock(dumps.mutex);
+      auto it = dumps.texts.find(key);
+      if (it != dumps.texts.end()) return it->second;
+    }
+    std::ostringstream out;
+    dump_value(out, indent, 0, to_json);
+    auto text = std::make_shared<const std::string>(out.str());
+    std::lock_guard<std::mutex> lock(dumps.mutex);
+    if (dumps.size + text->size() <= JsonDumps::max_size && dumps.texts.emplace(key, text).second) dumps.size += text->size();
+    return text;
+  }
+  /* Writes a serialization made at level 0 as if made `level` deep: only the indentation after its line breaks differs. */
+  static void write_indented(std::ostringstream & out, const std::string & text, int indent, int level) {
+    if (indent <= 0 || level == 0) {
+      out << text;
+      return;
+    }
+    std::string padding((size_t) indent * level, ' ');
+    size_t start = 0;
+    for (size_t end; (end = text.find('\n', start)) != std::string::npos; start = end + 1) {
+      out.write(text.data() + start, end + 1 - start);
+      out << padding;
+    }
+    out.write(text.data() + start, text.size() - start);
+  }
+  void dump_value(std::ostringstream & out, int indent, int level, bool to_json) const {
+    // The children of a JSON view are dumped as part of its serialization, not kept on their own.
+    auto dump_child = [&](const Value & child, int child_level) {
+      if (json_) child.dump_value(out, indent, child_level, to_json);
+      else child.dump(out, indent, child_level, to_json);
+    };
     auto print_indent = [&](int level) {
       if (indent > 0) {
           out << "\n";
@@ -98,19 +384,19 @@ private:
     auto string_quote = to_json ? '"' : '\'';
 
     if (is_null()) out << "null";
-    else if (array_) {
+    else if (auto array = as_array()) {
       out << "[";
       print_indent(level + 1);
-      for (size_t i = 0; i < array_->size(); ++i) {
+      for (size_t i = 0; i < array->size(); ++i) {
         if (i) print_sub_sep();
-        (*array_)[i].dump(out, indent, level + 1, to_json);
+        dump_child((*array)[i], level + 1);
       }
       print_indent(level);
       out << "]";
-    } else if (object_) {
+    } else if (auto object = as_object()) {
       out << "{";
       print_indent(level + 1);
-      for (auto begin = object_->begin(), it = begin; it != object_->end(); ++it) {
+      for (auto begin = object->begin(), it = begin; it != object->end(); ++it) {
         if (it != begin) print_sub_sep();
         if (it->first.is_string()) {
           dump_string(it->first, out, string_quote);
@@ -118,7 +404,7 @@ private:
           out << string_quote << it->first.dump() << string_quote;
         }
         out << ": ";
-        it->second.dump(out, indent, level + 1, to_json);
+        dump_child(it->second, level + 1);
       }
       print_indent(level);
       out << "}";
@@ -126,10 +412,10 @@ private:
       throw std::runtime_error("Cannot dump callable to JSON");
     } else if (is_boolean() && !to_json) {
       out << (this->to_bool() ? "True" : "False");
-    } else if (is_string() && !to_json) {
+    } else if (is_string()) {
       dump_string(primitive_, out, string_quote);
     } else {
-      out << primitive_.dump();
+      out << primitive_;
     }
   }
 
@@ -142,6 +428,7 @@ public:
   Value(const std::string & v) : primitive_(v) {}
   Value(const char * v) : primitive_(std::string(v)) {}
 
+  /* Converted JSON data is frozen (see freeze()), so it can be shared across renders, templates and threads. */
   Value(const json & v) {
     if (v.is_object()) {
       auto object = std::make_shared<ObjectType>();
@@ -149,27 +436,192 @@ public:
         (*object)[it.key()] = it.value();
       }
       object_ = std::move(object);
+      frozen_ = true;
     } else if (v.is_array()) {
       auto array = std::make_shared<ArrayType>();
       for (const auto& item : v) {
         array->push_back(Value(item));
       }
       array_ = array;
+      frozen_ = true;
     } else {
       primitive_ = v;
     }
   }
 
-  std::vector<Value> keys() {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
+  /* Parts of JSON documents read through views while recording (see record_json_reads): whole arrays / objects, and single keys of objects. */
+  struct JsonReads {
+    std::unordered_set<const void *> containers;
+    std::unordered_map<const void *, std::unordered_set<std::string>> keys;
+  };
+private:
+  static inline thread_local JsonReads * json_reads_ = nullptr;
+  void read_json() const {
+    if (json_reads_) json_reads_->containers.insert(json_id(*json_->node));
+  }
+  void read_json_key(const std::string & key) const {
+    if (json_reads_) json_reads_->keys[json_id(*json_->node)].insert(key);
+  }
+public:
+  /* Records the reads of JSON data made by this thread into `reads` (null stops recording); returns the previous recorder. */
+  static JsonReads * record_json_reads(JsonReads * reads) {
+    std::swap(reads, json_reads_);
+    return reads;
+  }
+  static bool records_json_reads() { return json_reads_ != nullptr; }
+  /* Identity of a JSON array / object that doesn't change when the json holding it is moved (e.g. within its parent). */
+  static const void * json_id(const json & node) {
+    if (node.is_object()) return &node.get_ref<const json::object_t &>();
+    if (node.is_array()) return &node.get_ref<const json::array_t &>();
+    return &node;
+  }
+
+  /*
+    Lazily converted view of a parsed document: nested arrays / objects are only converted to Values
+    (one level at a time) when a template accesses them, and never copied unless mutated.
+  */
+  static Value from_json(std::shared_ptr<const json> document) {
+    if (!document->is_structured()) return Value(*document);
+    return Value(std::make_shared<JsonNode>(std::move(document), std::make_shared<JsonDumps>()));
+  }
+
+  /*
+    Lazy array: `generate` is run again on each iteration (so it must not depend on state that changes
+    while the sequence is alive), and its items are only stored if accessed by index.
+    `count` returns the number of items without generating them, if possible; otherwise they're counted when first needed.
+  */
+  static Value sequence(GeneratorType generate, std::function<size_t()> count = nullptr) {
+    return Value(std::make_shared<Sequence>(std::move(generate), std::move(count)));
+  }
+  /*
+    Lazy sequence of the items of `source` that go through `stage` (which `keeps_size` if it never drops items).
+    Stages added to a pipeline are fused with it: all of them are applied in a single pass over the original source.
+  */
+  static Value pipeline(const Value & source, StageType stage, bool keeps_size) {
+    std::shared_ptr<const Value> origin;
+    std::vector<StageType> stages;
+    if (source.sequence_ && source.sequence_->source && !source.sequence_->has_array && !source.copied()) {
+      origin = source.sequence_->source;
+      stages = source.sequence_->stages;
+      keeps_size = keeps_size && source.sequence_->keeps_size;
+    } else {
+      origin = std::make_shared<const Value>(source);
+    }
+    stages.push_back(std::move(stage));
+    auto res = sequence([origin, stages](const std::function<bool(const Value &)> & yield) {
+      auto run_stages = stages;  // Stages may reuse their call arguments: each run gets its own copies
+      origin->iterate([&](const Value & item) {
+        Value value = item;
+        for (auto & stage : run_stages) {
+          if (!stage(value)) return true;
+        }
+        return yield(value);
+      });
+    }, keeps_size ? std::function<size_t()>([origin]() { return origin->size(); }) : nullptr);
+    res.sequence_->source = std::move(origin);
+    res.sequence_->stages = std::move(stages);
+    res.sequence_->keeps_size = keeps_size;
+    return res;
+  }
+  /* Plain array holding the items of a lazy sequence (e.g. before storing it in a variable); other values are returned as is. */
+  Value materialize() const {
+    if (auto copy = copied()) return *copy;
+    if (!sequence_) return *this;
+    as_array();
+    Value res(sequence_->array);
+    res.frozen_ = true;
+    return res;
+  }
+  /* Lazy sequence of the [key, value] pairs of an object. */
+  Value items() const {
+    if (!is_object()) throw std::runtime_error("Value is not an object: " + dump());
+    auto self = *this;
+    return sequence([self](const std::function<bool(const Value &)> & yield) {
+      for (const auto & [key, value] : *self.as_object()) {
+        if (!yield(Value::array({key, value}))) return;
+      }
+    }, [self]() { return self.size(); });
+  }
+
+  /*
+    Marks this array / object and everything it contains as shared, immutable data: any later mutation
+    (through this Value or any copy of it) first copies the container it touches (copy-on-write).
+    For callables, this applies to their attributes.
+  */
+  Value & freeze() {
+    if (frozen_) return *this;
+    if (array_) {
+      for (auto & item : *array_) item.freeze();
+    } else if (object_) {
+      for (auto & item : *object_) item.second.freeze();
+    } else {
+      return *this;
+    }
+    frozen_ = true;
+    return *this;
+  }
+  bool is_frozen() const { return frozen_ && !copied(); }
+
+  /* Whether this is, or contains, a view of a JSON document (see from_json) or a lazy sequence. */
+  bool refers_to_json() const {
+    if (auto copy = copied()) return copy->refers_to_json();
+    if (json_ || sequence_) return true;
+    if (array_) {
+      for (const auto & item : *array_) if (item.refers_to_json()) return true;
+    } else if (object_) {
+      for (const auto & item : *object_) if (item.second.refers_to_json()) return true;
+    }
+    return false;
+  }
+
+  /* Copy that later in-place mutations of this value can't reach: mutable containers are copied, frozen data is shared. */
+  Value snapshot() const {
+    if (auto copy = copied()) return copy->snapshot();
+    if (frozen_ || callable_) return *this;
+    if (array_) {
+      auto res = std::make_shared<ArrayType>();
+      res->reserve(array_->size());
+      for (const auto & item : *array_) res->push_back(item.snapshot());
+      return Value(res);
+    }
+    if (object_) {
+      auto res = std::make_shared<ObjectType>();
+      for (const auto & [key, value] : *object_) res->emplace(key, value.snapshot());
+      return Value(res);
+    }
+    return *this;
+  }
+
+  std::vector<Value> keys() const {
+    auto object = as_object();
+    if (!object) throw std::runtime_error("Value is not an object: " + dump());
     std::vector<Value> res;
-    for (const auto& item : *object_) {
+    for (const auto& item : *object) {
       res.push_back(item.first);
     }
     return res;
   }
 
+  /* Whether size() is known without running a lazy sequence (and the tests or filters of its pipeline). */
+  bool size_known() const {
+    return !sequence_ || copied() || sequence_->count || sequence_->has_array || sequence_->size.load() >= 0;
+  }
   size_t size() const {
+    if (auto copy = copied()) return copy->size();
+    if (json_) return read_json(), json_->node->size();
+    if (sequence_) {
+      auto n = sequence_->size.load();
+      if (n < 0) {
+        if (sequence_->count) {
+          n = sequence_->count();
+        } else {
+          n = 0;
+          iterate([&](const Value &) { ++n; return true; });
+        }
+        sequence_->size = n;
+      }
+      return n;
+    }
     if (is_object()) return object_->size();
     if (is_array()) return array_->size();
     if (is_string()) return primitive_.get<std::string>().length();
@@ -189,18 +641,26 @@ public:
   static Value callable(const CallableType & callable) {
     return Value(std::make_shared<CallableType>(callable));
   }
+  /* The function object of a callable made from an F, if it is one. */
+  template <typename F>
+  const F * callable_target() const {
+    return callable_ ? callable_->target<F>() : nullptr;
+  }
 
   void insert(size_t index, const Value& v) {
-    if (!array_)
+    if (!is_array())
       throw std::runtime_error("Value is not an array: " + dump());
+    unshare();
     array_->insert(array_->begin() + index, v);
   }
   void push_back(const Value& v) {
-    if (!array_)
+    if (!is_array())
       throw std::runtime_error("Value is not an array: " + dump());
+    unshare();
     array_->push_back(v);
   }
   Value pop(const Value& index) {
+    unshare();
     if (is_array()) {
       if (array_->empty())
         throw std::runtime_error("pop from empty list");
@@ -232,13 +692,30 @@ public:
       throw std::runtime_error("Value is not an array or object: " + dump());
     }
   }
-  Value get(const Value& key) {
-    if (array_) {
+  Value get(const Value& key) const {
+    if (auto copy = copied()) return copy->get(key);
+    if (json_) {
+      // Look the child up in the document directly, without converting its siblings.
+      const auto & node = *json_->node;
+      if (node.is_array()) {
+        read_json();
+        if (!key.is_number_integer()) return Value();
+        auto index = key.get<int>();
+        return json_child(node.at(index < 0 ? node.size() + index : index));
+      }
+      if (!key.is_hashable()) throw std::runtime_error("Unashable type: " + dump());
+      if (!key.is_string()) return Value();
+      read_json_key(key.primitive_.get<std::string>());
+      auto it = node.find(key.primitive_.get<std::string>());
+      if (it == node.end()) return Value();
+      return json_child(*it);
+    } else if (is_array()) {
       if (!key.is_number_integer()) {
         return Value();
       }
+      auto array = as_array();
       auto index = key.get<int>();
-      return array_->at(index < 0 ? array_->size() + index : index);
+      return array->at(index < 0 ? array->size() + index : index);
     } else if (object_) {
       if (!key.is_hashable()) throw std::runtime_error("Unashable type: " + dump());
       auto it = object_->find(key.primitive_);
@@ -248,8 +725,9 @@ public:
     return Value();
   }
   void set(const Value& key, const Value& value) {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
+    if (!is_object()) throw std::runtime_error("Value is not an object: " + dump());
     if (!key.is_hashable()) throw std::runtime_error("Unashable type: " + dump());
+    unshare();
     (*object_)[key.primitive_] = value;
   }
   Value call(const std::shared_ptr<Context> & context, ArgumentsValue & args) const {
@@ -257,10 +735,10 @@ public:
     return (*callable_)(context, args);
   }
 
-  bool is_object() const { return !!object_; }
-  bool is_array() const { return !!array_; }
+  bool is_object() const { return !!object_ || (json_ && json_->node->is_object()); }
+  bool is_array() const { return !!array_ || !!sequence_ || (json_ && json_->node->is_array()); }
   bool is_callable() const { return !!callable_; }
-  bool is_null() const { return !object_ && !array_ && primitive_.is_null() && !callable_; }
+  bool is_null() const { return !object_ && !array_ && primitive_.is_null() && !callable_ && !json_ && !sequence_; }
   bool is_boolean() const { return primitive_.is_boolean(); }
   bool is_number_integer() const { return primitive_.is_number_integer(); }
   bool is_number_float() const { return primitive_.is_number_float(); }
@@ -268,38 +746,65 @@ public:
   bool is_string() const { return primitive_.is_string(); }
   bool is_iterable() const { return is_array() || is_object() || is_string(); }
 
-  bool is_primitive() const { return !array_ && !object_ && !callable_; }
+  bool is_primitive() const { return !array_ && !object_ && !callable_ && !json_ && !sequence_; }
   bool is_hashable() const { return is_primitive(); }
+  /* JSON this array or object was lazily converted from, if so: immutable, so values from the same JSON are equal. */
+  std::shared_ptr<const json> json_source() const { return json_ && !copied() ? json_->node : nullptr; }
 
   bool empty() const {
+    if (auto copy = copied()) return copy->empty();
     if (is_null())
       throw std::runtime_error("Undefined value or reference");
     if (is_string()) return primitive_.empty();
+    if (json_) return read_json(), json_->node->empty();
+    if (sequence_) return iterate([](const Value &) { return false; });
     if (is_array()) return array_->empty();
     if (is_object()) return object_->empty();
     return false;
   }
 
-  void for_each(const std::function<void(Value &)> & callback) const {
+  /* Visits the items of an array (or the keys of an object, or the characters of a string) until `callback` returns false. Returns whether all items were visited. */
+  bool iterate(const std::function<bool(const Value &)> & callback) const {
+    if (auto copy = copied()) return copy->iterate(callback);
     if (is_null())
       throw std::runtime_error("Undefined value or reference");
-    if (array_) {
+    if (json_) {
+      read_json();
+      const auto & node = *json_->node;
+      if (node.is_array()) {
+        for (const auto & item : node) if (!callback(json_child(item))) return false;
+      } else {
+        for (auto it = node.begin(); it != node.end(); ++it) if (!callback(Value(it.key()))) return false;
+      }
+    } else if (sequence_) {
+      if (sequence_->has_array) {
+        for (const auto & item : *sequence_->array) if (!callback(item)) return false;
+      } else {
+        bool complete = true;
+        sequence_->generate([&](const Value & item) { return complete = callback(item); });
+        return complete;
+      }
+    } else if (array_) {
       for (auto& item : *array_) {
-        callback(item);
+        if (!callback(item)) return false;
       }
     } else if (object_) {
       for (auto & item : *object_) {
         Value key(item.first);
-        callback(key);
+        if (!callback(key)) return false;
       }
     } else if (is_string()) {
       for (char c : primitive_.get<std::string>()) {
         auto val = Value(std::string(1, c));
-        callback(val);
+        if (!callback(val)) return false;
       }
     } else {
       throw std::runtime_error("Value is not iterable: " + dump());
     }
+    return true;
+  }
+  void for_each(const std::function<void(const Value &)> & callback) const {
+    iterate([&](const Value & item) { callback(item); return true; });
   }
 
   bool to_bool() const {
@@ -347,20 +852,24 @@ public:
     if (callable_ || other.callable_) {
       if (callable_.get() != other.callable_.get()) return false;
     }
-    if (array_) {
-      if (!other.array_) return false;
-      if (array_->size() != other.array_->size()) return false;
-      for (size_t i = 0; i < array_->size(); ++i) {
-        if (!(*array_)[i].to_bool() || !(*other.array_)[i].to_bool() || (*array_)[i] != (*other.array_)[i]) return false;
+    if (auto array = as_array()) {
+      auto other_array = other.as_array();
+      if (!other_array) return false;
+      if (array->size() != other_array->size()) return false;
+      for (size_t i = 0; i < array->size(); ++i) {
+        if (!(*array)[i].to_bool() || !(*other_array)[i].to_bool() || (*array)[i] != (*other_array)[i]) return false;
       }
       return true;
-    } else if (object_) {
-      if (!other.object_) return false;
-      if (object_->size() != other.object_->size()) return false;
-      for (const auto& item : *object_) {
-        if (!item.second.to_bool() || !other.object_->count(item.first) || item.second != other.object_->at(item.first)) return false;
+    } else if (auto object = as_object()) {
+      auto other_object = other.as_object();
+      if (!other_object) return false;
+      if (object->size() != other_object->size()) return false;
+      for (const auto& item : *object) {
+        if (!item.second.to_bool() || !other_object->count(item.first) || item.second != other_object->at(item.first)) return false;
       }
       return true;
+    } else if (other.json_) {
+      return false;
     } else {
       return primitive_ == other.primitive_;
     }
@@ -369,8 +878,12 @@ public:
 
   bool contains(const char * key) const { return contains(std::string(key)); }
   bool contains(const std::string & key) const {
-    if (array_) {
+    if (auto copy = copied()) return copy->contains(key);
+    if (is_array()) {
       return false;
+    } else if (json_) {
+      read_json_key(key);
+      return json_->node->contains(key);
     } else if (object_) {
       return object_->find(key) != object_->end();
     } else {
@@ -378,47 +891,55 @@ public:
     }
   }
   bool contains(const Value & value) const {
+    if (auto copy = copied()) return copy->contains(value);
     if (is_null())
       throw std::runtime_error("Undefined value or reference");
-    if (array_) {
-      for (const auto& item : *array_) {
-        if (item.to_bool() && item == value) return true;
-      }
-      return false;
-    } else if (object_) {
+    if (is_array()) {
+      return !iterate([&](const Value & item) { return !(item.to_bool() && item == value); });
+    } else if (is_object()) {
       if (!value.is_hashable()) throw std::runtime_error("Unashable type: " + value.dump());
+      if (json_) {
+        if (!value.is_string()) return false;
+        read_json_key(value.primitive_.get<std::string>());
+        return json_->node->contains(value.primitive_.get<std::string>());
+      }
       return object_->find(value.primitive_) != object_->end();
     } else {
       throw std::runtime_error("contains can only be called on arrays and objects: " + dump());
     }
   }
   void erase(size_t index) {
-    if (!array_) throw std::runtime_error("Value is not an array: " + dump());
+    if (!is_array()) throw std::runtime_error("Value is not an array: " + dump());
+    unshare();
     array_->erase(array_->begin() + index);
   }
   void erase(const std::string & key) {
-    if (!object_) throw std::runtime_error("Value is not an object: " + dump());
+    if (!is_object()) throw std::runtime_error("Value is not an object: " + dump());
+    unshare();
     object_->erase(key);
   }
   const Value& at(const Value & index) const {
-    return const_cast<Value*>(this)->at(index);
-  }
-  Value& at(const Value & index) {
     if (!index.is_hashable()) throw std::runtime_error("Unashable type: " + dump());
-    if (is_array()) return array_->at(index.get<int>());
-    if (is_object()) return object_->at(index.primitive_);
+    if (auto array = as_array()) return array->at(index.get<int>());
+    if (auto object = as_object()) return object->at(index.primitive_);
     throw std::runtime_error("Value is not an array or object: " + dump());
   }
-  const Value& at(size_t index) const {
-    return const_cast<Value*>(this)->at(index);
+  /* Mutable access copies frozen data first: only use it to write, read through a const Value. */
+  Value& at(const Value & index) {
+    unshare();
+    return const_cast<Value &>(static_cast<const Value *>(this)->at(index));
   }
-  Value& at(size_t index) {
+  const Value& at(size_t index) const {
     if (is_null())
       throw std::runtime_error("Undefined value or reference");
-    if (is_array()) return array_->at(index);
-    if (is_object()) return object_->at(index);
+    if (auto array = as_array()) return array->at(index);
+    if (auto object = as_object()) return object->at(index);
     throw std::runtime_error("Value is not an array or object: " + dump());
   }
+  Value& at(size_t index) {
+    unshare();
+    return const_cast<Value &>(static_cast<const Value *>(this)->at(index));
+  }
 
   template <typename T>
   T get(const std::string & key, T default_value) const {
@@ -433,6 +954,7 @@ public:
   }
 
   std::string dump(int indent=-1, bool to_json=false) const {
+    if (json_ && !json_reads_ && !copied_any()) return *json_dump(indent, to_json);
     std::ostringstream out;
     dump(out, indent, 0, to_json);
     return out.str();
@@ -459,8 +981,8 @@ public:
         return get<int64_t>() + rhs.get<int64_t>();
       } else if (is_array() && rhs.is_array()) {
         auto res = Value::array();
-        for (const auto& item : *array_) res.push_back(item);
-        for (const auto& item : *rhs.array_) res.push_back(item);
+        for (const auto& item : *as_array()) res.push_back(item);
+        for (const auto& item : *rhs.as_array()) res.push_back(item);
         return res;
       } else {
         return get<double>() + rhs.get<double>();
@@ -529,13 +1051,15 @@ struct ArgumentsValue {
 
 template <>
 inline json Value::get<json>() const {
+  if (auto copy = copied()) return copy->get<json>();
   if (is_primitive()) return primitive_;
+  if (json_) return read_json(), *json_->node;
   if (is_null()) return json();
-  if (array_) {
+  if (is_array()) {
     std::vector<json> res;
-    for (const auto& item : *array_) {
+    for_each([&](const Value & item) {
       res.push_back(item.get<json>());
-    }
+    });
     return res;
   }
   if (object_) {
@@ -607,17 +1131,23 @@ class Context : public std::enable_shared_from_this<Context> {
     }
     virtual ~Context() {}
 
-    static std::shared_ptr<Context> builtins();
+    /* Shared, read-only context of the builtin functions (built on first use). */
+    static const std::shared_ptr<Context> & builtins();
     static std::shared_ptr<Context> make(Value && values, const std::shared_ptr<Context> & parent = builtins());
 
     std::vector<Value> keys() {
         return values_.keys();
     }
+    /* Own variables (not the parent's) as they are now (see Value::snapshot). */
+    Value snapshot() const {
+        return values_.snapshot();
+    }
     virtual Value get(const Value & key) {
-        if (values_.contains(key)) return values_.at(key);
+        if (values_.contains(key)) return values_.get(key);
         if (parent_) return parent_->get(key);
         return Value();
     }
+    /* Storage slot of a variable, e.g. to write back a copy-on-write mutation. Prefer get() to read. */
     virtual Value & at(const Value & key) {
         if (values_.contains(key)) return values_.at(key);
         if (parent_) return parent_->at(key);
@@ -629,16 +1159,247 @@ class Context : public std::enable_shared_from_this<Context> {
         return false;
     }
     virtual void set(const Value & key, const Value & value) {
-        values_.set(key, value);
+        // Stored values outlive the expression: lazy sequences (which may hold on to this context) are stored evaluated.
+        values_.set(key, value.materialize());
+    }
+  private:
+    static std::shared_ptr<Context> make_builtins();
+};
+
+/* Read-only context holding the builtins: created once per process and referenced by every top-level context. */
+class BuiltinsContext : public Context {
+    std::unordered_map<std::string, Value> index_;
+  public:
+    BuiltinsContext(Value && values) : Context(std::move(values)) {
+        values_.freeze();
+        for (const auto & key : values_.keys()) {
+            index_.emplace(key.get<std::string>(), values_.get(key));
+        }
+    }
+    Value get(const Value & key) override {
+        if (!key.is_string()) return Value();
+        auto it = index_.find(key.get<std::string>());
+        return it == index_.end() ? Value() : it->second;
+    }
+    Value & at(const Value & key) override {
+        if (contains(key)) throw std::runtime_error("Cannot modify builtin " + key.dump());
+        throw std::runtime_error("Undefined variable: " + key.dump());
+    }
+    bool contains(const Value & key) override {
+        return key.is_string() && index_.find(key.get<std::string>()) != index_.end();
+    }
+    void set(const Value & key, const Value &) override {
+        throw std::runtime_error("Cannot modify builtin " + key.dump());
+    }
+};
+
+/* A render went over one of the limits of its RenderBudget. Passes through templates unchanged (not wrapped with locations). */
+class RenderLimitExceeded : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/*
+  Limits of one render, checked as it goes by loops, macro calls, range() and the nodes writing output (0: no limit).
+  Going over one throws RenderLimitExceeded.
+*/
+struct RenderBudget {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    size_t max_output = 0;  // Bytes written by text and expressions, including into {% set %} blocks and macro results
+    size_t max_steps = 0;  // Loop iterations, macro calls and items of range()
+    size_t max_depth = 0;  // Nesting of macro calls and of recursive loop() calls
+
+    size_t output = 0;
+    size_t steps = 0;
+    size_t depth = 0;
+
+    /* Starts (or with nullptr, stops) applying `budget` to what this thread renders; returns the previous budget. */
+    static RenderBudget * apply(RenderBudget * budget) {
+        std::swap(budget, current_);
+        return budget;
+    }
+    static RenderBudget * current() { return current_; }
+
+    static void step() {
+        if (!current_) return;
+        if (++current_->steps > current_->max_steps && current_->max_steps) {
+            throw RenderLimitExceeded("Render exceeded its limit of " + std::to_string(current_->max_steps) + " steps");
+        }
+        current_->tick();
+    }
+    static void wrote(size_t size) {
+        if (!current_) return;
+        if ((current_->output += size) > current_->max_output && current_->max_output) {
+            throw RenderLimitExceeded("Render exceeded its limit of " + std::to_string(current_->max_output) + " output bytes");
+        }
+        current_->tick();
+    }
+    /* Counts a nested call for as long as it lives. */
+    struct Call {
+        RenderBudget * budget = current_;
+        Call() {
+            if (!budget) return;
+            if (budget->depth + 1 > budget->max_depth && budget->max_depth) {
+                throw RenderLimitExceeded("Render exceeded its limit of " + std::to_string(budget->max_depth) + " nested calls");
+            }
+            budget->depth++;
+            step();
+        }
+        ~Call() { if (budget) budget->depth--; }
+    };
+
+private:
+    size_t ticks_ = 0;
+
+    // The clock is only read every few steps and writes.
+    void tick() {
+        if (++ticks_ % 64 == 0 && std::chrono::steady_clock::now() > deadline) {
+            throw RenderLimitExceeded("Render exceeded its time limit");
+        }
     }
+
+    static inline thread_local RenderBudget * current_ = nullptr;
 };
 
+/* Offset in the source of a template, which owns that source (see Parser::parse): copying a location is free. */
 struct Location {
-    std::shared_ptr<std::string> source;
+    const std::string * source;
     size_t pos;
 };
 
+class Expression;
+class TemplateNode;
+
+/*
+  Bump allocator for the nodes of one parsed template: they're packed in large blocks in parse order
+  (siblings and subtrees next to each other) instead of scattered over the heap, and all freed at once
+  when the last of them is. Allocation isn't thread-safe (a template is parsed by a single thread).
+*/
+class AstArena {
+    static constexpr size_t block_size = 16 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char * next_ = nullptr;
+    size_t left_ = 0;
+public:
+    std::shared_ptr<const std::string> source;  // That the locations and text spans of the nodes point into
+
+    void * allocate(size_t size, size_t align) {
+        auto pad = (align - (uintptr_t) next_ % align) % align;
+        if (!next_ || pad + size > left_) {
+            auto n = (std::max)(block_size, size + align);
+            blocks_.emplace_back(new char[n]);
+            next_ = blocks_.back().get();
+            left_ = n;
+            pad = (align - (uintptr_t) next_ % align) % align;
+        }
+        auto p = next_ + pad;
+        next_ = p + size;
+        left_ -= pad + size;
+        return p;
+    }
+};
+
+/*
+  Allocates from an AstArena (for std::allocate_shared); memory is only released with the arena. The copy kept in
+  each node's control block owns the arena, so any pointer to a node (not only the root) keeps its tree's memory.
+*/
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    std::shared_ptr<AstArena> arena;
+
+    explicit ArenaAllocator(std::shared_ptr<AstArena> arena) : arena(std::move(arena)) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> & other) : arena(other.arena) {}
+
+    T * allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> & other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> & other) const { return arena != other.arena; }
+};
+
+/* Node kinds of the compiled (serialized) form of a template. */
+enum class AstTag : uint8_t {
+    Null, Sequence, Text, Expression, If, LoopControl, For, Macro, Filter, Set, SetTemplate,
+    IfExpr, Literal, Array, Dict, Slice, Subscript, UnaryOp, BinaryOp, MethodCall, Call, FilterExpr, Variable,
+    Generation,
+};
+
+/* Writes a parsed template as a compact binary tree (see write_template / read_template). */
+class AstWriter {
+    std::string & out_;
+public:
+    explicit AstWriter(std::string & out) : out_(out) {}
+
+    void u8(uint8_t v) { out_.push_back((char) v); }
+    void varint(uint64_t v) {
+        while (v >= 0x80) {
+            u8((uint8_t) (v | 0x80));
+            v >>= 7;
+        }
+        u8((uint8_t) v);
+    }
+    void str(const std::string & v) {
+        varint(v.size());
+        out_.append(v);
+    }
+    void strs(const std::vector<std::string> & v) {
+        varint(v.size());
+        for (const auto & s : v) str(s);
+    }
+    void boolean(bool v) { u8(v ? 1 : 0); }
+    void value(const Value & v) { str(v.get<json>().dump()); }
+    void begin(AstTag tag, const Location & location) {
+        u8((uint8_t) tag);
+        varint(location.source ? location.pos + 1 : 0);
+    }
+    void expr(const std::shared_ptr<Expression> & e);
+    void node(const std::shared_ptr<TemplateNode> & n);
+};
+
+/* Receives the direct children of an expression or node (see visit_children), for static analyses of a tree. */
+class AstVisitor {
+public:
+    virtual ~AstVisitor() = default;
+    virtual void visit(const Expression &) {}
+    virtual void visit(const TemplateNode &) {}
+    /* Variable assigned by a node: set targets, loop variables, macro names and parameters. */
+    virtual void binds(const std::string &) {}
+
+    void expr(const std::shared_ptr<Expression> & e) { if (e) visit(*e); }
+    void node(const std::shared_ptr<TemplateNode> & n) { if (n) visit(*n); }
+};
+
+/*
+  Values of the loop-invariant expressions of the loops being rendered on this thread (see ForNode::analyze), each
+  evaluated the first time an iteration needs it. Frames of nested loops are chained, innermost first.
+*/
+class LoopInvariants {
+    static inline thread_local LoopInvariants * current_ = nullptr;
+    const void * loop_;
+    std::vector<std::optional<Value>> values_;
+    LoopInvariants * outer_;
+public:
+    LoopInvariants(const void * loop, size_t count) : loop_(loop), values_(count), outer_(current_) { current_ = this; }
+    ~LoopInvariants() { current_ = outer_; }
+    LoopInvariants(const LoopInvariants &) = delete;
+    LoopInvariants & operator=(const LoopInvariants &) = delete;
+
+    /* Slot of an invariant of `loop` in its innermost render on this thread, null if it isn't being rendered. */
+    static std::optional<Value> * find(const void * loop, size_t slot) {
+        for (auto frame = current_; frame; frame = frame->outer_) {
+            if (frame->loop_ == loop) return &frame->values_[slot];
+        }
+        return nullptr;
+    }
+};
+
 class Expression {
+    mutable const void * invariant_loop_ = nullptr;  // Loop this expression is invariant in (see set_invariant)
+    mutable size_t invariant_slot_ = 0;
 protected:
     virtual Value do_evaluate(const std::shared_ptr<Context> & context) const = 0;
 public:
@@ -649,9 +1410,37 @@ public:
     Expression(const Location & location) : location(location) {}
     virtual ~Expression() = default;
 
+    /* Storage this expression designates (a variable or a subscript of one), if any: where in-place mutations of frozen data are written back. */
+    virtual Value * lvalue(const std::shared_ptr<Context> &) const { return nullptr; }
+
+    virtual void serialize(AstWriter &) const {
+        throw std::runtime_error("Expression cannot be serialized");
+    }
+    virtual void visit_children(AstVisitor &) const {}
+
     Value evaluate(const std::shared_ptr<Context> & context) const {
+        if (invariant_loop_) {
+            if (auto value = LoopInvariants::find(invariant_loop_, invariant_slot_)) {
+                if (!*value) *value = located([&]() { return do_evaluate(context); });
+                return **value;
+            }
+        }
+        return located([&]() { return do_evaluate(context); });
+    }
+    /* Marks this expression as evaluating to the same value in all the iterations of `loop`, which share it in `slot`. */
+    void set_invariant(const void * loop, size_t slot) const {
+        invariant_loop_ = loop;
+        invariant_slot_ = slot;
+    }
+    /* Whether this expression was marked invariant in a loop (see set_invariant). */
+    bool is_invariant() const { return invariant_loop_ != nullptr; }
+    /* Runs `fn`, adding the location of this expression to the errors it throws. */
+    template <typename F>
+    auto located(const F & fn) const -> decltype(fn()) {
         try {
-            return do_evaluate(context);
+            return fn();
+        } catch (const RenderLimitExceeded &) {
+            throw;
         } catch (const std::exception & e) {
             std::ostringstream out;
             out << e.what();
@@ -668,14 +1457,19 @@ public:
       : Expression(location), name(n) {}
     std::string get_name() const { return name; }
     Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        if (!context->contains(name)) {
-            return Value();
-        }
-        return context->at(name);
+        return context->get(name);
+    }
+    Value * lvalue(const std::shared_ptr<Context> & context) const override {
+        if (!context->contains(name)) return nullptr;
+        return &context->at(name);
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Variable, location);
+        w.str(name);
     }
 };
 
-static void destructuring_assign(const std::vector<std::string> & var_names, const std::shared_ptr<Context> & context, Value& item) {
+static void destructuring_assign(const std::vector<std::string> & var_names, const std::shared_ptr<Context> & context, const Value& item) {
   if (var_names.size() == 1) {
       Value name(var_names[0]);
       context->set(name, item);
@@ -730,8 +1524,8 @@ public:
 };
 
 struct TextTemplateToken : public TemplateToken {
-    std::string text;
-    TextTemplateToken(const Location & location, SpaceHandling pre, SpaceHandling post, const std::string& t) : TemplateToken(Type::Text, location, pre, post), text(t) {}
+    std::string_view text;  // Span of the template source.
+    TextTemplateToken(const Location & location, SpaceHandling pre, SpaceHandling post, std::string_view t) : TemplateToken(Type::Text, location, pre, post), text(t) {}
 };
 
 struct ExpressionTemplateToken : public TemplateToken {
@@ -833,6 +1627,51 @@ struct LoopControlTemplateToken : public TemplateToken {
     LoopControlTemplateToken(const Location & location, SpaceHandling pre, SpaceHandling post, LoopControlType control_type) : TemplateToken(Type::Break, location, pre, post), control_type(control_type) {}
 };
 
+/*
+  Byte ranges of the output of {% generation %} blocks and of the iterations of the outermost loops, recorded while
+  rendering to one stream (e.g. to mask the assistant turns of a rendered conversation without parsing it again).
+*/
+struct OutputSpans {
+    struct Span {
+        size_t start;
+        size_t end;
+    };
+    struct Loop {
+        size_t line;  // Of the {% for %} in the template
+        std::vector<Span> iterations;
+    };
+
+    const std::ostringstream * out;
+    std::vector<Span> generations;  // In order of their starts
+    std::vector<Loop> loops;
+    size_t loop_depth = 0;
+
+    /* Starts (or with nullptr, stops) recording the spans of the output rendered to spans->out on this thread; returns the previous recorder. */
+    static OutputSpans * record(OutputSpans * spans) {
+        std::swap(spans, current_);
+        return spans;
+    }
+    /* Recorder of `out` on this thread, if any. */
+    static OutputSpans * of(const std::ostringstream & out) {
+        return current_ && current_->out == &out ? current_ : nullptr;
+    }
+
+    /* {"generation": [[start, end], ...], "loops": [{"line": 3, "iterations": [[start, end], ...]}, ...]} */
+    json to_json() const {
+        auto pairs = [](const std::vector<Span> & spans) {
+            auto result = json::array();
+            for (const auto & span : spans) result.push_back({span.start, span.end});
+            return result;
+        };
+        auto loops_json = json::array();
+        for (const auto & loop : loops) loops_json.push_back({{"line", loop.line}, {"iterations", pairs(loop.iterations)}});
+        return {{"generation", pairs(generations)}, {"loops", std::move(loops_json)}};
+    }
+
+private:
+    static inline thread_local OutputSpans * current_ = nullptr;
+};
+
 class TemplateNode {
     Location location_;
 protected:
@@ -841,6 +1680,7 @@ protected:
 public:
     TemplateNode(const Location & location) : location_(location) {}
     void render(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
+        Value::CopyScope copies;  // Of the whole render, if this is its root
         try {
             do_render(out, context);
         } catch (const LoopControlException & e) {
@@ -849,6 +1689,8 @@ public:
             err << e.what();
             if (location_.source) err << error_location_suffix(*location_.source, location_.pos);
             throw LoopControlException(err.str(), e.control_type);
+        } catch (const RenderLimitExceeded &) {
+            throw;
         } catch (const std::exception & e) {
             std::ostringstream err;
             err << e.what();
@@ -858,6 +1700,10 @@ public:
     }
     const Location & location() const { return location_; }
     virtual ~TemplateNode() = default;
+    virtual void serialize(AstWriter &) const {
+        throw std::runtime_error("Template node cannot be serialized");
+    }
+    virtual void visit_children(AstVisitor &) const {}
     std::string render(const std::shared_ptr<Context> & context) const {
         std::ostringstream out;
         render(out, context);
@@ -873,32 +1719,133 @@ public:
     void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
         for (const auto& child : children) child->render(out, context);
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Sequence, location());
+        w.varint(children.size());
+        for (const auto& child : children) w.node(child);
+    }
+    void visit_children(AstVisitor & v) const override {
+        for (const auto& child : children) v.node(child);
+    }
+    const std::vector<std::shared_ptr<TemplateNode>> & get_children() const { return children; }
 };
 
-class TextNode : public TemplateNode {
-    std::string text;
+/* {% generation %}: renders its body, and records its span when the output spans are recorded (see OutputSpans). */
+class GenerationNode : public TemplateNode {
+    std::shared_ptr<TemplateNode> body;
 public:
-    TextNode(const Location & location, const std::string& t) : TemplateNode(location), text(t) {}
-    void do_render(std::ostringstream & out, const std::shared_ptr<Context> &) const override {
-      out << text;
+    GenerationNode(const Location & location, std::shared_ptr<TemplateNode> && b)
+      : TemplateNode(location), body(std::move(b)) {}
+    void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+        if (!body) throw std::runtime_error("GenerationNode.body is null");
+        auto spans = OutputSpans::of(out);
+        if (!spans) {
+            body->render(out, context);
+            return;
+        }
+        auto index = spans->generations.size();
+        spans->generations.push_back({(size_t) out.tellp(), 0});
+        try {
+            body->render(out, context);
+        } catch (const LoopControlException &) {
+            spans->generations[index].end = out.tellp();
+            throw;
+        }
+        spans->generations[index].end = out.tellp();
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Generation, location());
+        w.node(body);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.node(body);
     }
 };
 
-class ExpressionNode : public TemplateNode {
+class TextNode : public TemplateNode {
+    std::string owned_;  // Only used for text that isn't a span of the template source.
+    std::string_view text_;
+    bool is_span_;
+public:
+    TextNode(const Location & location, std::string text)
+      : TemplateNode(location), owned_(std::move(text)), text_(owned_), is_span_(false) {}
+    /* Text at [pos, pos + size) in the template source (location.source), without copying it. */
+    TextNode(const Location & location, size_t pos, size_t size)
+      : TemplateNode(location), text_(location.source->data() + pos, size), is_span_(true) {}
+    TextNode(const TextNode &) = delete;
+    TextNode & operator=(const TextNode &) = delete;
+
+    /* TextNodes rendered straight to one stream, with their offsets in it, in order (see record_text). */
+    struct TextOffsets {
+        const std::ostringstream * out;
+        std::vector<std::pair<const TextNode *, size_t>> offsets;
+    };
+private:
+    static inline thread_local TextOffsets * text_offsets_ = nullptr;
+public:
+    /* Starts (or with nullptr, stops) recording the TextNodes rendered to offsets->out on this thread; returns the previous recorder. */
+    static TextOffsets * record_text(TextOffsets * offsets) {
+        std::swap(offsets, text_offsets_);
+        return offsets;
+    }
+    static bool records_text(const std::ostringstream & out) { return text_offsets_ && text_offsets_->out == &out; }
+
+    std::string_view get_text() const { return text_; }
+
+    void do_render(std::ostringstream & out, const std::shared_ptr<Context> &) const override {
+      if (records_text(out) && !text_.empty()) {
+        text_offsets_->offsets.emplace_back(this, static_cast<size_t>(out.tellp()));
+      }
+      RenderBudget::wrote(text_.size());
+      out << text_;
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Text, location());
+        w.boolean(is_span_);
+        if (is_span_) {
+            w.varint(text_.data() - location().source->data());
+            w.varint(text_.size());
+        } else {
+            w.str(owned_);
+        }
+    }
+};
+
+class ExpressionNode : public TemplateNode {
     std::shared_ptr<Expression> expr;
 public:
     ExpressionNode(const Location & location, std::shared_ptr<Expression> && e) : TemplateNode(location), expr(std::move(e)) {}
     void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
       if (!expr) throw std::runtime_error("ExpressionNode.expr is null");
-      auto result = expr->evaluate(context);
+      if (render_macro_call(out, context) || render_json(out, context)) return;
+      write(out, expr->evaluate(context));
+  }
+  /* Writes the value of an expression: strings as they are, other values serialized straight into `out`. */
+  static void write(std::ostringstream & out, const Value & result) {
       if (result.is_string()) {
-          out << result.get<std::string>();
+          auto text = result.get<std::string>();
+          RenderBudget::wrote(text.size());
+          out << text;
       } else if (result.is_boolean()) {
+          RenderBudget::wrote(result.get<bool>() ? 4 : 5);
           out << (result.get<bool>() ? "True" : "False");
       } else if (!result.is_null()) {
-          out << result.dump();
+          auto start = out.tellp();
+          result.dump(out);
+          RenderBudget::wrote(out.tellp() - start);
       }
   }
+  /* Renders {{ macro(...) }} straight into `out`, rather than into a string to write. Returns false for other expressions. */
+  bool render_macro_call(std::ostringstream & out, const std::shared_ptr<Context> & context) const;
+  /* Serializes {{ value | tojson }} straight into `out`, rather than into a string to write. Returns false for other expressions. */
+  bool render_json(std::ostringstream & out, const std::shared_ptr<Context> & context) const;
+  void serialize(AstWriter & w) const override {
+      w.begin(AstTag::Expression, location());
+      w.expr(expr);
+  }
+  void visit_children(AstVisitor & v) const override {
+      v.expr(expr);
+  }
 };
 
 class IfNode : public TemplateNode {
@@ -919,6 +1866,20 @@ public:
           }
       }
     }
+    void serialize(AstWriter & w) const override {
+      w.begin(AstTag::If, location());
+      w.varint(cascade.size());
+      for (const auto& branch : cascade) {
+          w.expr(branch.first);
+          w.node(branch.second);
+      }
+    }
+    void visit_children(AstVisitor & v) const override {
+      for (const auto& branch : cascade) {
+          v.expr(branch.first);
+          v.node(branch.second);
+      }
+    }
 };
 
 class LoopControlNode : public TemplateNode {
@@ -928,6 +1889,11 @@ class LoopControlNode : public TemplateNode {
     void do_render(std::ostringstream &, const std::shared_ptr<Context> &) const override {
       throw LoopControlException(control_type_);
     }
+    LoopControlType get_control_type() const { return control_type_; }
+    void serialize(AstWriter & w) const override {
+      w.begin(AstTag::LoopControl, location());
+      w.u8((uint8_t) control_type_);
+    }
 };
 
 class ForNode : public TemplateNode {
@@ -937,41 +1903,135 @@ class ForNode : public TemplateNode {
     std::shared_ptr<TemplateNode> body;
     bool recursive;
     std::shared_ptr<TemplateNode> else_body;
+    bool parallel_ = false;  // Whether iterations can render concurrently (see analyze)
+    size_t invariants_ = 0;  // Number of expressions of the body evaluated once per render of the loop (see analyze)
+    bool counts_ = true;  // Whether the body may read the number of items (loop.length, loop.last...: see analyze)
+    std::vector<std::string> free_names_;  // Read by the body from enclosing scopes: mustn't be macros for the above
+
+    static inline std::atomic<size_t> parallel_min_items_ { 0 };
+    static inline std::atomic<unsigned> parallel_threads_ { 0 };
+    static inline thread_local bool in_parallel_loop_ = false;
+
+    void analyze();
+    bool calls_builtins_only(const std::shared_ptr<Context> & context) const;
+    bool render_parallel(std::ostringstream & out, const std::shared_ptr<Context> & context, const Value & items, size_t n) const;
+
+    static constexpr size_t unknown_length = (std::numeric_limits<size_t>::max)();
+
+    /* Sets the attributes of `loop` for item `i` of `n` (those derived from `n` are left out if it's unknown_length). */
+    static void set_loop_item(Value & loop, size_t i, size_t n, const Value & previous, const Value & next) {
+      loop.set("index", (int64_t) i + 1);
+      loop.set("index0", (int64_t) i);
+      if (n != unknown_length) {
+        loop.set("revindex", (int64_t) (n - i));
+        loop.set("revindex0", (int64_t) (n - i - 1));
+        loop.set("length", (int64_t) n);
+        loop.set("last", i == (n - 1));
+      }
+      loop.set("first", i == 0);
+      loop.set("previtem", previous);
+      loop.set("nextitem", next);
+    }
 public:
     ForNode(const Location & location, std::vector<std::string> && var_names, std::shared_ptr<Expression> && iterable,
       std::shared_ptr<Expression> && condition, std::shared_ptr<TemplateNode> && body, bool recursive, std::shared_ptr<TemplateNode> && else_body)
-            : TemplateNode(location), var_names(var_names), iterable(std::move(iterable)), condition(std::move(condition)), body(std::move(body)), recursive(recursive), else_body(std::move(else_body)) {}
+            : TemplateNode(location), var_names(var_names), iterable(std::move(iterable)), condition(std::move(condition)), body(std::move(body)), recursive(recursive), else_body(std::move(else_body)) {
+      analyze();
+    }
+
+    /*
+      Renders the iterations of loops over at least `min_items` items on up to `threads` threads (0: one per core), each
+      into its own buffer, when nothing in their body depends on the order they run in (see analyze).
+      0 items (the default) turns it off. Applies to all renders of the process, which share the threads (see LoopThreads).
+    */
+    static void set_parallel(size_t min_items, unsigned threads = 0) {
+      parallel_min_items_ = min_items;
+      parallel_threads_ = threads;
+    }
+
+    /* State of a loop before one of its items, to resume it there (see render_loop). */
+    struct LoopState {
+      size_t index = 0;
+      size_t cycle_index = 0;  // Position of loop.cycle()
+      Value locals = Value::object();  // Variables of the loop's scope (Value::snapshot)
+    };
+    /* Called before rendering each item; `save` returns the state of the loop at that point. */
+    using ItemCallback = std::function<void(size_t index, size_t length, const std::function<LoopState()> & save)>;
 
     void do_render(std::ostringstream & out, const std::shared_ptr<Context> & context) const override {
+      render_loop(out, context, nullptr, nullptr);
+    }
+
+    /*
+      Renders the loop, starting from the item of `resume` (in the state saved there by `on_item`, during an earlier
+      render of the same loop over the same leading items) if it isn't null.
+    */
+    void render_loop(std::ostringstream & out, const std::shared_ptr<Context> & context, const LoopState * resume, const ItemCallback & on_item) const {
       // https://jinja.palletsprojects.com/en/3.0.x/templates/#for
       if (!iterable) throw std::runtime_error("ForNode.iterable is null");
       if (!body) throw std::runtime_error("ForNode.body is null");
 
       auto iterable_value = iterable->evaluate(context);
       Value::CallableType loop_function;
-
-      std::function<void(Value&)> visit = [&](Value& iter) {
-          auto filtered_items = Value::array();
-          if (!iter.is_null()) {
-            if (!iterable_value.is_iterable()) {
-              throw std::runtime_error("For loop iterable must be iterable: " + iterable_value.dump());
-            }
-            iterable_value.for_each([&](Value & item) {
+      std::optional<LoopInvariants> invariants;
+      if (invariants_ && calls_builtins_only(context)) invariants.emplace(this, invariants_);
+
+      // Iterations of outermost loops are recorded, not those of loops within them.
+      auto spans = OutputSpans::of(out);
+      auto outermost = spans && spans->loop_depth == 0;
+      if (outermost) {
+        auto source = location().source;
+        spans->loops.push_back({source ? (size_t) std::count(source->begin(), source->begin() + location().pos, '\n') + 1 : 0, {}});
+      }
+      auto spans_loop = outermost ? spans->loops.size() - 1 : 0;
+      struct Depth {
+        OutputSpans * spans;
+        Depth(OutputSpans * spans) : spans(spans) { if (spans) spans->loop_depth++; }
+        ~Depth() { if (spans) spans->loop_depth--; }
+      } depth(spans);
+
+      // Only the outer loop resumes and reports its items (not the nested calls of a recursive loop).
+      std::function<void(Value&, const LoopState *, const ItemCallback *)> visit = [&](Value& iter, const LoopState * resume, const ItemCallback * on_item) {
+          if (!iter.is_null() && !iterable_value.is_iterable()) {
+            throw std::runtime_error("For loop iterable must be iterable: " + iterable_value.dump());
+          }
+          // Items are streamed (lazy sequences aren't stored) unless a condition filters them or their count is needed.
+          Value items;
+          if (iter.is_null()) {
+            items = Value::array();
+          } else if (condition) {
+            items = Value::array();
+            iterable_value.for_each([&](const Value & item) {
                 destructuring_assign(var_names, context, item);
-                if (!condition || condition->evaluate(context).to_bool()) {
-                  filtered_items.push_back(item);
+                if (condition->evaluate(context).to_bool()) {
+                  items.push_back(item);
                 }
             });
+          } else if (iterable_value.is_frozen() || iterable_value.is_string()) {
+            items = iterable_value;  // Lazy sequences and frozen data can't change under the loop
+          } else {
+            // The body may mutate the array / object it iterates: loop over a copy of its items.
+            items = Value::array();
+            iterable_value.for_each([&](const Value & item) { items.push_back(item); });
           }
-          if (filtered_items.empty()) {
+          // Counting a lazy sequence runs it (with the tests of a select / reject): when the length is needed, its items are
+          // stored by that pass and rendered from there. Otherwise they're streamed, and the length is left unknown.
+          if (!items.size_known() && (counts_ || resume || (on_item && *on_item) || (parallel_ && parallel_min_items_.load()))) {
+            items = items.materialize();
+          }
+          auto n = items.size_known() ? items.size() : unknown_length;
+          size_t start = resume ? resume->index : 0;
+          if (start > 0 && start >= n) throw std::runtime_error("Cannot resume a loop of " + std::to_string(n) + " items at item " + std::to_string(start));
+          if (n == 0) {
             if (else_body) {
               else_body->render(out, context);
             }
-          } else {
+          } else if (start > 0 || (on_item && *on_item) || n == unknown_length || !render_parallel(out, context, items, n)) {
+              // In order on this thread: resumed or reported loops, and those that don't render in parallel.
               auto loop = recursive ? Value::callable(loop_function) : Value::object();
-              loop.set("length", (int64_t) filtered_items.size());
+              if (n != unknown_length) loop.set("length", (int64_t) n);
 
-              size_t cycle_index = 0;
+              size_t cycle_index = resume ? resume->cycle_index : 0;
               loop.set("cycle", Value::callable([&](const std::shared_ptr<Context> &, ArgumentsValue & args) {
                   if (args.args.empty() || !args.kwargs.empty()) {
                       throw std::runtime_error("cycle() expects at least 1 positional argument and no named arg");
@@ -980,27 +2040,47 @@ public:
                   cycle_index = (cycle_index + 1) % args.args.size();
                   return item;
               }));
-              auto loop_context = Context::make(Value::object(), context);
+              auto loop_context = Context::make(resume ? resume->locals.snapshot() : Value::object(), context);
               loop_context->set("loop", loop);
-              for (size_t i = 0, n = filtered_items.size(); i < n; ++i) {
-                  auto & item = filtered_items.at(i);
-                  destructuring_assign(var_names, loop_context, item);
-                  loop.set("index", (int64_t) i + 1);
-                  loop.set("index0", (int64_t) i);
-                  loop.set("revindex", (int64_t) (n - i));
-                  loop.set("revindex0", (int64_t) (n - i - 1));
-                  loop.set("length", (int64_t) n);
-                  loop.set("first", i == 0);
-                  loop.set("last", i == (n - 1));
-                  loop.set("previtem", i > 0 ? filtered_items.at(i - 1) : Value());
-                  loop.set("nextitem", i < n - 1 ? filtered_items.at(i + 1) : Value());
+
+              // Renders the pending item once the next one (loop.nextitem) is known; returns false on break.
+              size_t i = start, skipped = 0;
+              Value previous, current;
+              bool has_current = false;
+              auto render_current = [&](const Value & next) {
+                  if (on_item && *on_item) {
+                      (*on_item)(i, n, [&]() { return LoopState { i, cycle_index, loop_context->snapshot() }; });
+                  }
+                  RenderBudget::step();
+                  destructuring_assign(var_names, loop_context, current);
+                  set_loop_item(loop, i, n, previous, next);
+                  ++i;
+                  previous = std::move(current);
+                  auto record = outermost && on_item;  // Not the nested calls of a recursive loop
+                  if (record) spans->loops[spans_loop].iterations.push_back({(size_t) out.tellp(), 0});
+                  bool more = true;
                   try {
                       body->render(out, loop_context);
                   } catch (const LoopControlException & e) {
-                      if (e.control_type == LoopControlType::Break) break;
-                      if (e.control_type == LoopControlType::Continue) continue;
+                      more = e.control_type != LoopControlType::Break;
                   }
-              }
+                  if (record) spans->loops[spans_loop].iterations.back().end = out.tellp();
+                  return more;
+              };
+              auto complete = items.iterate([&](const Value & item) {
+                  if (skipped < start) {
+                      // Already rendered before the resume point: only needed as loop.previtem.
+                      ++skipped;
+                      previous = item;
+                      return true;
+                  }
+                  if (has_current && !render_current(item)) return false;
+                  current = item;
+                  has_current = true;
+                  return true;
+              });
+              if (complete && has_current) render_current(Value());
+              if (!has_current && n == unknown_length && else_body) else_body->render(out, context);
           }
       };
 
@@ -1010,12 +2090,37 @@ public:
                 throw std::runtime_error("loop() expects exactly 1 positional iterable argument");
             }
             auto & items = args.args[0];
-            visit(items);
+            RenderBudget::Call call;
+            visit(items, nullptr, nullptr);
             return Value();
         };
       }
 
-      visit(iterable_value);
+      visit(iterable_value, resume, &on_item);
+  }
+
+  const std::vector<std::string> & get_var_names() const { return var_names; }
+  const std::shared_ptr<Expression> & get_iterable() const { return iterable; }
+  const std::shared_ptr<Expression> & get_condition() const { return condition; }
+  const std::shared_ptr<TemplateNode> & get_body() const { return body; }
+  const std::shared_ptr<TemplateNode> & get_else_body() const { return else_body; }
+  bool is_recursive() const { return recursive; }
+
+  void serialize(AstWriter & w) const override {
+      w.begin(AstTag::For, location());
+      w.strs(var_names);
+      w.expr(iterable);
+      w.expr(condition);
+      w.node(body);
+      w.boolean(recursive);
+      w.node(else_body);
+  }
+  void visit_children(AstVisitor & v) const override {
+      for (const auto & var_name : var_names) v.binds(var_name);
+      v.expr(iterable);
+      v.expr(condition);
+      v.node(body);
+      v.node(else_body);
   }
 };
 
@@ -1024,47 +2129,176 @@ class MacroNode : public TemplateNode {
     Expression::Parameters params;
     std::shared_ptr<TemplateNode> body;
     std::unordered_map<std::string, size_t> named_param_positions;
+    std::vector<Value> param_keys_;  // Names of the parameters, as variables of a call's frame
+    std::vector<std::optional<Value>> constant_defaults_;  // Default values that are literals
+    bool pure_ = false;  // Whether calls with the same arguments render the same text (see memo_key)
+    std::vector<std::string> free_names_;  // Read by the body from the scope it was defined in
 public:
-    MacroNode(const Location & location, std::shared_ptr<VariableExpr> && n, Expression::Parameters && p, std::shared_ptr<TemplateNode> && b)
-        : TemplateNode(location), name(std::move(n)), params(std::move(p)), body(std::move(b)) {
-        for (size_t i = 0; i < params.size(); ++i) {
-          const auto & name = params[i].first;
-          if (!name.empty()) {
-            named_param_positions[name] = i;
-          }
+    MacroNode(const Location & location, std::shared_ptr<VariableExpr> && n, Expression::Parameters && p, std::shared_ptr<TemplateNode> && b);
+
+    /* Results of the calls of a pure macro during one render, by arguments (see memo_key). */
+    struct Memo {
+        static constexpr size_t max_size = 16 << 20;  // Bytes of results kept, beyond which calls are rendered again
+
+        std::mutex mutex;
+        std::unordered_map<std::string, std::string> results;
+        size_t size = 0;
+        std::vector<std::shared_ptr<const json>> sources;  // Keyed by address (see memo_key): kept alive
+    };
+
+    /*
+      A macro as a value. Each call renders the body in a frame of its own, holding the parameters, whose parent is the
+      scope the macro was defined in: calls don't see each other's variables, and can run on several threads at once.
+      The render keeps that scope alive (see Value::keep_alive), so the macro can be called after it ended (e.g. when
+      stored in a namespace from a loop), until the end of the render.
+    */
+    struct Call {
+        const MacroNode * node;
+        std::weak_ptr<Context> scope;  // Which holds this value: not owned, to avoid a cycle
+        std::shared_ptr<Memo> memo;  // Null if the macro isn't pure
+
+        Value operator()(const std::shared_ptr<Context> &, ArgumentsValue & args) const {
+            std::ostringstream out;
+            render(out, args);
+            return out.str();
         }
-    }
+        /* Renders the call into `out` (e.g. straight into the output, for {{ macro(...) }}). */
+        void render(std::ostringstream & out, ArgumentsValue & args) const {
+            auto defining_scope = scope.lock();
+            if (!defining_scope) throw std::runtime_error("Macro " + node->get_name() + " called after the end of the render it was defined in");
+            node->render_call(out, defining_scope, memo.get(), args);
+        }
+    };
+
     void do_render(std::ostringstream &, const std::shared_ptr<Context> & macro_context) const override {
         if (!name) throw std::runtime_error("MacroNode.name is null");
         if (!body) throw std::runtime_error("MacroNode.body is null");
-        auto callable = Value::callable([&](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
-            auto call_context = macro_context;
-            std::vector<bool> param_set(params.size(), false);
-            for (size_t i = 0, n = args.args.size(); i < n; i++) {
-                auto & arg = args.args[i];
-                if (i >= params.size()) throw std::runtime_error("Too many positional arguments for macro " + name->get_name());
-                param_set[i] = true;
-                auto & param_name = params[i].first;
-                call_context->set(param_name, arg);
-            }
-            for (auto & [arg_name, value] : args.kwargs) {
-                auto it = named_param_positions.find(arg_name);
-                if (it == named_param_positions.end()) throw std::runtime_error("Unknown parameter name for macro " + name->get_name() + ": " + arg_name);
-
-                call_context->set(arg_name, value);
-                param_set[it->second] = true;
-            }
-            // Set default values for parameters that were not passed
-            for (size_t i = 0, n = params.size(); i < n; i++) {
-                if (!param_set[i] && params[i].second != nullptr) {
-                    auto val = params[i].second->evaluate(context);
-                    call_context->set(params[i].first, val);
+        Value::keep_alive(macro_context);
+        macro_context->set(name->get_name(), Value::callable(Call { this, macro_context, pure_ ? std::make_shared<Memo>() : nullptr }));
+    }
+    void render_call(std::ostringstream & out, const std::shared_ptr<Context> & scope, Memo * memo, ArgumentsValue & args) const {
+        RenderBudget::Call call;
+        std::vector<std::optional<Value>> values(params.size());
+        for (size_t i = 0, n = args.args.size(); i < n; i++) {
+            if (i >= params.size()) throw std::runtime_error("Too many positional arguments for macro " + name->get_name());
+            values[i] = args.args[i];
+        }
+        for (auto & [arg_name, value] : args.kwargs) {
+            auto it = named_param_positions.find(arg_name);
+            if (it == named_param_positions.end()) throw std::runtime_error("Unknown parameter name for macro " + name->get_name() + ": " + arg_name);
+            values[it->second] = value;
+        }
+        // Set default values for parameters that were not passed, in order: a default sees the parameters before it
+        auto frame = Context::make(Value::object(), scope);
+        for (size_t i = 0, n = params.size(); i < n; i++) {
+            if (!values[i]) {
+                if (constant_defaults_[i]) {
+                    values[i] = constant_defaults_[i];
+                } else if (params[i].second) {
+                    values[i] = params[i].second->evaluate(frame);
                 }
             }
-            return body->render(call_context);
-        });
-        macro_context->set(name->get_name(), callable);
+            if (values[i]) frame->set(param_keys_[i], *values[i]);
+        }
+        // Recorders see the reads and the output of each call. Once the render copied JSON data to mutate it, a JSON
+        // argument's address no longer tells what its nested containers hold (see Value::unshare).
+        std::string key;
+        std::vector<std::shared_ptr<const json>> sources;
+        if (!memo || Value::copied_any() || Value::records_json_reads() || TextNode::records_text(out) || OutputSpans::of(out) || !memo_key(scope, values, key, sources)) {
+            body->render(out, frame);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(memo->mutex);
+            auto it = memo->results.find(key);
+            if (it != memo->results.end()) {
+                RenderBudget::wrote(it->second.size());
+                out << it->second;
+                return;
+            }
+        }
+        std::ostringstream result_out;
+        body->render(result_out, frame);
+        auto result = result_out.str();
+        out << result;
+        std::lock_guard<std::mutex> lock(memo->mutex);
+        if (memo->size + key.size() + result.size() <= Memo::max_size) {
+            memo->size += key.size() + result.size();
+            memo->results.emplace(std::move(key), std::move(result));
+            memo->sources.insert(memo->sources.end(), sources.begin(), sources.end());
+        }
     }
+    /*
+      Key of the result of a call with these parameter values, unless it can't be memoized: the body is pure, so it only
+      depends on them and on the variables it reads from the defining scope, which must be builtins, this macro, or
+      scalars (keyed too).
+    */
+    bool memo_key(const std::shared_ptr<Context> & scope, const std::vector<std::optional<Value>> & values, std::string & key,
+                  std::vector<std::shared_ptr<const json>> & sources) const {
+        // Scalars are written as a tag and their value (strings prefixed with their size), JSON data as the address of
+        // its (immutable) source, other values as their dump.
+        auto append = [&](const Value & value) {
+            if (value.is_string()) {
+                const auto & text = value.get<std::string>();
+                key += 's';
+                key += std::to_string(text.size());
+                key += ':';
+                key += text;
+            } else if (value.is_number_integer()) {
+                key += 'i';
+                key += std::to_string(value.get<int64_t>());
+            } else if (value.is_primitive()) {
+                key += 'p';
+                key += value.dump();
+            } else if (auto source = value.json_source()) {
+                key += 'j';
+                key += std::to_string(reinterpret_cast<uintptr_t>(source.get()));
+                sources.push_back(std::move(source));
+            } else {
+                key += 'v';
+                key += value.dump();  // Throws on callables
+            }
+            key += ',';
+        };
+        try {
+            for (const auto & value : values) {
+                if (value) append(*value);
+                else key += "u,";  // Undefined
+            }
+            for (const auto & free_name : free_names_) {
+                auto value = scope->get(free_name);
+                if (value.is_callable()) {
+                    auto macro = value.callable_target<Call>();
+                    if ((macro && macro->node == this) || value == Context::builtins()->get(free_name)) continue;
+                    return false;
+                }
+                if (!value.is_primitive()) return false;
+                append(value);
+            }
+        } catch (const std::exception &) {
+            return false;  // Holds callables
+        }
+        return true;
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Macro, location());
+        w.expr(name);
+        w.varint(params.size());
+        for (const auto & [param_name, default_value] : params) {
+            w.str(param_name);
+            w.expr(default_value);
+        }
+        w.node(body);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.binds(name->get_name());
+        for (const auto & [param_name, default_value] : params) {
+            v.binds(param_name);
+            v.expr(default_value);
+        }
+        v.node(body);
+    }
+    std::string get_name() const { return name->get_name(); }
 };
 
 class FilterNode : public TemplateNode {
@@ -1085,8 +2319,18 @@ public:
         std::string rendered_body = body->render(context);
 
         ArgumentsValue filter_args = {{Value(rendered_body)}, {}};
-        auto result = filter_value.call(context, filter_args);
-        out << result.to_str();
+        auto result = filter_value.call(context, filter_args).to_str();
+        RenderBudget::wrote(result.size());
+        out << result;
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Filter, location());
+        w.expr(filter);
+        w.node(body);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(filter);
+        v.node(body);
     }
 };
 
@@ -1106,12 +2350,29 @@ public:
         auto & name = var_names[0];
         auto ns_value = context->get(ns);
         if (!ns_value.is_object()) throw std::runtime_error("Namespace '" + ns + "' is not an object");
-        ns_value.set(name, this->value->evaluate(context));
+        auto val = this->value->evaluate(context);
+        // A frozen object is copied on write: store the copy back in the variable itself.
+        (ns_value.is_frozen() ? context->at(ns) : ns_value).set(name, val.materialize());
       } else {
         auto val = value->evaluate(context);
         destructuring_assign(var_names, context, val);
       }
     }
+    const std::string & get_ns() const { return ns; }
+    void serialize(AstWriter & w) const override {
+      w.begin(AstTag::Set, location());
+      w.str(ns);
+      w.strs(var_names);
+      w.expr(value);
+    }
+    void visit_children(AstVisitor & v) const override {
+      if (ns.empty()) {
+        for (const auto & var_name : var_names) v.binds(var_name);
+      } else {
+        v.binds(ns);
+      }
+      v.expr(value);
+    }
 };
 
 class SetTemplateNode : public TemplateNode {
@@ -1125,6 +2386,15 @@ public:
       Value value { template_value->render(context) };
       context->set(name, value);
     }
+    void serialize(AstWriter & w) const override {
+      w.begin(AstTag::SetTemplate, location());
+      w.str(name);
+      w.node(template_value);
+    }
+    void visit_children(AstVisitor & v) const override {
+      v.binds(name);
+      v.node(template_value);
+    }
 };
 
 class IfExpr : public Expression {
@@ -1145,6 +2415,17 @@ public:
       }
       return nullptr;
     }
+    void serialize(AstWriter & w) const override {
+      w.begin(AstTag::IfExpr, location);
+      w.expr(condition);
+      w.expr(then_expr);
+      w.expr(else_expr);
+    }
+    void visit_children(AstVisitor & v) const override {
+      v.expr(condition);
+      v.expr(then_expr);
+      v.expr(else_expr);
+    }
 };
 
 class LiteralExpr : public Expression {
@@ -1153,6 +2434,11 @@ public:
     LiteralExpr(const Location & location, const Value& v)
       : Expression(location), value(v) {}
     Value do_evaluate(const std::shared_ptr<Context> &) const override { return value; }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Literal, location);
+        w.value(value);
+    }
+    const Value & get_value() const { return value; }
 };
 
 class ArrayExpr : public Expression {
@@ -1164,10 +2450,19 @@ public:
         auto result = Value::array();
         for (const auto& e : elements) {
             if (!e) throw std::runtime_error("Array element is null");
-            result.push_back(e->evaluate(context));
+            // Like variables, containers are stored: lazy sequences (which may hold on to the context) are stored evaluated.
+            result.push_back(e->evaluate(context).materialize());
         }
         return result;
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Array, location);
+        w.varint(elements.size());
+        for (const auto& e : elements) w.expr(e);
+    }
+    void visit_children(AstVisitor & v) const override {
+        for (const auto& e : elements) v.expr(e);
+    }
 };
 
 class DictExpr : public Expression {
@@ -1180,10 +2475,24 @@ public:
         for (const auto& [key, value] : elements) {
             if (!key) throw std::runtime_error("Dict key is null");
             if (!value) throw std::runtime_error("Dict value is null");
-            result.set(key->evaluate(context), value->evaluate(context));
+            result.set(key->evaluate(context), value->evaluate(context).materialize());  // See ArrayExpr
         }
         return result;
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Dict, location);
+        w.varint(elements.size());
+        for (const auto& [key, value] : elements) {
+            w.expr(key);
+            w.expr(value);
+        }
+    }
+    void visit_children(AstVisitor & v) const override {
+        for (const auto& [key, value] : elements) {
+            v.expr(key);
+            v.expr(value);
+        }
+    }
 };
 
 class SliceExpr : public Expression {
@@ -1194,6 +2503,15 @@ public:
     Value do_evaluate(const std::shared_ptr<Context> &) const override {
         throw std::runtime_error("SliceExpr not implemented");
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Slice, location);
+        w.expr(start);
+        w.expr(end);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(start);
+        v.expr(end);
+    }
 };
 
 class SubscriptExpr : public Expression {
@@ -1215,13 +2533,16 @@ public:
             if (end < 0) end = s.size() + end;
             return s.substr(start, end - start);
           } else if (target_value.is_array()) {
-            if (start < 0) start = target_value.size() + start;
-            if (end < 0) end = target_value.size() + end;
-            auto result = Value::array();
-            for (auto i = start; i < end; ++i) {
-              result.push_back(target_value.at(i));
-            }
-            return result;
+            auto size = (int64_t) target_value.size();
+            if (start < 0) start = size + start;
+            if (end < 0) end = size + end;
+            if (start < end && (start < 0 || end > size)) throw std::out_of_range("Slice out of range: " + target_value.dump());
+            auto count = (size_t) (end > start ? end - start : 0);
+            return Value::sequence([target_value, start, end](const std::function<bool(const Value &)> & yield) {
+              for (auto i = start; i < end; ++i) {
+                if (!yield(target_value.at(i))) return;
+              }
+            }, [count]() { return count; });
           } else {
             throw std::runtime_error(target_value.is_null() ? "Cannot subscript null" : "Subscripting only supported on arrays and strings");
           }
@@ -1236,6 +2557,33 @@ public:
           return target_value.get(index_value);
         }
     }
+    Value * lvalue(const std::shared_ptr<Context> & context) const override {
+        if (dynamic_cast<SliceExpr*>(index.get())) return nullptr;
+        auto slot = base->lvalue(context);
+        if (!slot) return nullptr;
+        auto index_value = index->evaluate(context);
+        if (slot->is_array() && index_value.is_number_integer()) {
+          auto i = index_value.get<int64_t>();
+          if (i < 0) i += slot->size();
+          if (i < 0 || i >= (int64_t) slot->size()) return nullptr;
+          return &slot->at((size_t) i);
+        }
+        if (slot->is_object() && index_value.is_hashable() && slot->contains(index_value)) {
+          return &slot->at(index_value);
+        }
+        return nullptr;
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Subscript, location);
+        w.expr(base);
+        w.expr(index);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(base);
+        v.expr(index);
+    }
+    const std::shared_ptr<Expression> & get_base() const { return base; }
+    const std::shared_ptr<Expression> & get_index() const { return index; }
 };
 
 class UnaryOpExpr : public Expression {
@@ -1259,6 +2607,14 @@ public:
         }
         throw std::runtime_error("Unknown unary operator");
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::UnaryOp, location);
+        w.u8((uint8_t) op);
+        w.expr(expr);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(expr);
+    }
 };
 
 class BinaryOpExpr : public Expression {
@@ -1339,6 +2695,16 @@ public:
           return do_eval(l);
         }
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::BinaryOp, location);
+        w.u8((uint8_t) op);
+        w.expr(left);
+        w.expr(right);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(left);
+        v.expr(right);
+    }
 };
 
 struct ArgumentsExpression {
@@ -1354,7 +2720,7 @@ struct ArgumentsExpression {
                     if (!array.is_array()) {
                         throw std::runtime_error("Expansion operator only supported on arrays");
                     }
-                    array.for_each([&](Value & value) {
+                    array.for_each([&](const Value & value) {
                         vargs.args.push_back(value);
                     });
                     continue;
@@ -1364,7 +2730,7 @@ struct ArgumentsExpression {
                         throw std::runtime_error("ExpansionDict operator only supported on objects");
                     }
                     dict.for_each([&](const Value & key) {
-                        vargs.kwargs.push_back({key.get<std::string>(), dict.at(key)});
+                        vargs.kwargs.push_back({key.get<std::string>(), std::as_const(dict).at(key)});
                     });
                     continue;
                 }
@@ -1376,6 +2742,20 @@ struct ArgumentsExpression {
         }
         return vargs;
     }
+
+    void serialize(AstWriter & w) const {
+        w.varint(args.size());
+        for (const auto& arg : args) w.expr(arg);
+        w.varint(kwargs.size());
+        for (const auto& [name, value] : kwargs) {
+            w.str(name);
+            w.expr(value);
+        }
+    }
+    void visit_children(AstVisitor & v) const {
+        for (const auto& arg : args) v.expr(arg);
+        for (const auto& [name, value] : kwargs) v.expr(value);
+    }
 };
 
 static std::string strip(const std::string & s) {
@@ -1416,42 +2796,45 @@ public:
         if (obj.is_null()) {
           throw std::runtime_error("Trying to call method '" + method->get_name() + "' on null");
         }
+        // Mutating frozen (shared) data copies it first: do that in the variable it was reached through, so the change stays visible.
+        auto mutable_obj = [&]() -> Value & {
+          if (obj.is_frozen()) {
+            if (auto slot = object->lvalue(context)) return *slot;
+          }
+          return obj;
+        };
         if (obj.is_array()) {
           if (method->get_name() == "append") {
               vargs.expectArgs("append method", {1, 1}, {0, 0});
-              obj.push_back(vargs.args[0]);
+              mutable_obj().push_back(vargs.args[0].materialize());
               return Value();
           } else if (method->get_name() == "pop") {
               vargs.expectArgs("pop method", {0, 1}, {0, 0});
-              return obj.pop(vargs.args.empty() ? Value() : vargs.args[0]);
+              return mutable_obj().pop(vargs.args.empty() ? Value() : vargs.args[0]);
           } else if (method->get_name() == "insert") {
               vargs.expectArgs("insert method", {2, 2}, {0, 0});
               auto index = vargs.args[0].get<int64_t>();
               if (index < 0 || index > (int64_t) obj.size()) throw std::runtime_error("Index out of range for insert method");
-              obj.insert(index, vargs.args[1]);
+              mutable_obj().insert(index, vargs.args[1].materialize());
               return Value();
           }
         } else if (obj.is_object()) {
           if (method->get_name() == "items") {
             vargs.expectArgs("items method", {0, 0}, {0, 0});
-            auto result = Value::array();
-            for (const auto& key : obj.keys()) {
-              result.push_back(Value::array({key, obj.at(key)}));
-            }
-            return result;
+            return obj.items();
           } else if (method->get_name() == "pop") {
             vargs.expectArgs("pop method", {1, 1}, {0, 0});
-            return obj.pop(vargs.args[0]);
+            return mutable_obj().pop(vargs.args[0]);
           } else if (method->get_name() == "get") {
             vargs.expectArgs("get method", {1, 2}, {0, 0});
             auto key = vargs.args[0];
             if (vargs.args.size() == 1) {
-              return obj.contains(key) ? obj.at(key) : Value();
+              return obj.contains(key) ? obj.get(key) : Value();
             } else {
-              return obj.contains(key) ? obj.at(key) : vargs.args[1];
+              return obj.contains(key) ? obj.get(key) : vargs.args[1];
             }
           } else if (obj.contains(method->get_name())) {
-            auto callable = obj.at(method->get_name());
+            auto callable = obj.get(method->get_name());
             if (!callable.is_callable()) {
               throw std::runtime_error("Property '" + method->get_name() + "' is not callable");
             }
@@ -1478,6 +2861,18 @@ public:
         }
         throw std::runtime_error("Unknown method: " + method->get_name());
     }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::MethodCall, location);
+        w.expr(object);
+        w.expr(method);
+        args.serialize(w);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(object);
+        args.visit_children(v);
+    }
+    const std::shared_ptr<Expression> & get_object() const { return object; }
+    std::string get_method() const { return method->get_name(); }
 };
 
 class CallExpr : public Expression {
@@ -1492,43 +2887,708 @@ public:
         if (!obj.is_callable()) {
           throw std::runtime_error("Object is not callable: " + obj.dump(2));
         }
-        auto vargs = args.evaluate(context);
-        return obj.call(context, vargs);
+        auto vargs = args.evaluate(context);
+        return obj.call(context, vargs);
+    }
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::Call, location);
+        w.expr(object);
+        args.serialize(w);
+    }
+    void visit_children(AstVisitor & v) const override {
+        v.expr(object);
+        args.visit_children(v);
+    }
+};
+
+class FilterExpr : public Expression {
+    std::vector<std::shared_ptr<Expression>> parts;
+public:
+    FilterExpr(const Location & location, std::vector<std::shared_ptr<Expression>> && p)
+      : Expression(location), parts(std::move(p)) {}
+    const std::vector<std::shared_ptr<Expression>> & get_parts() const { return parts; }
+    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
+        return apply(context, parts.size());
+    }
+    /* Value of the first `count` parts: the operand and the filters applied to it before the others. */
+    Value apply(const std::shared_ptr<Context> & context, size_t count) const {
+        Value result;
+        bool first = true;
+        for (size_t i = 0; i < count; ++i) {
+          const auto & part = parts[i];
+          if (!part) throw std::runtime_error("FilterExpr.part is null");
+          if (first) {
+            first = false;
+            result = part->evaluate(context);
+          } else {
+            if (auto ce = dynamic_cast<CallExpr*>(part.get())) {
+              auto target = ce->object->evaluate(context);
+              ArgumentsValue args = ce->args.evaluate(context);
+              args.args.insert(args.args.begin(), result);
+              result = target.call(context, args);
+            } else {
+              auto callable = part->evaluate(context);
+              ArgumentsValue args;
+              args.args.insert(args.args.begin(), result);
+              result = callable.call(context, args);
+            }
+          }
+        }
+        return result;
+    }
+
+    void prepend(std::shared_ptr<Expression> && e) {
+        parts.insert(parts.begin(), std::move(e));
+    }
+
+    void serialize(AstWriter & w) const override {
+        w.begin(AstTag::FilterExpr, location);
+        w.varint(parts.size());
+        for (const auto& part : parts) w.expr(part);
+    }
+
+    void visit_children(AstVisitor & v) const override {
+        for (const auto& part : parts) v.expr(part);
+    }
+};
+
+inline bool ExpressionNode::render_macro_call(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
+    auto call = dynamic_cast<const CallExpr *>(expr.get());
+    auto callee = call ? dynamic_cast<const VariableExpr *>(call->object.get()) : nullptr;
+    if (!callee) return false;
+    auto value = context->get(callee->get_name());
+    auto macro = value.callable_target<MacroNode::Call>();
+    if (!macro) return false;
+    call->located([&]() {
+        auto args = call->args.evaluate(context);
+        macro->render(out, args);
+    });
+    return true;
+}
+
+inline bool ExpressionNode::render_json(std::ostringstream & out, const std::shared_ptr<Context> & context) const {
+    auto filter = dynamic_cast<const FilterExpr *>(expr.get());
+    if (!filter || filter->get_parts().size() < 2 || filter->is_invariant()) return false;
+    auto last = filter->get_parts().back().get();
+    auto call = dynamic_cast<const CallExpr *>(last);
+    auto name = dynamic_cast<const VariableExpr *>(call ? call->object.get() : last);
+    if (!name || name->get_name() != "tojson") return false;
+    auto tojson = context->get("tojson");
+    if (!(tojson == Context::builtins()->get("tojson"))) return false;
+    filter->located([&]() {
+        auto value = filter->apply(context, filter->get_parts().size() - 1);
+        ArgumentsValue args;
+        if (call) args = call->args.evaluate(context);
+        // Only `tojson` and `tojson(indent)` are serialized here; the filter checks other arguments.
+        const Value * indent = nullptr;
+        if (args.args.size() == 1 && args.kwargs.empty()) indent = &args.args[0];
+        else if (args.args.empty() && args.kwargs.size() == 1 && args.kwargs[0].first == "indent") indent = &args.kwargs[0].second;
+        if ((indent && !indent->is_number_integer()) || (!indent && !args.empty())) {
+            args.args.insert(args.args.begin(), value);
+            write(out, tojson.call(context, args));
+            return;
+        }
+        auto start = out.tellp();
+        value.dump(out, indent ? (int) indent->get<int64_t>() : -1, 0, /* to_json= */ true);
+        RenderBudget::wrote(out.tellp() - start);
+    });
+    return true;
+}
+
+/* What a template body does, as far as can be told without rendering it (see analyze_body). */
+struct BodyAnalysis {
+    bool pure = false;  // Doesn't mutate values (namespace attributes, append / pop / insert, loop.cycle()), define macros or call anything but named functions
+    bool breaks = false;  // Has a {% break %} outside of its nested loops
+    bool ordered = false;  // Only reads the variables it sets in its scope after setting them, in every path
+    std::vector<std::string> free_names;  // Variables read from enclosing scopes, and filters or tests looked up by name
+    std::unordered_set<std::string> bound;  // Variables set or bound anywhere in the body, nested loops and blocks included
+};
+
+/* Analyzes `body` as rendered in a scope where `assigned` are already set (e.g. the variables of a loop). */
+inline BodyAnalysis analyze_body(const std::shared_ptr<TemplateNode> & body, std::unordered_set<std::string> assigned) {
+    class Check : public AstVisitor {
+        std::vector<std::string> shadowed_;  // Variables of the nested loops being visited
+        size_t depth_ = 0;  // Number of nested loop bodies being visited
+        std::unordered_set<const Expression *> filter_calls_;  // Calls applied as filters, whose operand is their first argument
+    public:
+        bool pure = true, breaks = false;
+        std::unordered_set<std::string> reads, bound, bound_anywhere;
+        std::unordered_set<std::string> names;  // Filters or tests looked up by name (e.g. map('upper'))
+
+        void visit(const Expression & e) override {
+            if (auto variable = dynamic_cast<const VariableExpr *>(&e)) {
+                if (std::find(shadowed_.begin(), shadowed_.end(), variable->get_name()) == shadowed_.end()) reads.insert(variable->get_name());
+            } else if (auto filter = dynamic_cast<const FilterExpr *>(&e)) {
+                const auto & parts = filter->get_parts();
+                for (size_t i = 1; i < parts.size(); ++i) {
+                    if (dynamic_cast<const CallExpr *>(parts[i].get())) filter_calls_.insert(parts[i].get());
+                }
+            } else if (auto method = dynamic_cast<const MethodCallExpr *>(&e)) {
+                static const std::unordered_set<std::string> pure_methods { "items", "get", "strip", "endswith", "title" };
+                if (!pure_methods.count(method->get_method())) pure = false;
+            } else if (auto call = dynamic_cast<const CallExpr *>(&e)) {
+                if (auto callee = dynamic_cast<const VariableExpr *>(call->object.get())) names_called(*call, callee->get_name());
+                else pure = false;
+            }
+            e.visit_children(*this);
+        }
+        /* Records the filter or test that `call` looks up by name, if it's a builtin that does (e.g. select('odd')). */
+        void names_called(const CallExpr & call, const std::string & callee) {
+            static const std::unordered_map<std::string, size_t> name_positions {
+                { "select", 1 }, { "reject", 1 }, { "map", 1 }, { "selectattr", 2 }, { "rejectattr", 2 },
+            };
+            auto it = name_positions.find(callee);
+            if (it == name_positions.end()) return;
+            if (callee == "map" && !call.args.kwargs.empty()) return;  // map(attribute=...)
+            auto position = it->second - (filter_calls_.count(&call) ? 1 : 0);
+            if (position >= call.args.args.size()) return;
+            auto literal = dynamic_cast<const LiteralExpr *>(call.args.args[position].get());
+            if (literal && literal->get_value().is_string()) names.insert(literal->get_value().get<std::string>());
+            else pure = false;  // Names a callable that can't be told before rendering
+        }
+        void visit(const TemplateNode & n) override {
+            if (auto set = dynamic_cast<const SetNode *>(&n)) {
+                if (!set->get_ns().empty()) pure = false;
+            } else if (auto control = dynamic_cast<const LoopControlNode *>(&n)) {
+                if (depth_ == 0 && control->get_control_type() == LoopControlType::Break) breaks = true;
+            } else if (dynamic_cast<const MacroNode *>(&n)) {
+                pure = false;
+            } else if (auto loop = dynamic_cast<const ForNode *>(&n)) {
+                // Its variables are local to its body, but a condition also assigns them in the enclosing scope.
+                const auto & var_names = loop->get_var_names();
+                expr(loop->get_iterable());
+                if (loop->get_condition()) {
+                    for (const auto & name : var_names) binds(name);
+                }
+                bound_anywhere.insert(var_names.begin(), var_names.end());
+                shadowed_.insert(shadowed_.end(), var_names.begin(), var_names.end());
+                depth_++;
+                expr(loop->get_condition());
+                node(loop->get_body());
+                depth_--;
+                shadowed_.resize(shadowed_.size() - var_names.size());
+                node(loop->get_else_body());
+                return;
+            }
+            n.visit_children(*this);
+        }
+        void binds(const std::string & name) override {
+            if (depth_ == 0) bound.insert(name);
+            bound_anywhere.insert(name);
+        }
+    };
+
+    BodyAnalysis result;
+    if (!body) return result;
+    auto sequence = dynamic_cast<const SequenceNode *>(body.get());
+    auto children = sequence ? sequence->get_children() : std::vector<std::shared_ptr<TemplateNode>> { body };
+    std::vector<Check> checks(children.size());
+    std::unordered_set<std::string> bound;
+    for (size_t i = 0; i < children.size(); ++i) {
+        checks[i].node(children[i]);
+        if (!checks[i].pure) return result;
+        result.breaks = result.breaks || checks[i].breaks;
+        bound.insert(checks[i].bound.begin(), checks[i].bound.end());
+        result.bound.insert(checks[i].bound_anywhere.begin(), checks[i].bound_anywhere.end());
+    }
+    result.pure = true;
+    result.ordered = true;
+    std::unordered_set<std::string> free;
+    auto is_identifier = [](const std::string & s) {
+        return !s.empty() && !std::isdigit((unsigned char) s[0])
+            && std::all_of(s.begin(), s.end(), [](char c) { return std::isalnum((unsigned char) c) || c == '_'; });
+    };
+    for (size_t i = 0; i < children.size(); ++i) {
+        for (const auto & name : checks[i].reads) {
+            if (assigned.count(name)) continue;
+            if (bound.count(name)) result.ordered = false;
+            else free.insert(name);
+        }
+        for (const auto & name : checks[i].names) {
+            if (is_identifier(name) && !assigned.count(name) && !bound.count(name)) free.insert(name);
+        }
+        // Top-level sets run every time, before the nodes after them.
+        if (dynamic_cast<const SetNode *>(children[i].get()) || dynamic_cast<const SetTemplateNode *>(children[i].get())) {
+            assigned.insert(checks[i].bound.begin(), checks[i].bound.end());
+        }
+    }
+    result.free_names.assign(free.begin(), free.end());
+    return result;
+}
+
+inline MacroNode::MacroNode(const Location & location, std::shared_ptr<VariableExpr> && n, Expression::Parameters && p, std::shared_ptr<TemplateNode> && b)
+    : TemplateNode(location), name(std::move(n)), params(std::move(p)), body(std::move(b)) {
+    for (size_t i = 0; i < params.size(); ++i) {
+      const auto & name = params[i].first;
+      if (!name.empty()) {
+        named_param_positions[name] = i;
+      }
+      param_keys_.emplace_back(name);
+      // A literal default is the same value at every call: evaluated once, here.
+      auto literal = dynamic_cast<const LiteralExpr *>(params[i].second.get());
+      constant_defaults_.emplace_back(literal ? std::optional<Value>(literal->get_value()) : std::nullopt);
+    }
+    // strftime_now() is the only builtin whose result changes from a call to the next.
+    std::unordered_set<std::string> assigned;
+    for (const auto & param : params) assigned.insert(param.first);
+    auto analysis = analyze_body(body, assigned);
+    pure_ = analysis.pure && analysis.ordered && !analysis.breaks
+        && std::find(analysis.free_names.begin(), analysis.free_names.end(), "strftime_now") == analysis.free_names.end();
+    free_names_ = std::move(analysis.free_names);
+}
+
+/*
+  Iterations can render concurrently when none can tell whether another one ran: the body is pure (see BodyAnalysis),
+  doesn't break, calls no macros (checked when rendering) and only reads the variables it sets in the loop's scope after
+  setting them in the same iteration (before that, they hold the previous iteration's values).
+
+  In a pure body, subscripts (e.g. messages[0]['role']) and filters of variables that neither the body nor its nested
+  loops set are loop-invariant: each render of the loop evaluates them once, when an iteration first needs them.
+*/
+inline void ForNode::analyze() {
+    // Reads of loop attributes that don't depend on the number of items leave a lazy sequence streamed (see render_loop).
+    class Counts : public AstVisitor {
+        std::unordered_set<const Expression *> allowed_;  // Uses of `loop` known not to need the length
+    public:
+        bool counts = false;
+
+        void visit(const Expression & e) override {
+            if (auto subscript = dynamic_cast<const SubscriptExpr *>(&e)) {
+                auto base = dynamic_cast<const VariableExpr *>(subscript->get_base().get());
+                auto index = dynamic_cast<const LiteralExpr *>(subscript->get_index().get());
+                if (base && index && base->get_name() == "loop" && index->get_value().is_string()) {
+                    static const std::unordered_set<std::string> uncounted { "index", "index0", "first", "previtem", "nextitem" };
+                    if (uncounted.count(index->get_value().get<std::string>())) allowed_.insert(base);
+                }
+            } else if (auto call = dynamic_cast<const MethodCallExpr *>(&e)) {
+                auto object = dynamic_cast<const VariableExpr *>(call->get_object().get());
+                if (object && object->get_name() == "loop" && call->get_method() == "cycle") allowed_.insert(object);
+            } else if (auto variable = dynamic_cast<const VariableExpr *>(&e)) {
+                if (variable->get_name() == "loop" && !allowed_.count(&e)) counts = true;
+            }
+            e.visit_children(*this);
+        }
+        void visit(const TemplateNode & n) override {
+            if (auto loop = dynamic_cast<const ForNode *>(&n)) {
+                // Its body has its own `loop`.
+                expr(loop->get_iterable());
+                expr(loop->get_condition());
+                node(loop->get_else_body());
+                return;
+            }
+            n.visit_children(*this);
+        }
+    };
+    Counts counts;
+    counts.node(body);
+    counts_ = recursive || counts.counts;
+
+    std::unordered_set<std::string> assigned(var_names.begin(), var_names.end());
+    assigned.insert("loop");
+    auto analysis = analyze_body(body, assigned);
+    if (!analysis.pure) return;
+    free_names_ = std::move(analysis.free_names);
+    parallel_ = !recursive && !analysis.breaks && analysis.ordered;
+
+    class Hoist : public AstVisitor {
+        const std::unordered_set<std::string> & variant_;  // Variables that may change from an iteration to the next
+        bool invariant(const Expression & e) const {
+            if (auto variable = dynamic_cast<const VariableExpr *>(&e)) return !variant_.count(variable->get_name());
+            if (dynamic_cast<const LiteralExpr *>(&e)) return true;
+            if (auto subscript = dynamic_cast<const SubscriptExpr *>(&e)) {
+                const auto & index = subscript->get_index();
+                return subscript->get_base() && index && !dynamic_cast<const SliceExpr *>(index.get())
+                    && invariant(*subscript->get_base()) && invariant(*index);
+            }
+            if (auto filter = dynamic_cast<const FilterExpr *>(&e)) {
+                // Applied by name (e.g. `messages | length`), each name checked to be a builtin when rendering.
+                static const std::unordered_set<std::string> impure { "joiner", "namespace", "strftime_now" };
+                const auto & parts = filter->get_parts();
+                if (parts.empty() || !parts[0] || !invariant(*parts[0])) return false;
+                return std::all_of(parts.begin() + 1, parts.end(), [&](const std::shared_ptr<Expression> & part) {
+                    auto name = dynamic_cast<const VariableExpr *>(part.get());
+                    return name && !variant_.count(name->get_name()) && !impure.count(name->get_name());
+                });
+            }
+            return false;
+        }
+    public:
+        const ForNode * loop;
+        size_t count = 0;
+        Hoist(const ForNode * loop, const std::unordered_set<std::string> & variant) : variant_(variant), loop(loop) {}
+
+        void visit(const Expression & e) override {
+            if ((dynamic_cast<const SubscriptExpr *>(&e) || dynamic_cast<const FilterExpr *>(&e)) && invariant(e)) {
+                e.set_invariant(loop, count++);
+                return;
+            }
+            e.visit_children(*this);
+        }
+        void visit(const TemplateNode & n) override {
+            n.visit_children(*this);
+        }
+    };
+    auto & variant = analysis.bound;
+    variant.insert(assigned.begin(), assigned.end());
+    Hoist hoist(this, variant);
+    hoist.node(body);
+    invariants_ = hoist.count;
+}
+
+/* Whether the variables the body reads from enclosing scopes aren't callables other than builtins (e.g. macros). */
+inline bool ForNode::calls_builtins_only(const std::shared_ptr<Context> & context) const {
+    const auto & builtins = Context::builtins();
+    for (const auto & name : free_names_) {
+        auto value = context->get(name);
+        if (value.is_callable() && !(value == builtins->get(name))) return false;
+    }
+    return true;
+}
+
+/*
+  Threads helping with parallel loops (see ForNode::set_parallel), started as loops need them and kept until the
+  process exits: a loop doesn't pay for creating threads each time it renders.
+*/
+class LoopThreads {
+    // A loop's `work`, queued once per helper it asked for.
+    struct Batch {
+        const std::function<void()> * work;
+        unsigned running = 0;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable queued_, finished_;
+    std::deque<std::shared_ptr<Batch>> queue_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+
+    void serve() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            queued_.wait(lock, [&]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) return;
+            auto batch = std::move(queue_.front());
+            queue_.pop_front();
+            batch->running++;
+            lock.unlock();
+            (*batch->work)();  // Doesn't throw
+            lock.lock();
+            if (--batch->running == 0) finished_.notify_all();
+        }
+    }
+
+public:
+    static LoopThreads & instance() {
+        static LoopThreads threads;
+        return threads;
+    }
+    ~LoopThreads() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        queued_.notify_all();
+        for (auto & thread : threads_) thread.join();
+    }
+
+    /*
+      Runs `work` on the calling thread and on up to `helpers` threads of the pool, which `work` must not throw from.
+      Returns once they're all done: helpers that didn't start by the time the calling thread is done aren't waited for.
+    */
+    void run(const std::function<void()> & work, unsigned helpers) {
+        auto batch = std::make_shared<Batch>();
+        batch->work = &work;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            while (threads_.size() < helpers) {
+                try {
+                    threads_.emplace_back([this]() { serve(); });
+                } catch (const std::system_error &) {
+                    break;  // Renders on the threads it got
+                }
+            }
+            for (unsigned i = 0; i < helpers; i++) queue_.push_back(batch);
+        }
+        queued_.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_.erase(std::remove(queue_.begin(), queue_.end(), batch), queue_.end());
+        finished_.wait(lock, [&]() { return batch->running == 0; });
+    }
+};
+
+/* Renders the loop's items in chunks claimed in turn by a few threads, if it's enabled and safe (returns false otherwise). */
+inline bool ForNode::render_parallel(std::ostringstream & out, const std::shared_ptr<Context> & context, const Value & items, size_t n) const {
+    auto min_items = parallel_min_items_.load();
+    if (!parallel_ || min_items == 0 || n < min_items || in_parallel_loop_) return false;
+    // Recorders only see what their own thread renders to their own stream, and budgets what their own thread renders.
+    if (Value::records_json_reads() || TextNode::records_text(out) || OutputSpans::of(out) || RenderBudget::current()) return false;
+    auto threads = parallel_threads_.load();
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads < 2) return false;
+    // Macros may mutate their arguments, and other callables may keep state.
+    if (!calls_builtins_only(context)) return false;
+
+    std::vector<Value> values;
+    values.reserve(n);
+    items.for_each([&](const Value & item) { values.push_back(item.materialize()); });
+    n = values.size();
+    threads = (unsigned) (std::min)((size_t) threads, n);
+    auto chunk_size = (std::max)((size_t) 1, n / (threads * 8));  // Several chunks per thread, to balance their loads
+    auto chunks = (n + chunk_size - 1) / chunk_size;
+    std::vector<std::string> outputs(chunks);
+    std::vector<std::exception_ptr> errors(chunks);
+    std::atomic<size_t> next { 0 };
+    std::atomic<size_t> failed { chunks };  // First chunk that threw: the error a sequential render would have thrown
+    auto copies = Value::current_copies();  // Only read: the body doesn't mutate data
+    std::function<void()> work = [&]() {
+        Value::CopyScope scope(copies);
+        in_parallel_loop_ = true;  // Loops within these items render on this thread
+        for (size_t chunk; (chunk = next++) < chunks && chunk < failed;) {
+            try {
+                std::ostringstream chunk_out;
+                auto loop = Value::object();
+                auto loop_context = Context::make(Value::object(), context);
+                loop_context->set("loop", loop);
+                for (size_t i = chunk * chunk_size, end = (std::min)(n, i + chunk_size); i < end; ++i) {
+                    destructuring_assign(var_names, loop_context, values[i]);
+                    set_loop_item(loop, i, n, i > 0 ? values[i - 1] : Value(), i + 1 < n ? values[i + 1] : Value());
+                    try {
+                        body->render(chunk_out, loop_context);
+                    } catch (const LoopControlException &) {
+                        // {% continue %} (the body has no {% break %})
+                    }
+                }
+                outputs[chunk] = chunk_out.str();
+            } catch (...) {
+                errors[chunk] = std::current_exception();
+                for (auto first = failed.load(); chunk < first && !failed.compare_exchange_weak(first, chunk);) {}
+            }
+        }
+        in_parallel_loop_ = false;
+    };
+    LoopThreads::instance().run(work, threads - 1);
+    if (failed < chunks) std::rethrow_exception(errors[failed]);
+    for (const auto & output : outputs) out << output;
+    return true;
+}
+
+inline void AstWriter::expr(const std::shared_ptr<Expression> & e) {
+    if (e) e->serialize(*this);
+    else u8((uint8_t) AstTag::Null);
+}
+
+inline void AstWriter::node(const std::shared_ptr<TemplateNode> & n) {
+    if (n) n->serialize(*this);
+    else u8((uint8_t) AstTag::Null);
+}
+
+/* Rebuilds the trees written by AstWriter; throws on truncated or malformed input. */
+class AstReader {
+    std::string_view & in_;
+    const std::string * source_;
+    std::shared_ptr<AstArena> arena_;
+
+    static std::runtime_error malformed() { return std::runtime_error("Malformed compiled template"); }
+
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make_node(Args &&... args) {
+        return std::allocate_shared<T>(ArenaAllocator<T>(arena_), std::forward<Args>(args)...);
+    }
+
+public:
+    AstReader(std::string_view & in, const std::string * source, std::shared_ptr<AstArena> arena = nullptr) : in_(in), source_(source), arena_(std::move(arena)) {}
+
+    uint8_t u8() {
+        if (in_.empty()) throw malformed();
+        auto v = (uint8_t) in_[0];
+        in_.remove_prefix(1);
+        return v;
+    }
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto b = u8();
+            v |= (uint64_t) (b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw malformed();
+    }
+    size_t count() {
+        auto n = varint();
+        if (n > in_.size()) throw malformed();  // Every element takes at least a byte.
+        return (size_t) n;
+    }
+    std::string str() {
+        auto n = count();
+        std::string v(in_.substr(0, n));
+        in_.remove_prefix(n);
+        return v;
+    }
+    std::vector<std::string> strs() {
+        std::vector<std::string> v(count());
+        for (auto & s : v) s = str();
+        return v;
+    }
+    bool boolean() { return u8() != 0; }
+    Value value() { return Value(json::parse(str())); }
+    Location location() {
+        auto pos = varint();
+        if (pos == 0) return Location { nullptr, 0 };
+        if (!source_ || pos - 1 > source_->size()) throw malformed();
+        return Location { source_, (size_t) (pos - 1) };
+    }
+
+    ArgumentsExpression arguments() {
+        ArgumentsExpression a;
+        a.args.resize(count());
+        for (auto & arg : a.args) arg = expr();
+        a.kwargs.resize(count());
+        for (auto & [name, value] : a.kwargs) {
+            name = str();
+            value = expr();
+        }
+        return a;
     }
-};
 
-class FilterExpr : public Expression {
-    std::vector<std::shared_ptr<Expression>> parts;
-public:
-    FilterExpr(const Location & location, std::vector<std::shared_ptr<Expression>> && p)
-      : Expression(location), parts(std::move(p)) {}
-    Value do_evaluate(const std::shared_ptr<Context> & context) const override {
-        Value result;
-        bool first = true;
-        for (const auto& part : parts) {
-          if (!part) throw std::runtime_error("FilterExpr.part is null");
-          if (first) {
-            first = false;
-            result = part->evaluate(context);
-          } else {
-            if (auto ce = dynamic_cast<CallExpr*>(part.get())) {
-              auto target = ce->object->evaluate(context);
-              ArgumentsValue args = ce->args.evaluate(context);
-              args.args.insert(args.args.begin(), result);
-              result = target.call(context, args);
-            } else {
-              auto callable = part->evaluate(context);
-              ArgumentsValue args;
-              args.args.insert(args.args.begin(), result);
-              result = callable.call(context, args);
+    std::shared_ptr<VariableExpr> variable() {
+        auto e = expr();
+        auto v = std::dynamic_pointer_cast<VariableExpr>(e);
+        if (e && !v) throw malformed();
+        return v;
+    }
+
+    std::shared_ptr<Expression> expr() {
+        auto tag = (AstTag) u8();
+        if (tag == AstTag::Null) return nullptr;
+        auto loc = location();
+        switch (tag) {
+            case AstTag::Variable: return make_node<VariableExpr>(loc, str());
+            case AstTag::Literal: return make_node<LiteralExpr>(loc, value());
+            case AstTag::IfExpr: {
+                auto condition = expr();
+                auto then_expr = expr();
+                auto else_expr = expr();
+                return make_node<IfExpr>(loc, std::move(condition), std::move(then_expr), std::move(else_expr));
             }
-          }
+            case AstTag::Array: {
+                std::vector<std::shared_ptr<Expression>> elements(count());
+                for (auto & e : elements) e = expr();
+                return make_node<ArrayExpr>(loc, std::move(elements));
+            }
+            case AstTag::Dict: {
+                std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> elements(count());
+                for (auto & [key, value] : elements) {
+                    key = expr();
+                    value = expr();
+                }
+                return make_node<DictExpr>(loc, std::move(elements));
+            }
+            case AstTag::Slice: {
+                auto start = expr();
+                auto end = expr();
+                return make_node<SliceExpr>(loc, std::move(start), std::move(end));
+            }
+            case AstTag::Subscript: {
+                auto base = expr();
+                auto index = expr();
+                return make_node<SubscriptExpr>(loc, std::move(base), std::move(index));
+            }
+            case AstTag::UnaryOp: {
+                auto op = u8();
+                if (op > (uint8_t) UnaryOpExpr::Op::ExpansionDict) throw malformed();
+                return make_node<UnaryOpExpr>(loc, expr(), (UnaryOpExpr::Op) op);
+            }
+            case AstTag::BinaryOp: {
+                auto op = u8();
+                if (op > (uint8_t) BinaryOpExpr::Op::IsNot) throw malformed();
+                auto left = expr();
+                auto right = expr();
+                return make_node<BinaryOpExpr>(loc, std::move(left), std::move(right), (BinaryOpExpr::Op) op);
+            }
+            case AstTag::MethodCall: {
+                auto object = expr();
+                auto method = variable();
+                return make_node<MethodCallExpr>(loc, std::move(object), std::move(method), arguments());
+            }
+            case AstTag::Call: {
+                auto object = expr();
+                return make_node<CallExpr>(loc, std::move(object), arguments());
+            }
+            case AstTag::FilterExpr: {
+                std::vector<std::shared_ptr<Expression>> parts(count());
+                for (auto & part : parts) part = expr();
+                return make_node<FilterExpr>(loc, std::move(parts));
+            }
+            default: throw malformed();
         }
-        return result;
     }
 
-    void prepend(std::shared_ptr<Expression> && e) {
-        parts.insert(parts.begin(), std::move(e));
+    std::shared_ptr<TemplateNode> node() {
+        auto tag = (AstTag) u8();
+        if (tag == AstTag::Null) return nullptr;
+        auto loc = location();
+        switch (tag) {
+            case AstTag::Sequence: {
+                std::vector<std::shared_ptr<TemplateNode>> children(count());
+                for (auto & child : children) child = node();
+                return make_node<SequenceNode>(loc, std::move(children));
+            }
+            case AstTag::Text: {
+                if (!boolean()) return make_node<TextNode>(loc, str());
+                auto pos = varint();
+                auto size = varint();
+                if (!loc.source || pos > loc.source->size() || size > loc.source->size() - pos) throw malformed();
+                return make_node<TextNode>(loc, (size_t) pos, (size_t) size);
+            }
+            case AstTag::Expression: return make_node<ExpressionNode>(loc, expr());
+            case AstTag::If: {
+                std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<TemplateNode>>> cascade(count());
+                for (auto & [condition, body] : cascade) {
+                    condition = expr();
+                    body = node();
+                }
+                return make_node<IfNode>(loc, std::move(cascade));
+            }
+            case AstTag::LoopControl: {
+                auto type = u8();
+                if (type > (uint8_t) LoopControlType::Continue) throw malformed();
+                return make_node<LoopControlNode>(loc, (LoopControlType) type);
+            }
+            case AstTag::For: {
+                auto var_names = strs();
+                auto iterable = expr();
+                auto condition = expr();
+                auto body = node();
+                auto recursive = boolean();
+                auto else_body = node();
+                return make_node<ForNode>(loc, std::move(var_names), std::move(iterable), std::move(condition), std::move(body), recursive, std::move(else_body));
+            }
+            case AstTag::Macro: {
+                auto name = variable();
+                Expression::Parameters params(count());
+                for (auto & [param_name, default_value] : params) {
+                    param_name = str();
+                    default_value = expr();
+                }
+                return make_node<MacroNode>(loc, std::move(name), std::move(params), node());
+            }
+            case AstTag::Filter: {
+                auto filter = expr();
+                return make_node<FilterNode>(loc, std::move(filter), node());
+            }
+            case AstTag::Set: {
+                auto ns = str();
+                auto var_names = strs();
+                return make_node<SetNode>(loc, ns, var_names, expr());
+            }
+            case AstTag::SetTemplate: {
+                auto name = str();
+                return make_node<SetTemplateNode>(loc, name, node());
+            }
+            case AstTag::Generation: return make_node<GenerationNode>(loc, node());
+            default: throw malformed();
+        }
     }
 };
 
@@ -1537,9 +3597,15 @@ private:
     using CharIterator = std::string::const_iterator;
 
     std::shared_ptr<std::string> template_str;
+    std::shared_ptr<AstArena> arena = std::make_shared<AstArena>();
     CharIterator start, end, it;
     Options options;
 
+    template <typename T, typename... Args>
+    std::shared_ptr<T> make_node(Args &&... args) const {
+        return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+    }
+
     Parser(const std::shared_ptr<std::string>& template_str, const Options & options) : template_str(template_str), options(options) {
       if (!template_str) throw std::runtime_error("Template string is null");
       start = it = this->template_str->begin();
@@ -1681,7 +3747,8 @@ private:
         auto start = it;
         consumeSpaces(space_handling);
         std::smatch match;
-        if (std::regex_search(it, end, match, regex) && match.position() == 0) {
+        // Anchored at `it`: an unanchored search would scan the rest of the template for every token.
+        if (std::regex_search(it, end, match, regex, std::regex_constants::match_continuous)) {
             it += match[0].length();
             std::vector<std::string> ret;
             for (size_t i = 0, n = match.size(); i < n; ++i) {
@@ -1696,7 +3763,8 @@ private:
         auto start = it;
         consumeSpaces(space_handling);
         std::smatch match;
-        if (std::regex_search(it, end, match, regex) && match.position() == 0) {
+        // Anchored at `it`: an unanchored search would scan the rest of the template for every token.
+        if (std::regex_search(it, end, match, regex, std::regex_constants::match_continuous)) {
             it += match[0].length();
             return match[0].str();
         }
@@ -1728,11 +3796,11 @@ private:
 
         auto location = get_location();
         auto [condition, else_expr] = parseIfExpression();
-        return std::make_shared<IfExpr>(location, std::move(condition), std::move(left), std::move(else_expr));
+        return make_node<IfExpr>(location, std::move(condition), std::move(left), std::move(else_expr));
     }
 
     Location get_location() const {
-        return {template_str, (size_t) std::distance(start, it)};
+        return {template_str.get(), (size_t) std::distance(start, it)};
     }
 
     std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>> parseIfExpression() {
@@ -1757,7 +3825,7 @@ private:
         while (!consumeToken(or_tok).empty()) {
             auto right = parseLogicalAnd();
             if (!right) throw std::runtime_error("Expected right side of 'or' expression");
-            left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::Or);
+            left = make_node<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::Or);
         }
         return left;
     }
@@ -1769,7 +3837,7 @@ private:
         if (!consumeToken(not_tok).empty()) {
           auto sub = parseLogicalNot();
           if (!sub) throw std::runtime_error("Expected expression after 'not' keyword");
-          return std::make_shared<UnaryOpExpr>(location, std::move(sub), UnaryOpExpr::Op::LogicalNot);
+          return make_node<UnaryOpExpr>(location, std::move(sub), UnaryOpExpr::Op::LogicalNot);
         }
         return parseLogicalCompare();
     }
@@ -1783,7 +3851,7 @@ private:
         while (!consumeToken(and_tok).empty()) {
             auto right = parseLogicalNot();
             if (!right) throw std::runtime_error("Expected right side of 'and' expression");
-            left = std::make_shared<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::And);
+            left = make_node<BinaryOpExpr>(location, std::move(left), std::move(right), BinaryOpExpr::Op::And);
         }
         return left;
     }
@@ -1796,14 +3864,13 @@ private:
         static std::regex not_tok(R"(not\b)");
         std::string op_str;
         while (!(op_str = consumeToken(compare_tok)).empty()) {
-            auto location = get_location();
             if (op_str == "is") {
               auto negated = !consumeToken(not_tok).empty();
 
               auto identifier = parseIdentifier();
               if (!identifier) throw std::runtime_error("Expected identifier after 'is' keyword");
 
-              return std::make_shared<BinaryOpExpr>(
+              return make_node<BinaryOpExpr>(
                   left->location,
                   std::move(left), std::move(identifier),
                   negated ? BinaryOpExpr::Op::IsNot : BinaryOpExpr::Op::Is);
@@ -1820,7 +3887,7 @@ private:
             else if (op_str == "in") op = BinaryOpExpr::Op::In;
             else if (op_str.substr(0, 3) == "not") op = BinaryOpExpr::Op::NotIn;
             else throw std::runtime_error("Unknown comparison operator: " + op_str);
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
         return left;
     }
@@ -1899,7 +3966,7 @@ private:
         auto ident = consumeToken(ident_regex);
         if (ident.empty())
           return nullptr;
-        return std::make_shared<VariableExpr>(location, ident);
+        return make_node<VariableExpr>(location, ident);
     }
 
     std::shared_ptr<Expression> parseStringConcat() {
@@ -1910,7 +3977,7 @@ private:
         if (!consumeToken(concat_tok).empty()) {
             auto right = parseLogicalAnd();
             if (!right) throw std::runtime_error("Expected right side of 'string concat' expression");
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::StrConcat);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::StrConcat);
         }
         return left;
     }
@@ -1922,7 +3989,7 @@ private:
         while (!consumeToken("**").empty()) {
             auto right = parseMathPlusMinus();
             if (!right) throw std::runtime_error("Expected right side of 'math pow' expression");
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::MulMul);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), BinaryOpExpr::Op::MulMul);
         }
         return left;
     }
@@ -1937,7 +4004,7 @@ private:
             auto right = parseMathMulDiv();
             if (!right) throw std::runtime_error("Expected right side of 'math plus/minus' expression");
             auto op = op_str == "+" ? BinaryOpExpr::Op::Add : BinaryOpExpr::Op::Sub;
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
         return left;
     }
@@ -1956,7 +4023,7 @@ private:
                 : op_str == "/" ? BinaryOpExpr::Op::Div
                 : op_str == "//" ? BinaryOpExpr::Op::DivDiv
                 : BinaryOpExpr::Op::Mod;
-            left = std::make_shared<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
+            left = make_node<BinaryOpExpr>(get_location(), std::move(left), std::move(right), op);
         }
 
         if (!consumeToken("|").empty()) {
@@ -1968,14 +4035,14 @@ private:
                 std::vector<std::shared_ptr<Expression>> parts;
                 parts.emplace_back(std::move(left));
                 parts.emplace_back(std::move(expr));
-                return std::make_shared<FilterExpr>(get_location(), std::move(parts));
+                return make_node<FilterExpr>(get_location(), std::move(parts));
             }
         }
         return left;
     }
 
     std::shared_ptr<Expression> call_func(const std::string & name, ArgumentsExpression && args) const {
-        return std::make_shared<CallExpr>(get_location(), std::make_shared<VariableExpr>(get_location(), name), std::move(args));
+        return make_node<CallExpr>(get_location(), make_node<VariableExpr>(get_location(), name), std::move(args));
     }
 
     std::shared_ptr<Expression> parseMathUnaryPlusMinus() {
@@ -1986,7 +4053,7 @@ private:
 
         if (!op_str.empty()) {
             auto op = op_str == "+" ? UnaryOpExpr::Op::Plus : UnaryOpExpr::Op::Minus;
-            return std::make_shared<UnaryOpExpr>(get_location(), std::move(expr), op);
+            return make_node<UnaryOpExpr>(get_location(), std::move(expr), op);
         }
         return expr;
     }
@@ -1997,17 +4064,17 @@ private:
       auto expr = parseValueExpression();
       if (op_str.empty()) return expr;
       if (!expr) throw std::runtime_error("Expected expr of 'expansion' expression");
-      return std::make_shared<UnaryOpExpr>(get_location(), std::move(expr), op_str == "*" ? UnaryOpExpr::Op::Expansion : UnaryOpExpr::Op::ExpansionDict);
+      return make_node<UnaryOpExpr>(get_location(), std::move(expr), op_str == "*" ? UnaryOpExpr::Op::Expansion : UnaryOpExpr::Op::ExpansionDict);
     }
 
     std::shared_ptr<Expression> parseValueExpression() {
       auto parseValue = [&]() -> std::shared_ptr<Expression> {
         auto location = get_location();
         auto constant = parseConstant();
-        if (constant) return std::make_shared<LiteralExpr>(location, *constant);
+        if (constant) return make_node<LiteralExpr>(location, *constant);
 
         static std::regex null_regex(R"(null\b)");
-        if (!consumeToken(null_regex).empty()) return std::make_shared<LiteralExpr>(location, Value());
+        if (!consumeToken(null_regex).empty()) return make_node<LiteralExpr>(location, Value());
 
         auto identifier = parseIdentifier();
         if (identifier) return identifier;
@@ -2031,16 +4098,16 @@ private:
             std::shared_ptr<Expression> index;
             if (!consumeToken(":").empty()) {
               auto slice_end = parseExpression();
-              index = std::make_shared<SliceExpr>(slice_end->location, nullptr, std::move(slice_end));
+              index = make_node<SliceExpr>(slice_end->location, nullptr, std::move(slice_end));
             } else {
               auto slice_start = parseExpression();
               if (!consumeToken(":").empty()) {
                 consumeSpaces();
                 if (peekSymbols({ "]" })) {
-                  index = std::make_shared<SliceExpr>(slice_start->location, std::move(slice_start), nullptr);
+                  index = make_node<SliceExpr>(slice_start->location, std::move(slice_start), nullptr);
                 } else {
                   auto slice_end = parseExpression();
-                  index = std::make_shared<SliceExpr>(slice_start->location, std::move(slice_start), std::move(slice_end));
+                  index = make_node<SliceExpr>(slice_start->location, std::move(slice_start), std::move(slice_end));
                 }
               } else {
                 index = std::move(slice_start);
@@ -2049,7 +4116,7 @@ private:
             if (!index) throw std::runtime_error("Empty index in subscript");
             if (consumeToken("]").empty()) throw std::runtime_error("Expected closing bracket in subscript");
 
-            value = std::make_shared<SubscriptExpr>(value->location, std::move(value), std::move(index));
+            value = make_node<SubscriptExpr>(value->location, std::move(value), std::move(index));
         } else if (!consumeToken(".").empty()) {
             auto identifier = parseIdentifier();
             if (!identifier) throw std::runtime_error("Expected identifier in subscript");
@@ -2057,10 +4124,10 @@ private:
             consumeSpaces();
             if (peekSymbols({ "(" })) {
               auto callParams = parseCallArgs();
-              value = std::make_shared<MethodCallExpr>(identifier->location, std::move(value), std::move(identifier), std::move(callParams));
+              value = make_node<MethodCallExpr>(identifier->location, std::move(value), std::move(identifier), std::move(callParams));
             } else {
-              auto key = std::make_shared<LiteralExpr>(identifier->location, Value(identifier->get_name()));
-              value = std::make_shared<SubscriptExpr>(identifier->location, std::move(value), std::move(key));
+              auto key = make_node<LiteralExpr>(identifier->location, Value(identifier->get_name()));
+              value = make_node<SubscriptExpr>(identifier->location, std::move(value), std::move(key));
             }
         }
         consumeSpaces();
@@ -2069,7 +4136,7 @@ private:
       if (peekSymbols({ "(" })) {
         auto location = get_location();
         auto callParams = parseCallArgs();
-        value = std::make_shared<CallExpr>(location, std::move(value), std::move(callParams));
+        value = make_node<CallExpr>(location, std::move(value), std::move(callParams));
       }
       return value;
     }
@@ -2094,7 +4161,7 @@ private:
           tuple.push_back(std::move(next));
 
           if (!consumeToken(")").empty()) {
-              return std::make_shared<ArrayExpr>(get_location(), std::move(tuple));
+              return make_node<ArrayExpr>(get_location(), std::move(tuple));
           }
         }
         throw std::runtime_error("Expected closing parenthesis");
@@ -2105,7 +4172,7 @@ private:
 
         std::vector<std::shared_ptr<Expression>> elements;
         if (!consumeToken("]").empty()) {
-            return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
+            return make_node<ArrayExpr>(get_location(), std::move(elements));
         }
         auto first_expr = parseExpression();
         if (!first_expr) throw std::runtime_error("Expected first expression in array");
@@ -2117,7 +4184,7 @@ private:
               if (!expr) throw std::runtime_error("Expected expression in array");
               elements.push_back(std::move(expr));
             } else if (!consumeToken("]").empty()) {
-                return std::make_shared<ArrayExpr>(get_location(), std::move(elements));
+                return make_node<ArrayExpr>(get_location(), std::move(elements));
             } else {
                 throw std::runtime_error("Expected comma or closing bracket in array");
             }
@@ -2130,7 +4197,7 @@ private:
 
         std::vector<std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> elements;
         if (!consumeToken("}").empty()) {
-            return std::make_shared<DictExpr>(get_location(), std::move(elements));
+            return make_node<DictExpr>(get_location(), std::move(elements));
         }
 
         auto parseKeyValuePair = [&]() {
@@ -2148,7 +4215,7 @@ private:
             if (!consumeToken(",").empty()) {
                 parseKeyValuePair();
             } else if (!consumeToken("}").empty()) {
-                return std::make_shared<DictExpr>(get_location(), std::move(elements));
+                return make_node<DictExpr>(get_location(), std::move(elements));
             } else {
                 throw std::runtime_error("Expected comma or closing brace in dictionary");
             }
@@ -2204,7 +4271,6 @@ private:
 
       TemplateTokenVector tokens;
       std::vector<std::string> group;
-      std::string text;
       std::smatch match;
 
       try {
@@ -2337,11 +4403,11 @@ private:
             }
           } else if (std::regex_search(it, end, match, non_text_open_regex)) {
             auto text_end = it + match.position();
-            text = std::string(it, text_end);
+            std::string_view text(&*it, text_end - it);
             it = text_end;
             tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
           } else {
-            text = std::string(it, end);
+            std::string_view text(&*it, end - it);
             it = end;
             tokens.push_back(std::make_unique<TextTemplateToken>(location, SpaceHandling::Keep, SpaceHandling::Keep, text));
           }
@@ -2376,7 +4442,7 @@ private:
               if (it == end || (*(it++))->type != TemplateToken::Type::EndIf) {
                   throw unterminated(**start);
               }
-              children.emplace_back(std::make_shared<IfNode>(token->location, std::move(cascade)));
+              children.emplace_back(make_node<IfNode>(token->location, std::move(cascade)));
           } else if (auto for_token = dynamic_cast<ForTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               auto else_body = std::shared_ptr<TemplateNode>();
@@ -2386,35 +4452,35 @@ private:
               if (it == end || (*(it++))->type != TemplateToken::Type::EndFor) {
                   throw unterminated(**start);
               }
-              children.emplace_back(std::make_shared<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body)));
+              children.emplace_back(make_node<ForNode>(token->location, std::move(for_token->var_names), std::move(for_token->iterable), std::move(for_token->condition), std::move(body), for_token->recursive, std::move(else_body)));
           } else if (dynamic_cast<GenerationTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndGeneration) {
                   throw unterminated(**start);
               }
-              // Treat as a no-op, as our scope is templates for inference, not training (`{% generation %}` wraps generated tokens for masking).
-              children.emplace_back(std::move(body));
+              // Renders as its body; `{% generation %}` wraps generated tokens for masking, whose spans can be recorded (see OutputSpans).
+              children.emplace_back(make_node<GenerationNode>(token->location, std::move(body)));
           } else if (auto text_token = dynamic_cast<TextTemplateToken*>(token.get())) {
               SpaceHandling pre_space = (it - 1) != begin ? (*(it - 2))->post_space : SpaceHandling::Keep;
               SpaceHandling post_space = it != end ? (*it)->pre_space : SpaceHandling::Keep;
 
+              // Whitespace control only ever trims the ends of the text: the node stays a span of the source.
               auto text = text_token->text;
+              auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'; };
               if (post_space == SpaceHandling::Strip) {
-                static std::regex trailing_space_regex(R"((\s|\r|\n)+$)");
-                text = std::regex_replace(text, trailing_space_regex, "");
+                while (!text.empty() && is_space(text.back())) text.remove_suffix(1);
               } else if (options.lstrip_blocks && it != end) {
                 auto i = text.size();
                 while (i > 0 && (text[i - 1] == ' ' || text[i - 1] == '\t')) i--;
                 if ((i == 0 && (it - 1) == begin) || (i > 0 && text[i - 1] == '\n')) {
-                  text.resize(i);
+                  text = text.substr(0, i);
                 }
               }
               if (pre_space == SpaceHandling::Strip) {
-                static std::regex leading_space_regex(R"(^(\s|\r|\n)+)");
-                text = std::regex_replace(text, leading_space_regex, "");
+                while (!text.empty() && is_space(text.front())) text.remove_prefix(1);
               } else if (options.trim_blocks && (it - 1) != begin && !dynamic_cast<ExpressionTemplateToken*>((*(it - 2)).get())) {
                 if (text.length() > 0 && text[0] == '\n') {
-                  text.erase(0, 1);
+                  text.remove_prefix(1);
                 }
               }
               if (it == end && !options.keep_trailing_newline) {
@@ -2422,15 +4488,15 @@ private:
                 if (i > 0 && text[i - 1] == '\n') {
                   i--;
                   if (i > 0 && text[i - 1] == '\r') i--;
-                  text.resize(i);
+                  text = text.substr(0, i);
                 }
               }
-              children.emplace_back(std::make_shared<TextNode>(token->location, text));
+              children.emplace_back(make_node<TextNode>(token->location, text.data() - template_str->data(), text.size()));
           } else if (auto expr_token = dynamic_cast<ExpressionTemplateToken*>(token.get())) {
-              children.emplace_back(std::make_shared<ExpressionNode>(token->location, std::move(expr_token->expr)));
+              children.emplace_back(make_node<ExpressionNode>(token->location, std::move(expr_token->expr)));
           } else if (auto set_token = dynamic_cast<SetTemplateToken*>(token.get())) {
             if (set_token->value) {
-              children.emplace_back(std::make_shared<SetNode>(token->location, set_token->ns, set_token->var_names, std::move(set_token->value)));
+              children.emplace_back(make_node<SetNode>(token->location, set_token->ns, set_token->var_names, std::move(set_token->value)));
             } else {
               auto value_template = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndSet) {
@@ -2439,24 +4505,24 @@ private:
               if (!set_token->ns.empty()) throw std::runtime_error("Namespaced set not supported in set with template value");
               if (set_token->var_names.size() != 1) throw std::runtime_error("Structural assignment not supported in set with template value");
               auto & name = set_token->var_names[0];
-              children.emplace_back(std::make_shared<SetTemplateNode>(token->location, name, std::move(value_template)));
+              children.emplace_back(make_node<SetTemplateNode>(token->location, name, std::move(value_template)));
             }
           } else if (auto macro_token = dynamic_cast<MacroTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndMacro) {
                   throw unterminated(**start);
               }
-              children.emplace_back(std::make_shared<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body)));
+              children.emplace_back(make_node<MacroNode>(token->location, std::move(macro_token->name), std::move(macro_token->params), std::move(body)));
           } else if (auto filter_token = dynamic_cast<FilterTemplateToken*>(token.get())) {
               auto body = parseTemplate(begin, it, end);
               if (it == end || (*(it++))->type != TemplateToken::Type::EndFilter) {
                   throw unterminated(**start);
               }
-              children.emplace_back(std::make_shared<FilterNode>(token->location, std::move(filter_token->filter), std::move(body)));
+              children.emplace_back(make_node<FilterNode>(token->location, std::move(filter_token->filter), std::move(body)));
           } else if (dynamic_cast<CommentTemplateToken*>(token.get())) {
               // Ignore comments
           } else if (auto ctrl_token = dynamic_cast<LoopControlTemplateToken*>(token.get())) {
-              children.emplace_back(std::make_shared<LoopControlNode>(token->location, ctrl_token->control_type));
+              children.emplace_back(make_node<LoopControlNode>(token->location, ctrl_token->control_type));
           } else if (dynamic_cast<EndForTemplateToken*>(token.get())
                   || dynamic_cast<EndSetTemplateToken*>(token.get())
                   || dynamic_cast<EndMacroTemplateToken*>(token.get())
@@ -2475,92 +4541,792 @@ private:
             throw unexpected(**it);
         }
         if (children.empty()) {
-          return std::make_shared<TextNode>(Location { template_str, 0 }, std::string());
+          return make_node<TextNode>(Location { template_str.get(), 0 }, 0, 0);
         } else if (children.size() == 1) {
           return std::move(children[0]);
         } else {
-          return std::make_shared<SequenceNode>(children[0]->location(), std::move(children));
+          return make_node<SequenceNode>(children[0]->location(), std::move(children));
         }
     }
 
 public:
 
-    static std::shared_ptr<TemplateNode> parse(const std::string& template_str, const Options & options) {
+    /*
+      Makes the arena that the nodes of `root`'s tree live in (and keep alive) own the source that their
+      locations and text spans point into.
+    */
+    static std::shared_ptr<TemplateNode> own_tree(std::shared_ptr<std::string> source, const std::shared_ptr<AstArena> & arena, std::shared_ptr<TemplateNode> root) {
+        arena->source = std::move(source);
+        return root;
+    }
+
+    /* The source is copied once (into the buffer that locations refer to): it needn't outlive the template. */
+    static std::shared_ptr<TemplateNode> parse(std::string_view template_str, const Options & options) {
         Parser parser(std::make_shared<std::string>(normalize_newlines(template_str)), options);
         auto tokens = parser.tokenize();
         TemplateTokenIterator begin = tokens.begin();
         auto it = begin;
         TemplateTokenIterator end = tokens.end();
-        return parser.parseTemplate(begin, it, end, /* full= */ true);
+        auto root = parser.parseTemplate(begin, it, end, /* full= */ true);
+        return own_tree(parser.template_str, parser.arena, std::move(root));
+    }
+};
+
+/*
+  Compiled form of a parsed template: its (normalized) source, kept for error locations, then its tree.
+  read_template consumes one template from the front of `in`, so several can be stored back to back.
+*/
+inline void write_template(const TemplateNode & root, std::string & out) {
+    AstWriter w(out);
+    auto source = root.location().source;
+    w.str(source ? *source : std::string());
+    root.serialize(w);
+}
+
+inline std::shared_ptr<TemplateNode> read_template(std::string_view & in) {
+    auto source = std::make_shared<std::string>(AstReader(in, nullptr).str());
+    auto arena = std::make_shared<AstArena>();
+    auto root = AstReader(in, source.get(), arena).node();
+    if (!root) throw std::runtime_error("Malformed compiled template");
+    return Parser::own_tree(std::move(source), arena, std::move(root));
+}
+
+/*
+  Thread-safe LRU cache of parsed templates, keyed by the template source and the parsing options.
+  Entries are spread over independently locked shards (each with its own LRU order), so concurrent
+  lookups of different templates don't contend on a single lock.
+  Cached trees are shared: render them concurrently, but never modify them.
+*/
+class TemplateCache {
+    struct Entry {
+        size_t key;
+        std::string source;
+        std::shared_ptr<const TemplateNode> root;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;  // Most recently used first
+        std::unordered_map<size_t, std::list<Entry>::iterator> index;
+    };
+
+    size_t shard_capacity_;
+    std::vector<Shard> shards_;
+    std::atomic<size_t> hits_ { 0 };
+    std::atomic<size_t> misses_ { 0 };
+
+    static size_t hash(const std::string & source, const Options & options) {
+        auto flags = (options.trim_blocks ? 1 : 0) | (options.lstrip_blocks ? 2 : 0) | (options.keep_trailing_newline ? 4 : 0);
+        return std::hash<std::string_view>()(source) * 31 + flags;
+    }
+
+public:
+    explicit TemplateCache(size_t capacity = 64, size_t shard_count = 8)
+        : shard_capacity_((std::max)((capacity + shard_count - 1) / (std::max)(shard_count, (size_t) 1), (size_t) 1)),
+          shards_((std::max)(shard_count, (size_t) 1)) {}
+
+    /* Parsed template for `source`, parsing it (outside of any lock) if it isn't cached yet. */
+    std::shared_ptr<const TemplateNode> get(const std::string & source, const Options & options) {
+        auto key = hash(source, options);
+        auto & shard = shards_[key % shards_.size()];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end() && it->second->source == source) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                hits_++;
+                return it->second->root;
+            }
+        }
+        misses_++;
+        std::shared_ptr<const TemplateNode> root = Parser::parse(source, options);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            // Parsed concurrently by another thread, or a hash collision: keep the latest.
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+        }
+        shard.lru.push_front({key, source, root});
+        shard.index[key] = shard.lru.begin();
+        while (shard.lru.size() > shard_capacity_) {
+            shard.index.erase(shard.lru.back().key);
+            shard.lru.pop_back();
+        }
+        return root;
+    }
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+    size_t size() {
+        size_t n = 0;
+        for (auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            n += shard.lru.size();
+        }
+        return n;
+    }
+    void clear() {
+        for (auto & shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.lru.clear();
+            shard.index.clear();
+        }
     }
 };
 
-static Value simple_function(const std::string & fn_name, const std::vector<std::string> & params, const std::function<Value(const std::shared_ptr<Context> &, Value & args)> & fn) {
-  std::map<std::string, size_t> named_positions;
-  for (size_t i = 0, n = params.size(); i < n; i++) named_positions[params[i]] = i;
+/*
+  Renders a conversation again after messages were appended to it, resuming the template's loop over
+  `messages` instead of starting over: the cost is that of the new messages, not of the whole history.
+
+  Each render keeps the output and a checkpoint taken before the last item of that loop (the variables in
+  scope at that point). The next render restarts from there if it's for the same template, its `messages`
+  start with the previous ones and its other fields are unchanged; otherwise it renders in full.
+  The loop must be at the top level of the template. Templates whose output before the last message may
+  depend on the messages after it (loop.length, loop.revindex, messages|length, messages[-1]...), or which
+  define macros elsewhere than at the top level, are always rendered in full.
+  Not thread-safe: use one per conversation.
+*/
+class IncrementalRender {
+    // Whether the output before the last item of `loop` can only depend on the items up to it.
+    class ResumeCheck : public AstVisitor {
+        const std::string & variable_;
+        std::unordered_set<const Expression *> allowed_;  // Uses of the variable / of `loop` known to be safe
+        bool in_loop_ = false;
+    public:
+        bool safe = true;
+        int64_t max_index = -1;  // Largest messages[i] read
+
+        ResumeCheck(const std::string & variable) : variable_(variable) {}
+
+        void check_prefix(const std::vector<std::shared_ptr<TemplateNode>> & nodes, size_t loop_position) {
+            for (size_t i = 0; i < loop_position; ++i) {
+                // Top-level macros are defined again when resuming, the others would refer to the previous render.
+                if (dynamic_cast<const MacroNode *>(nodes[i].get())) nodes[i]->visit_children(*this);
+                else node(nodes[i]);
+            }
+            in_loop_ = true;
+            node(static_cast<const ForNode &>(*nodes[loop_position]).get_body());
+        }
+        void visit(const Expression & e) override {
+            if (auto subscript = dynamic_cast<const SubscriptExpr *>(&e)) {
+                auto base = dynamic_cast<const VariableExpr *>(subscript->get_base().get());
+                auto index = dynamic_cast<const LiteralExpr *>(subscript->get_index().get());
+                if (base && index && base->get_name() == variable_) {
+                    auto & i = index->get_value();
+                    if (i.is_number_integer() && i.get<int64_t>() >= 0) {
+                        max_index = (std::max)(max_index, i.get<int64_t>());
+                        allowed_.insert(base);
+                    }
+                } else if (base && index && base->get_name() == "loop" && index->get_value().is_string()) {
+                    auto name = index->get_value().get<std::string>();
+                    if (name != "length" && name != "revindex" && name != "revindex0") allowed_.insert(base);
+                }
+            } else if (auto call = dynamic_cast<const MethodCallExpr *>(&e)) {
+                auto object = dynamic_cast<const VariableExpr *>(call->get_object().get());
+                if (object && object->get_name() == "loop" && call->get_method() == "cycle") allowed_.insert(object);
+            } else if (auto variable = dynamic_cast<const VariableExpr *>(&e)) {
+                auto name = variable->get_name();
+                if (!allowed_.count(&e) && (name == variable_ || (in_loop_ && name == "loop"))) safe = false;
+            }
+            e.visit_children(*this);
+        }
+        void visit(const TemplateNode & n) override {
+            if (dynamic_cast<const MacroNode *>(&n)) safe = false;
+            n.visit_children(*this);
+        }
+        void binds(const std::string & name) override {
+            if (name == variable_) safe = false;
+        }
+    };
+
+    std::string variable_;
+    std::shared_ptr<const TemplateNode> root_;
+    std::vector<std::shared_ptr<TemplateNode>> nodes_;  // Top-level nodes of root_
+    const ForNode * loop_ = nullptr;  // Loop over the messages in nodes_, if root_ can be resumed
+    size_t loop_position_ = 0;
+    int64_t max_index_ = -1;
+
+    std::shared_ptr<const json> data_;
+    std::string output_;
+    bool has_checkpoint_ = false;
+    struct {
+        size_t offset;  // Output before the item
+        size_t count;  // Number of messages
+        Value globals;  // Top-level variables
+        ForNode::LoopState loop;
+    } checkpoint_;
+
+    void analyze(const std::shared_ptr<const TemplateNode> & root) {
+        // The nodes of the previous template go before the tree holding them.
+        nodes_.clear();
+        loop_ = nullptr;
+        root_ = root;
+        if (auto sequence = dynamic_cast<const SequenceNode *>(root.get())) {
+            nodes_ = sequence->get_children();
+        } else {
+            nodes_.push_back(std::const_pointer_cast<TemplateNode>(root));
+        }
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            auto loop = dynamic_cast<const ForNode *>(nodes_[i].get());
+            if (!loop) continue;
+            auto iterable = dynamic_cast<const VariableExpr *>(loop->get_iterable().get());
+            if (!iterable || iterable->get_name() != variable_) continue;
+            if (loop->get_condition() || loop->is_recursive()) return;
+
+            ResumeCheck check(variable_);
+            check.check_prefix(nodes_, i);
+            if (!check.safe) return;
+            loop_ = loop;
+            loop_position_ = i;
+            max_index_ = check.max_index;
+            return;
+        }
+    }
+
+    // Whether `data` only appends messages to those of the last render, which can be resumed.
+    bool extends_previous(const json & data) const {
+        if (!has_checkpoint_ || !data.is_object() || data.size() != data_->size()) return false;
+        if (max_index_ >= (int64_t) checkpoint_.count) return false;
+        for (auto it = data.begin(); it != data.end(); ++it) {
+            auto previous = data_->find(it.key());
+            if (previous == data_->end()) return false;
+            if (it.key() != variable_) {
+                if (*it != *previous) return false;
+                continue;
+            }
+            if (!it->is_array() || it->size() < checkpoint_.count) return false;
+            for (size_t i = 0; i < checkpoint_.count; ++i) {
+                if ((*it)[i] != (*previous)[i]) return false;
+            }
+        }
+        return true;
+    }
 
-  return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
-    auto args_obj = Value::object();
-    std::vector<bool> provided_args(params.size());
-    for (size_t i = 0, n = args.args.size(); i < n; i++) {
-      auto & arg = args.args[i];
-      if (i < params.size()) {
-        args_obj.set(params[i], arg);
-        provided_args[i] = true;
-      } else {
-        throw std::runtime_error("Too many positional params for " + fn_name);
-      }
+public:
+    explicit IncrementalRender(std::string variable = "messages") : variable_(std::move(variable)) {}
+
+    /*
+      Renders `root` with `data` and returns the length of the prefix of the output that was kept from the
+      previous render (0 if it was rendered in full): output() only changed after it.
+    */
+    size_t render(const std::shared_ptr<const TemplateNode> & root, const std::shared_ptr<const json> & data) {
+        if (root != root_) {
+            analyze(root);
+            has_checkpoint_ = false;
+        }
+        Value::CopyScope copies;  // The checkpoint is saved with the mutations of this render
+        auto data_value = Value::from_json(data);
+        auto resume = loop_ && extends_previous(*data);
+        auto prefix = resume ? checkpoint_.offset : 0;
+        auto loop_state = checkpoint_.loop;
+        has_checkpoint_ = false;
+        output_.resize(prefix);
+
+        std::shared_ptr<Context> context;
+        std::ostringstream out;
+        size_t first_node = 0;
+        if (resume) {
+            // Back to the state before the last previous message, with the new messages and the top-level macros defined again.
+            context = Context::make(checkpoint_.globals.snapshot());
+            context->set(variable_, data_value.get(variable_));
+            for (size_t i = 0; i < loop_position_; ++i) {
+                if (dynamic_cast<const MacroNode *>(nodes_[i].get())) nodes_[i]->render(out, context);
+            }
+            first_node = loop_position_;
+        } else {
+            context = Context::make(Value(data_value));
+        }
+        auto on_item = [&](size_t index, size_t length, const std::function<ForNode::LoopState()> & save) {
+            if (index + 1 != length) return;
+            checkpoint_.offset = prefix + (size_t) out.tellp();
+            checkpoint_.count = length;
+            checkpoint_.globals = context->snapshot();
+            checkpoint_.loop = save();
+            has_checkpoint_ = true;
+        };
+        try {
+            for (size_t i = first_node; i < nodes_.size(); ++i) {
+                if (nodes_[i].get() != loop_) {
+                    nodes_[i]->render(out, context);
+                } else if (resume && i == first_node) {
+                    loop_->render_loop(out, context, &loop_state, on_item);
+                } else {
+                    loop_->render_loop(out, context, nullptr, on_item);
+                }
+            }
+        } catch (...) {
+            has_checkpoint_ = false;
+            output_.clear();
+            throw;
+        }
+        output_ += out.str();
+        data_ = data;
+        return prefix;
+    }
+
+    const std::string & output() const { return output_; }
+};
+
+/*
+  Renders a template again after a JSON Patch (RFC 6902) to its data, rendering only the top-level nodes
+  of the template that depend on what changed and splicing their output between the unchanged parts.
+
+  While each top-level node renders, the data it reads is recorded (the keys it looks up in objects and the
+  arrays / objects it reads whole), with the top-level variables before it. A patch marks the nodes that read
+  a patched location; they're rendered again from their saved variables, with the later nodes that use
+  variables they set. The data is kept (and patched in place) here, not shared with the caller.
+  Templates that define macros below the top level, or keep data (not copies of it) in variables, are
+  rendered in full on every patch. A template that is one big loop is also always rendered in full.
+  Not thread-safe.
+*/
+class PatchRender {
+    // Variables a node reads and assigns.
+    class NameCheck : public AstVisitor {
+    public:
+        std::unordered_set<std::string> reads, writes;
+        bool nested_macro = false;
+        bool unknown_write = false;  // A method may change a value not held by a variable
+
+        void visit(const Expression & e) override {
+            if (auto variable = dynamic_cast<const VariableExpr *>(&e)) {
+                reads.insert(variable->get_name());
+            } else if (auto call = dynamic_cast<const MethodCallExpr *>(&e)) {
+                // Other methods (append(), pop()...) may change the value in place: they write the variable it's reached through.
+                static const std::unordered_set<std::string> read_only { "items", "get", "strip", "endswith", "title" };
+                if (!read_only.count(call->get_method())) {
+                    auto object = call->get_object().get();
+                    while (auto subscript = dynamic_cast<const SubscriptExpr *>(object)) object = subscript->get_base().get();
+                    if (auto variable = dynamic_cast<const VariableExpr *>(object)) writes.insert(variable->get_name());
+                    else unknown_write = true;
+                }
+            }
+            e.visit_children(*this);
+        }
+        void visit(const TemplateNode & n) override {
+            if (dynamic_cast<const MacroNode *>(&n)) nested_macro = true;
+            if (auto loop = dynamic_cast<const ForNode *>(&n)) {
+                // Loop variables are local, unless a condition assigns them in the enclosing scope.
+                if (loop->get_condition()) {
+                    for (const auto & name : loop->get_var_names()) binds(name);
+                }
+                expr(loop->get_iterable());
+                expr(loop->get_condition());
+                node(loop->get_body());
+                node(loop->get_else_body());
+                return;
+            }
+            n.visit_children(*this);
+        }
+        void binds(const std::string & name) override {
+            writes.insert(name);
+        }
+    };
+
+    struct Part {
+        std::shared_ptr<TemplateNode> node;
+        bool is_macro = false;
+        std::unordered_set<std::string> names;  // Variables read or assigned (including by the macros it calls)
+        std::unordered_set<std::string> writes;
+        size_t begin = 0, end = 0;  // Output
+        Value::JsonReads reads;
+        std::shared_ptr<const Value> before;  // Top-level variables before the node
+    };
+
+    std::shared_ptr<const TemplateNode> root_;
+    std::vector<Part> parts_;
+    std::unordered_set<std::string> macro_names_;
+    bool incremental_ = false;
+    std::shared_ptr<json> document_;
+    std::string output_;
+
+    template <typename T>
+    static bool intersects(const std::unordered_set<T> & a, const std::unordered_set<T> & b) {
+        if (a.size() > b.size()) return intersects(b, a);
+        for (const auto & item : a) if (b.count(item)) return true;
+        return false;
+    }
+
+    void analyze(const std::shared_ptr<const TemplateNode> & root) {
+        parts_.clear();  // Before the tree holding their nodes
+        root_ = root;
+        macro_names_.clear();
+        incremental_ = true;
+        std::vector<std::shared_ptr<TemplateNode>> nodes;
+        if (auto sequence = dynamic_cast<const SequenceNode *>(root.get())) {
+            nodes = sequence->get_children();
+        } else {
+            nodes.push_back(std::const_pointer_cast<TemplateNode>(root));
+        }
+        // What macros read and assign happens in the nodes that call them.
+        std::unordered_set<std::string> macro_names;
+        NameCheck macros;
+        for (const auto & node : nodes) {
+            if (auto macro = dynamic_cast<const MacroNode *>(node.get())) {
+                macro_names.insert(macro->get_name());
+                macro->visit_children(macros);
+            }
+        }
+        macro_names_ = macro_names;
+        for (const auto & node : nodes) {
+            Part part;
+            part.node = node;
+            part.is_macro = dynamic_cast<const MacroNode *>(node.get()) != nullptr;
+            NameCheck check;
+            if (part.is_macro) node->visit_children(check);
+            else check.visit(*node);
+            if (check.nested_macro || macros.nested_macro || check.unknown_write || macros.unknown_write) incremental_ = false;
+            part.names = check.reads;
+            part.names.insert(check.writes.begin(), check.writes.end());
+            part.writes = check.writes;
+            if (intersects(part.names, macro_names)) {
+                part.names.insert(macros.reads.begin(), macros.reads.end());
+                part.names.insert(macros.writes.begin(), macros.writes.end());
+                part.writes.insert(macros.writes.begin(), macros.writes.end());
+                // Variables it assigns may hold a macro too.
+                macro_names.insert(check.writes.begin(), check.writes.end());
+            }
+            parts_.push_back(std::move(part));
+        }
+    }
+
+    // Top-level variables, which must not refer to the data (patched in place) or to macros of a previous render.
+    std::shared_ptr<const Value> save(const std::shared_ptr<Context> & context) {
+        auto values = context->snapshot();
+        for (const auto & key : values.keys()) {
+            if (values.get(key).is_callable() && !(key.is_string() && macro_names_.count(key.get<std::string>()))) incremental_ = false;
+        }
+        if (values.refers_to_json()) incremental_ = false;
+        return std::make_shared<const Value>(std::move(values));
+    }
+
+    void render_part(Part & part, std::ostringstream & out, const std::shared_ptr<Context> & context) {
+        part.reads = {};
+        auto previous = Value::record_json_reads(&part.reads);
+        try {
+            part.node->render(out, context);
+        } catch (...) {
+            Value::record_json_reads(previous);
+            throw;
+        }
+        Value::record_json_reads(previous);
+    }
+
+    // Templates may write to the data through methods (e.g. append()): such changes are lost when re-rendering.
+    void check_data(const std::shared_ptr<Context> & data_context) {
+        if (!data_context->snapshot().is_frozen() || Value::copied_any()) incremental_ = false;
+    }
+
+    void render_all() {
+        Value::CopyScope copies;  // Of all the nodes, as one render
+        auto data_context = Context::make(Value::from_json(document_));
+        auto context = Context::make(Value::object(), data_context);
+        std::ostringstream out;
+        std::shared_ptr<const Value> before;
+        for (size_t i = 0; i < parts_.size(); ++i) {
+            auto & part = parts_[i];
+            if (!before || !parts_[i - 1].writes.empty()) before = save(context);
+            part.before = before;
+            part.begin = (size_t) out.tellp();
+            render_part(part, out, context);
+            part.end = (size_t) out.tellp();
+        }
+        output_ = out.str();
+        check_data(data_context);
+    }
+
+    // Marks the nodes that read the location at `path` (or something in it); `adds` if the operation adds a value there.
+    void mark(const std::string & path, bool adds, std::vector<bool> & affected) const {
+        std::vector<std::string> tokens;
+        for (json::json_pointer pointer(path); !pointer.empty(); pointer.pop_back()) tokens.push_back(pointer.back());
+        std::reverse(tokens.begin(), tokens.end());
+
+        // Arrays / objects on the way see a change in their contents; so do readers of the object's key.
+        std::unordered_set<const void *> ancestors;
+        const json * parent = nullptr;
+        const json * node = document_.get();
+        for (const auto & token : tokens) {
+            if (!node->is_structured()) {
+                node = nullptr;
+                break;
+            }
+            ancestors.insert(Value::json_id(*node));
+            parent = node;
+            const json * child = nullptr;
+            if (node->is_object()) {
+                auto it = node->find(token);
+                if (it != node->end()) child = &*it;
+            } else if (!token.empty() && token.find_first_not_of("0123456789") == std::string::npos && std::stoull(token) < node->size()) {
+                child = &(*node)[std::stoull(token)];
+            }
+            node = child;
+            if (!node) break;
+        }
+        // Everything in the previous value at that location changes.
+        std::unordered_set<const void *> changed;
+        std::function<void(const json &)> collect = [&](const json & n) {
+            if (!n.is_structured()) return;
+            changed.insert(Value::json_id(n));
+            for (const auto & child : n) collect(child);
+        };
+        if (node) collect(*node);
+        if (adds && !node && parent && parent->is_object()) {
+            // A new key that makes the object reallocate its storage copies the values of the other keys.
+            const auto & object = parent->get_ref<const json::object_t &>();
+            if (object.size() == object.capacity()) {
+                for (const auto & item : object) collect(item.second);
+            }
+        }
+        const void * key_parent = parent && parent->is_object() ? Value::json_id(*parent) : nullptr;
+        auto & key = tokens.empty() ? path : tokens.back();
+
+        for (size_t i = 0; i < parts_.size(); ++i) {
+            if (affected[i]) continue;
+            const auto & reads = parts_[i].reads;
+            auto touched = false;
+            for (auto id : ancestors) touched = touched || reads.containers.count(id);
+            if (key_parent) {
+                auto it = reads.keys.find(key_parent);
+                touched = touched || (it != reads.keys.end() && it->second.count(key));
+            }
+            if (changed.size() <= reads.containers.size() + reads.keys.size()) {
+                for (auto id : changed) touched = touched || reads.containers.count(id) || reads.keys.count(id);
+            } else {
+                for (auto id : reads.containers) touched = touched || changed.count(id);
+                for (const auto & item : reads.keys) touched = touched || changed.count(item.first);
+            }
+            affected[i] = touched;
+        }
+    }
+
+    size_t render_again(const std::vector<bool> & affected) {
+        Value::CopyScope copies;  // See render_all
+        auto data_context = Context::make(Value::from_json(document_));
+        std::shared_ptr<Context> context;  // From the first node rendered again on
+        std::vector<std::shared_ptr<const Value>> previous_before;
+        for (const auto & part : parts_) previous_before.push_back(part.before);
+        std::unordered_set<std::string> dirty;  // Variables assigned by nodes rendered again
+        std::string output;
+        output.reserve(output_.size());
+        std::ostringstream discard;
+        std::shared_ptr<const Value> before;
+        size_t count = 0;
+
+        for (size_t i = 0; i < parts_.size(); ++i) {
+            auto & part = parts_[i];
+            if (context) {
+                if (!before || !parts_[i - 1].writes.empty()) before = save(context);
+                part.before = before;
+            }
+            if (!affected[i] && !intersects(part.names, dirty)) {
+                if (context && part.is_macro) {
+                    part.node->render(discard, context);
+                } else if (context && i + 1 < parts_.size()) {
+                    // Same inputs as in the previous render: its variables have the values they had after it.
+                    for (const auto & name : part.writes) {
+                        if (previous_before[i + 1]->contains(name)) context->set(name, previous_before[i + 1]->get(name).snapshot());
+                    }
+                }
+                auto begin = output.size();
+                output.append(output_, part.begin, part.end - part.begin);
+                part.begin = begin;
+                part.end = output.size();
+                continue;
+            }
+            if (!context) {
+                context = Context::make(part.before->snapshot(), data_context);
+                before = part.before;
+                for (size_t j = 0; j < i; ++j) {
+                    if (parts_[j].is_macro) parts_[j].node->render(discard, context);
+                }
+            }
+            std::ostringstream out;
+            render_part(part, out, context);
+            part.begin = output.size();
+            output += out.str();
+            part.end = output.size();
+            dirty.insert(part.writes.begin(), part.writes.end());
+            ++count;
+        }
+        output_ = std::move(output);
+        check_data(data_context);
+        return count;
+    }
+
+    void reset() {
+        parts_.clear();  // Before the tree holding their nodes
+        root_.reset();
+        document_.reset();
+        output_.clear();
+    }
+
+public:
+    /* Renders `root` with `data` in full (keeping both for apply()). */
+    void render(const std::shared_ptr<const TemplateNode> & root, json data) {
+        reset();
+        analyze(root);
+        document_ = std::make_shared<json>(std::move(data));
+        try {
+            render_all();
+        } catch (...) {
+            reset();
+            throw;
+        }
+    }
+
+    /*
+      Applies `patch` to the data and renders the nodes that depend on the changes again.
+      Returns the number of top-level nodes rendered again. If it throws (e.g. the patch doesn't apply), the
+      data may be partly patched: start again with render().
+    */
+    size_t apply(const json & patch) {
+        if (!document_) throw std::runtime_error("No render to patch");
+        if (!patch.is_array()) throw std::runtime_error("A JSON Patch must be an array of operations");
+        try {
+            if (!incremental_) {
+                document_->patch_inplace(patch);
+                render_all();
+                return parts_.size();
+            }
+            std::vector<bool> affected(parts_.size(), false);
+            for (const auto & operation : patch) {
+                // Each operation applies to the result of the previous ones: mark the nodes before applying it.
+                if (operation.is_object() && operation.contains("op") && operation.contains("path")) {
+                    auto op = operation["op"].get<std::string>();
+                    if (op == "add" || op == "remove" || op == "replace" || op == "copy" || op == "move") {
+                        mark(operation["path"].get<std::string>(), op != "remove" && op != "replace", affected);
+                    }
+                    if (op == "move") mark(operation.at("from").get<std::string>(), false, affected);
+                }
+                document_->patch_inplace(json::array({operation}));
+            }
+            return render_again(affected);
+        } catch (...) {
+            reset();
+            throw;
+        }
+    }
+
+    const std::string & output() const { return output_; }
+    const json & data() const {
+        if (!document_) throw std::runtime_error("No render");
+        return *document_;
+    }
+};
+
+/* Converts a bound argument (null if not provided) to the type of the native function's parameter. */
+template <typename T>
+struct NativeArg {
+  static T convert(const Value * arg, const std::string & name, const std::string & fn_name) {
+    if (!arg) throw std::runtime_error("Missing argument " + name + " for function " + fn_name);
+    return arg->get<T>();
+  }
+};
+template <>
+struct NativeArg<Value> {
+  static const Value & convert(const Value * arg, const std::string & name, const std::string & fn_name) {
+    if (!arg) throw std::runtime_error("Missing argument " + name + " for function " + fn_name);
+    return *arg;
+  }
+};
+template <typename T>
+struct NativeArg<std::optional<T>> {
+  static std::optional<T> convert(const Value * arg, const std::string & name, const std::string & fn_name) {
+    if (!arg) return std::nullopt;
+    return NativeArg<T>::convert(arg, name, fn_name);
+  }
+};
+
+template <typename F>
+struct NativeSignature : NativeSignature<decltype(&F::operator())> {};
+template <typename C, typename R, typename... Args>
+struct NativeSignature<R (C::*)(const std::shared_ptr<Context> &, Args...) const> {
+  static constexpr size_t arity = sizeof...(Args);
+  template <size_t I>
+  using Arg = std::decay_t<std::tuple_element_t<I, std::tuple<Args...>>>;
+};
+
+template <typename F, size_t N, size_t... I>
+static Value native_call(const F & fn, const std::shared_ptr<Context> & context, const std::array<const Value *, N> & bound,
+                         const std::vector<std::string> & params, const std::string & fn_name, std::index_sequence<I...>) {
+  return Value(fn(context, NativeArg<typename NativeSignature<F>::template Arg<I>>::convert(bound[I], params[I], fn_name)...));
+}
+
+/*
+  Exposes `fn(context, args...)` as a template callable: each of its parameters is bound to the positional
+  argument at the same index, or to the keyword argument named like it in `params`.
+  Parameters may be `const Value &`, `std::string`, `int64_t`, `double` or `bool`, or a `std::optional` of one of those
+  for optional arguments.
+*/
+template <typename F>
+static Value native_function(const std::string & fn_name, const std::vector<std::string> & params, F fn) {
+  constexpr auto arity = NativeSignature<F>::arity;
+  if (params.size() != arity) throw std::runtime_error("Wrong number of parameter names for function " + fn_name);
+  for (size_t i = 0; i < arity; i++) {
+    if (std::find(params.begin(), params.begin() + i, params[i]) != params.begin() + i) {
+      throw std::runtime_error("Duplicate parameter " + params[i] + " for function " + fn_name);
     }
+  }
+
+  return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) -> Value {
+    if (args.args.size() > arity) throw std::runtime_error("Too many positional params for " + fn_name);
+    std::array<const Value *, arity> bound {};
+    for (size_t i = 0, n = args.args.size(); i < n; i++) bound[i] = &args.args[i];
     for (auto & [name, value] : args.kwargs) {
-      auto named_pos_it = named_positions.find(name);
-      if (named_pos_it == named_positions.end()) {
+      auto it = std::find(params.begin(), params.end(), name);
+      if (it == params.end()) {
         throw std::runtime_error("Unknown argument " + name + " for function " + fn_name);
       }
-      provided_args[named_pos_it->second] = true;
-      args_obj.set(name, value);
+      bound[it - params.begin()] = &value;
     }
-    return fn(context, args_obj);
+    return native_call(fn, context, bound, params, fn_name, std::make_index_sequence<arity>());
   });
 }
 
-inline std::shared_ptr<Context> Context::builtins() {
+inline const std::shared_ptr<Context> & Context::builtins() {
+  static const std::shared_ptr<Context> builtins = make_builtins();
+  return builtins;
+}
+
+inline std::shared_ptr<Context> Context::make_builtins() {
   auto globals = Value::object();
 
-  globals.set("raise_exception", simple_function("raise_exception", { "message" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-    throw std::runtime_error(args.at("message").get<std::string>());
+  globals.set("raise_exception", native_function("raise_exception", { "message" }, [](const std::shared_ptr<Context> &, const std::string & message) -> Value {
+    throw std::runtime_error(message);
   }));
-  globals.set("tojson", simple_function("tojson", { "value", "indent" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value(args.at("value").dump(args.get<int64_t>("indent", -1), /* tojson= */ true));
+  globals.set("tojson", native_function("tojson", { "value", "indent" }, [](const std::shared_ptr<Context> &, const Value & value, std::optional<int64_t> indent) {
+    return value.dump(indent.value_or(-1), /* tojson= */ true);
   }));
-  globals.set("items", simple_function("items", { "object" }, [](const std::shared_ptr<Context> &, Value & args) {
+  globals.set("items", native_function("items", { "object" }, [](const std::shared_ptr<Context> &, const std::optional<Value> & obj) {
     auto items = Value::array();
-    if (args.contains("object")) {
-      auto & obj = args.at("object");
-      if (obj.is_string()) {
-        auto json_obj = json::parse(obj.get<std::string>());
+    if (obj) {
+      if (obj->is_string()) {
+        auto json_obj = json::parse(obj->get<std::string>());
         for (const auto & kv : json_obj.items()) {
           items.push_back(Value::array({kv.key(), kv.value()}));
         }
-      } else if (!obj.is_null()) {
-        for (auto & key : obj.keys()) {
-          items.push_back(Value::array({key, obj.at(key)}));
-        }
+      } else if (!obj->is_null()) {
+        return obj->items();
       }
     }
     return items;
   }));
-  globals.set("last", simple_function("last", { "items" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto items = args.at("items");
+  globals.set("first", native_function("first", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
+    if (!items.is_iterable()) throw std::runtime_error("object is not iterable");
+    Value res;
+    items.iterate([&](const Value & item) { res = item; return false; });
+    return res;
+  }));
+  globals.set("last", native_function("last", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
     if (!items.is_array()) throw std::runtime_error("object is not a list");
-    if (items.size() == 0) return Value();
-    return items.at(items.size() - 1);
+    Value res;
+    items.for_each([&](const Value & item) { res = item; });
+    return res;
   }));
-  globals.set("trim", simple_function("trim", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto & text = args.at("text");
+  globals.set("trim", native_function("trim", { "text" }, [](const std::shared_ptr<Context> &, const Value & text) {
     return text.is_null() ? text : Value(strip(text.get<std::string>()));
   }));
-  globals.set("lower", simple_function("lower", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto text = args.at("text");
+  globals.set("lower", native_function("lower", { "text" }, [](const std::shared_ptr<Context> &, const Value & text) {
     if (text.is_null()) return text;
     std::string res;
     auto str = text.get<std::string>();
@@ -2582,29 +5348,25 @@ inline std::shared_ptr<Context> Context::builtins() {
     }
     return boolean ? (value.to_bool() ? value : default_value) : value.is_null() ? default_value : value;
   }));
-  auto escape = simple_function("escape", { "text" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value(html_escape(args.at("text").get<std::string>()));
+  auto escape = native_function("escape", { "text" }, [](const std::shared_ptr<Context> &, const std::string & text) {
+    return html_escape(text);
   });
   globals.set("e", escape);
   globals.set("escape", escape);
-  globals.set("joiner", simple_function("joiner", { "sep" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto sep = args.get<std::string>("sep", "");
+  globals.set("joiner", native_function("joiner", { "sep" }, [](const std::shared_ptr<Context> &, std::optional<std::string> sep) {
     auto first = std::make_shared<bool>(true);
-    return simple_function("", {}, [sep, first](const std::shared_ptr<Context> &, const Value &) -> Value {
+    return native_function("", {}, [sep = sep.value_or(""), first](const std::shared_ptr<Context> &) -> Value {
       if (*first) {
         *first = false;
         return "";
       }
       return sep;
     });
-    return Value(html_escape(args.at("text").get<std::string>()));
   }));
-  globals.set("count", simple_function("count", { "items" }, [](const std::shared_ptr<Context> &, Value & args) {
-    return Value((int64_t) args.at("items").size());
+  globals.set("count", native_function("count", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
+    return (int64_t) items.size();
   }));
-  globals.set("dictsort", simple_function("dictsort", { "value" }, [](const std::shared_ptr<Context> &, Value & args) {
-    if (args.size() != 1) throw std::runtime_error("dictsort expects exactly 1 argument (TODO: fix implementation)");
-    auto & value = args.at("value");
+  globals.set("dictsort", native_function("dictsort", { "value" }, [](const std::shared_ptr<Context> &, const Value & value) {
     auto keys = value.keys();
     std::sort(keys.begin(), keys.end());
     auto res = Value::array();
@@ -2613,25 +5375,23 @@ inline std::shared_ptr<Context> Context::builtins() {
     }
     return res;
   }));
-  globals.set("join", simple_function("join", { "items", "d" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto do_join = [](Value & items, const std::string & sep) {
+  globals.set("join", native_function("join", { "items", "d" }, [](const std::shared_ptr<Context> &, const std::optional<Value> & items, std::optional<std::string> d) {
+    auto do_join = [](const Value & items, const std::string & sep) {
       if (!items.is_array()) throw std::runtime_error("object is not iterable: " + items.dump());
       std::ostringstream oss;
       auto first = true;
-      for (size_t i = 0, n = items.size(); i < n; ++i) {
+      items.for_each([&](const Value & item) {
         if (first) first = false;
         else oss << sep;
-        oss << items.at(i).to_str();
-      }
+        oss << item.to_str();
+      });
       return Value(oss.str());
     };
-    auto sep = args.get<std::string>("d", "");
-    if (args.contains("items")) {
-        auto & items = args.at("items");
-        return do_join(items, sep);
+    auto sep = d.value_or("");
+    if (items) {
+        return do_join(*items, sep);
     } else {
-      return simple_function("", {"items"}, [sep, do_join](const std::shared_ptr<Context> &, Value & args) {
-        auto & items = args.at("items");
+      return native_function("", {"items"}, [sep, do_join](const std::shared_ptr<Context> &, const Value & items) {
         if (!items.to_bool() || !items.is_array()) throw std::runtime_error("join expects an array for items, got: " + items.dump());
         return do_join(items, sep);
       });
@@ -2641,61 +5401,47 @@ inline std::shared_ptr<Context> Context::builtins() {
     auto ns = Value::object();
     args.expectArgs("namespace", {0, 0}, {0, (std::numeric_limits<size_t>::max)()});
     for (auto & [name, value] : args.kwargs) {
-      ns.set(name, value);
+      ns.set(name, value.materialize());
     }
     return ns;
   }));
-  auto equalto = simple_function("equalto", { "expected", "actual" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("actual") == args.at("expected");
+  auto equalto = native_function("equalto", { "expected", "actual" }, [](const std::shared_ptr<Context> &, const Value & expected, const Value & actual) {
+      return actual == expected;
   });
   globals.set("equalto", equalto);
   globals.set("==", equalto);
-  globals.set("length", simple_function("length", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
+  globals.set("length", native_function("length", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
       return (int64_t) items.size();
   }));
-  globals.set("safe", simple_function("safe", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_str();
+  globals.set("safe", native_function("safe", { "value" }, [](const std::shared_ptr<Context> &, const Value & value) {
+      return value.to_str();
   }));
-  globals.set("string", simple_function("string", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_str();
+  globals.set("string", native_function("string", { "value" }, [](const std::shared_ptr<Context> &, const Value & value) {
+      return value.to_str();
   }));
-  globals.set("int", simple_function("int", { "value" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      return args.at("value").to_int();
+  globals.set("int", native_function("int", { "value" }, [](const std::shared_ptr<Context> &, const Value & value) {
+      return value.to_int();
   }));
-  globals.set("list", simple_function("list", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
+  globals.set("list", native_function("list", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
       if (!items.is_array()) throw std::runtime_error("object is not iterable");
-      return items;
+      return items.materialize();
   }));
-  globals.set("unique", simple_function("unique", { "items" }, [](const std::shared_ptr<Context> &, Value & args) -> Value {
-      auto & items = args.at("items");
+  globals.set("unique", native_function("unique", { "items" }, [](const std::shared_ptr<Context> &, const Value & items) {
       if (!items.is_array()) throw std::runtime_error("object is not iterable");
       std::unordered_set<Value> seen;
       auto result = Value::array();
-      for (size_t i = 0, n = items.size(); i < n; i++) {
-        auto pair = seen.insert(items.at(i));
+      items.for_each([&](const Value & item) {
+        auto pair = seen.insert(item);
         if (pair.second) {
-          result.push_back(items.at(i));
+          result.push_back(item);
         }
-      }
+      });
       return result;
   }));
-  auto make_filter = [](const Value & filter, Value & extra_args) -> Value {
-    return simple_function("", { "value" }, [=](const std::shared_ptr<Context> & context, Value & args) {
-      auto & value = args.at("value");
-      ArgumentsValue actual_args;
-      actual_args.args.emplace_back(value);
-      for (size_t i = 0, n = extra_args.size(); i < n; i++) {
-        actual_args.args.emplace_back(extra_args.at(i));
-      }
-      return filter.call(context, actual_args);
-    });
-  };
-  auto select_or_reject = [make_filter](bool is_select) {
+  auto select_or_reject = [](bool is_select) {
     return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
       args.expectArgs(is_select ? "select" : "reject", {2, (std::numeric_limits<size_t>::max)()}, {0, 0});
-      auto & items = args.args[0];
+      const auto & items = args.args[0];
       if (items.is_null())
         return Value::array();
       if (!items.is_array()) throw std::runtime_error("object is not iterable: " + items.dump());
@@ -2703,39 +5449,28 @@ inline std::shared_ptr<Context> Context::builtins() {
       auto filter_fn = context->get(args.args[1]);
       if (filter_fn.is_null()) throw std::runtime_error("Undefined filter: " + args.args[1].dump());
 
-      auto filter_args = Value::array();
+      ArgumentsValue filter_args { {Value()}, {} };
       for (size_t i = 2, n = args.args.size(); i < n; i++) {
-        filter_args.push_back(args.args[i]);
-      }
-      auto filter = make_filter(filter_fn, filter_args);
-
-      auto res = Value::array();
-      for (size_t i = 0, n = items.size(); i < n; i++) {
-        auto & item = items.at(i);
-        ArgumentsValue filter_args;
-        filter_args.args.emplace_back(item);
-        auto pred_res = filter.call(context, filter_args);
-        if (pred_res.to_bool() == (is_select ? true : false)) {
-          res.push_back(item);
-        }
+        filter_args.args.emplace_back(args.args[i]);
       }
-      return res;
+      return Value::pipeline(items, [=](Value & item) mutable {
+        filter_args.args[0] = item;
+        return filter_fn.call(context, filter_args).to_bool() == is_select;
+      }, /* keeps_size= */ false);
     });
   };
   globals.set("select", select_or_reject(/* is_select= */ true));
   globals.set("reject", select_or_reject(/* is_select= */ false));
   globals.set("map", Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
-    auto res = Value::array();
     if (args.args.size() == 1 &&
       ((args.has_named("attribute") && args.kwargs.size() == 1) || (args.has_named("default") && args.kwargs.size() == 2))) {
-      auto & items = args.args[0];
       auto attr_name = args.get_named("attribute");
       auto default_value = args.get_named("default");
-      for (size_t i = 0, n = items.size(); i < n; i++) {
-        auto & item = items.at(i);
+      return Value::pipeline(args.args[0], [=](Value & item) {
         auto attr = item.get(attr_name);
-        res.push_back(attr.is_null() ? default_value : attr);
-      }
+        item = attr.is_null() ? default_value : attr;
+        return true;
+      }, /* keeps_size= */ true);
     } else if (args.kwargs.empty() && args.args.size() >= 2) {
       auto fn = context->get(args.args[1]);
       if (fn.is_null()) throw std::runtime_error("Undefined filter: " + args.args[1].dump());
@@ -2743,21 +5478,19 @@ inline std::shared_ptr<Context> Context::builtins() {
       for (size_t i = 2, n = args.args.size(); i < n; i++) {
         filter_args.args.emplace_back(args.args[i]);
       }
-      for (size_t i = 0, n = args.args[0].size(); i < n; i++) {
-        auto & item = args.args[0].at(i);
+      return Value::pipeline(args.args[0], [=](Value & item) mutable {
         filter_args.args[0] = item;
-        res.push_back(fn.call(context, filter_args));
-      }
+        item = fn.call(context, filter_args);
+        return true;
+      }, /* keeps_size= */ true);
     } else {
       throw std::runtime_error("Invalid or unsupported arguments for map");
     }
-    return res;
   }));
-  globals.set("indent", simple_function("indent", { "text", "indent", "first" }, [](const std::shared_ptr<Context> &, Value & args) {
-    auto text = args.at("text").get<std::string>();
-    auto first = args.get<bool>("first", false);
+  globals.set("indent", native_function("indent", { "text", "indent", "first" }, [](const std::shared_ptr<Context> &, const std::string & text, std::optional<int64_t> indent_width, std::optional<bool> first_opt) {
+    auto first = first_opt.value_or(false);
     std::string out;
-    std::string indent(args.get<int64_t>("indent", 0), ' ');
+    std::string indent(indent_width.value_or(0), ' ');
     std::istringstream iss(text);
     std::string line;
     auto is_first = true;
@@ -2774,11 +5507,11 @@ inline std::shared_ptr<Context> Context::builtins() {
   auto select_or_reject_attr = [](bool is_select) {
     return Value::callable([=](const std::shared_ptr<Context> & context, ArgumentsValue & args) {
       args.expectArgs(is_select ? "selectattr" : "rejectattr", {2, (std::numeric_limits<size_t>::max)()}, {0, 0});
-      auto & items = args.args[0];
+      const auto & items = args.args[0];
       if (items.is_null())
         return Value::array();
       if (!items.is_array()) throw std::runtime_error("object is not iterable: " + items.dump());
-      auto attr_name = args.args[1].get<std::string>();
+      Value attr_name = args.args[1].get<std::string>();
 
       bool has_test = false;
       Value test_fn;
@@ -2793,20 +5526,16 @@ inline std::shared_ptr<Context> Context::builtins() {
         test_args.kwargs = args.kwargs;
       }
 
-      auto res = Value::array();
-      for (size_t i = 0, n = items.size(); i < n; i++) {
-        auto & item = items.at(i);
-        auto attr = item.get(attr_name);
-        if (has_test) {
-          test_args.args[0] = attr;
-          if (test_fn.call(context, test_args).to_bool() == (is_select ? true : false)) {
-            res.push_back(item);
-          }
-        } else {
-          res.push_back(attr);
-        }
+      if (!has_test) {
+        return Value::pipeline(items, [=](Value & item) {
+          item = item.get(attr_name);
+          return true;
+        }, /* keeps_size= */ true);
       }
-      return res;
+      return Value::pipeline(items, [=](Value & item) mutable {
+        test_args.args[0] = item.get(attr_name);
+        return test_fn.call(context, test_args).to_bool() == is_select;
+      }, /* keeps_size= */ false);
     });
   };
   globals.set("selectattr", select_or_reject_attr(/* is_select= */ true));
@@ -2845,20 +5574,18 @@ inline std::shared_ptr<Context> Context::builtins() {
     int64_t end = startEndStep[1];
     int64_t step = param_set[2] ? startEndStep[2] : 1;
 
-    auto res = Value::array();
-    if (step > 0) {
-      for (int64_t i = start; i < end; i += step) {
-        res.push_back(Value(i));
+    if (step == 0) throw std::runtime_error("range() step must not be zero");
+    auto count = (size_t) (step > 0 ? (end > start ? (end - start + step - 1) / step : 0)
+                                     : (start > end ? (start - end - step - 1) / -step : 0));
+    return Value::sequence([start, step, count](const std::function<bool(const Value &)> & yield) {
+      for (size_t i = 0; i < count; i++) {
+        RenderBudget::step();
+        if (!yield(Value(start + (int64_t) i * step))) return;
       }
-    } else {
-      for (int64_t i = start; i > end; i += step) {
-        res.push_back(Value(i));
-      }
-    }
-    return res;
+    }, [count]() { return count; });
   }));
 
-  return std::make_shared<Context>(std::move(globals));
+  return std::make_shared<BuiltinsContext>(std::move(globals));
 }
 
 inline std::shared_ptr<Context> Context::make(Value && values, const std::shared_ptr<Context> & parent) {
@@ -0,0 +1,420 @@
+#include "cminja.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "json.hpp"
+#include "yaml.hpp"
+#include "minja.hpp"
+#include "tokenizer.hpp"
+
+using json = nlohmann::ordered_json;
+
+struct cminja_template {
+    std::shared_ptr<const minja::TemplateNode> root;
+    std::shared_ptr<const TokenizedTemplate> tokens;  // Set by cminja_template_set_tokenizer
+};
+
+struct cminja_data {
+    std::shared_ptr<const json> document;
+    minja::Value value;
+};
+
+struct cminja_incremental {
+    minja::IncrementalRender render;
+};
+
+struct cminja_patch_render {
+    minja::PatchRender render;
+};
+
+struct cminja_tokenizer {
+    std::shared_ptr<const Tokenizer> tokenizer;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+// Read-only stream over a caller's buffer (the YAML parser reads from a stream).
+struct MemoryBuffer : std::streambuf {
+    MemoryBuffer(const char* data, size_t size) {
+        auto begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+// Output stream buffer writing into [begin, begin + capacity), then only counting the bytes that don't fit.
+class ArrayBuffer : public std::streambuf {
+  public:
+    ArrayBuffer(char* begin, size_t capacity) : begin_(begin), capacity_(capacity) {}
+
+    // Size of the whole output, written or not.
+    size_t size() const { return size_; }
+
+  protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        auto fits = std::min(size_t(n), capacity_ - std::min(size_, capacity_));
+        if (fits) std::memcpy(begin_ + size_, s, fits);
+        size_ += size_t(n);
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+    // Only tells the position (tellp), which renders use to measure their output.
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+        return pos_type(off_type(size_));
+    }
+
+  private:
+    char* begin_;
+    size_t capacity_;
+    size_t size_ = 0;
+};
+
+// Thrown by SinkBuffer when the sink returns non-zero: aborts the render.
+struct SinkAborted : std::runtime_error {
+    SinkAborted() : std::runtime_error("Render aborted by the sink") {}
+};
+
+// Output stream buffer passing the output to a sink in chunks, as it's rendered.
+class SinkBuffer : public std::streambuf {
+  public:
+    SinkBuffer(cminja_sink sink, void* user_data) : sink_(sink), user_data_(user_data) {
+        setp(chunk_, chunk_ + sizeof(chunk_));
+    }
+
+    // Sends the rest of the output.
+    void finish() { send(); }
+    bool aborted() const { return aborted_; }
+
+  protected:
+    int_type overflow(int_type c) override {
+        send();
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+        return pos_type(off_type(sent_ + size_t(pptr() - pbase())));
+    }
+
+  private:
+    cminja_sink sink_;
+    void* user_data_;
+    size_t sent_ = 0;
+    bool aborted_ = false;
+    char chunk_[16384];
+
+    void send() {
+        auto size = size_t(pptr() - pbase());
+        setp(chunk_, chunk_ + sizeof(chunk_));
+        sent_ += size;
+        if (size && sink_(user_data_, chunk_, size) != 0) {
+            aborted_ = true;
+            throw SinkAborted();
+        }
+    }
+};
+
+// Runs `fn`, turning exceptions into `on_error` (CMINJA_LIMIT_EXCEEDED for exceeded render limits, when returning a
+// status) and a message for cminja_last_error().
+template <typename T, typename F>
+T guarded(T on_error, F fn) {
+    try {
+        return fn();
+    } catch (const minja::RenderLimitExceeded& e) {
+        last_error = e.what();
+        if constexpr (std::is_same_v<T, int>) return CMINJA_LIMIT_EXCEEDED;
+    } catch (const std::exception& e) {
+        last_error = e.what();
+    } catch (...) {
+        last_error = "Unknown error";
+    }
+    return on_error;
+}
+
+json yaml_to_json(yaml::TypedValue& value) {
+    switch (value.type) {
+        case yaml::YAMLType::Int_:
+            return value.cast<int>();
+        case yaml::YAMLType::Double_:
+            return value.cast<double>();
+        case yaml::YAMLType::String_:
+            return value.cast<std::string>();
+        case yaml::YAMLType::Bool_:
+            return value.cast<bool>();
+        case yaml::YAMLType::Array_: {
+            json result = json::array();
+            for (auto& elem : value.cast<yaml::Array>()) {
+                result.push_back(yaml_to_json(elem));
+            }
+            return result;
+        }
+        case yaml::YAMLType::Object_: {
+            json result = json::object();
+            for (auto& [k, v] : value.cast<yaml::Object>()) {
+                result[k] = yaml_to_json(v);
+            }
+            return result;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+cminja_data* make_data(json&& data) {
+    auto document = std::make_shared<const json>(std::move(data));
+    return new cminja_data { document, minja::Value::from_json(document) };
+}
+
+// Renders into `buffer`: the nodes render into an std::ostringstream, which is made to write through it instead.
+void render(const cminja_template* tmpl, const cminja_data* data, std::streambuf& buffer, minja::OutputSpans* spans = nullptr,
+            minja::RenderBudget* budget = nullptr) {
+    if (!tmpl || !data) throw std::runtime_error("Null template or data");
+    std::ostringstream out;
+    static_cast<std::ostream&>(out).rdbuf(&buffer);
+    out.exceptions(std::ios::badbit);  // Rethrows the exceptions of `buffer` (e.g. SinkAborted) rather than ignoring writes
+    auto context = minja::Context::make(minja::Value(data->value));
+    if (!spans && !budget) {
+        tmpl->root->render(out, context);
+        return;
+    }
+    if (spans) spans->out = &out;
+    auto previous_spans = minja::OutputSpans::record(spans);
+    auto previous_budget = minja::RenderBudget::apply(budget);
+    try {
+        tmpl->root->render(out, context);
+    } catch (...) {
+        minja::OutputSpans::record(previous_spans);
+        minja::RenderBudget::apply(previous_budget);
+        throw;
+    }
+    minja::OutputSpans::record(previous_spans);
+    minja::RenderBudget::apply(previous_budget);
+}
+
+// Renders to `sink` as it goes. Returns CMINJA_ERROR if the sink aborted the render.
+int render_to(const cminja_template* tmpl, const cminja_data* data, cminja_sink sink, void* user_data,
+              minja::OutputSpans* spans = nullptr, minja::RenderBudget* budget = nullptr) {
+    SinkBuffer buffer(sink, user_data);
+    try {
+        render(tmpl, data, buffer, spans, budget);
+        buffer.finish();
+    } catch (const std::exception&) {
+        // The error the render wraps SinkAborted in (with the template location) is the sink's doing.
+        if (!buffer.aborted()) throw;
+        last_error = SinkAborted().what();
+        return CMINJA_ERROR;
+    }
+    return CMINJA_OK;
+}
+
+std::vector<int32_t> render_tokens(const cminja_template* tmpl, const cminja_data* data) {
+    if (!tmpl || !data) throw std::runtime_error("Null template or data");
+    if (!tmpl->tokens) throw std::runtime_error("The template has no tokenizer");
+    return tmpl->tokens->render(minja::Context::make(minja::Value(data->value)));
+}
+
+} // namespace
+
+extern "C" {
+
+const char* cminja_version(void) {
+    return "1.0.0";
+}
+
+const char* cminja_last_error(void) {
+    return last_error.c_str();
+}
+
+cminja_template* cminja_template_compile(const char* source, size_t size, int flags) {
+    return guarded<cminja_template*>(nullptr, [&]() {
+        minja::Options options;
+        options.trim_blocks = (flags & CMINJA_TRIM_BLOCKS) != 0;
+        options.lstrip_blocks = (flags & CMINJA_LSTRIP_BLOCKS) != 0;
+        options.keep_trailing_newline = (flags & CMINJA_KEEP_TRAILING_NEWLINE) != 0;
+        return new cminja_template { minja::Parser::parse(std::string_view(source, size), options), nullptr };
+    });
+}
+
+void cminja_template_free(cminja_template* tmpl) {
+    delete tmpl;
+}
+
+cminja_data* cminja_data_from_json(const char* buffer, size_t size) {
+    return guarded<cminja_data*>(nullptr, [&]() {
+        return make_data(json::parse(buffer, buffer + size));
+    });
+}
+
+cminja_data* cminja_data_from_yaml(const char* buffer, size_t size) {
+    return guarded<cminja_data*>(nullptr, [&]() {
+        MemoryBuffer memory(buffer, size);
+        std::istream in(&memory);
+        yaml::YAML yaml_file(in);
+        json data = json::object();
+        for (auto& [key, value] : yaml_file.data) {
+            data[key] = yaml_to_json(value);
+        }
+        return make_data(std::move(data));
+    });
+}
+
+void cminja_data_free(cminja_data* data) {
+    delete data;
+}
+
+int cminja_render(const cminja_template* tmpl, const cminja_data* data, char* buffer, size_t capacity, size_t* size) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        ArrayBuffer out(buffer, capacity);
+        render(tmpl, data, out);
+        if (size) *size = out.size();
+        return out.size() > capacity ? CMINJA_BUFFER_TOO_SMALL : CMINJA_OK;
+    });
+}
+
+void cminja_set_parallel_loops(size_t min_items, unsigned threads) {
+    minja::ForNode::set_parallel(min_items, threads);
+}
+
+int cminja_render_to(const cminja_template* tmpl, const cminja_data* data, cminja_sink sink, void* user_data) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        return render_to(tmpl, data, sink, user_data);
+    });
+}
+
+int cminja_render_limited(const cminja_template* tmpl, const cminja_data* data, const cminja_limits* limits,
+                          cminja_sink sink, void* user_data) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        minja::RenderBudget budget;
+        if (limits) {
+            if (limits->timeout_ms) budget.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits->timeout_ms);
+            budget.max_output = limits->max_output;
+            budget.max_steps = limits->max_steps;
+            budget.max_depth = limits->max_depth;
+        }
+        return render_to(tmpl, data, sink, user_data, nullptr, &budget);
+    });
+}
+
+int cminja_render_spans(const cminja_template* tmpl, const cminja_data* data, cminja_sink sink, cminja_sink spans_sink, void* user_data) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        minja::OutputSpans spans {};
+        auto status = render_to(tmpl, data, sink, user_data, &spans);
+        if (status != CMINJA_OK) return status;
+        auto index = spans.to_json().dump();
+        if (spans_sink(user_data, index.data(), index.size()) != 0) {
+            last_error = SinkAborted().what();
+            return CMINJA_ERROR;
+        }
+        return CMINJA_OK;
+    });
+}
+
+cminja_incremental* cminja_incremental_new(void) {
+    return guarded<cminja_incremental*>(nullptr, []() {
+        return new cminja_incremental();
+    });
+}
+
+void cminja_incremental_free(cminja_incremental* state) {
+    delete state;
+}
+
+int cminja_render_incremental(cminja_incremental* state, const cminja_template* tmpl, const cminja_data* data,
+                              size_t* stable_prefix, cminja_sink sink, void* user_data) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        if (!state || !tmpl || !data) throw std::runtime_error("Null state, template or data");
+        auto kept = state->render.render(tmpl->root, data->document);
+        if (stable_prefix) *stable_prefix = kept;
+        const auto& output = state->render.output();
+        if (sink(user_data, output.data() + kept, output.size() - kept) != 0) {
+            last_error = "Render aborted by the sink";
+            return CMINJA_ERROR;
+        }
+        return CMINJA_OK;
+    });
+}
+
+cminja_patch_render* cminja_patch_render_new(const cminja_template* tmpl, const char* data, size_t size) {
+    return guarded<cminja_patch_render*>(nullptr, [&]() {
+        if (!tmpl) throw std::runtime_error("Null template");
+        auto state = std::make_unique<cminja_patch_render>();
+        state->render.render(tmpl->root, json::parse(data, data + size));
+        return state.release();
+    });
+}
+
+void cminja_patch_render_free(cminja_patch_render* state) {
+    delete state;
+}
+
+int cminja_patch_render_apply(cminja_patch_render* state, const char* patch, size_t size, size_t* rerendered) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        if (!state) throw std::runtime_error("Null state");
+        auto count = state->render.apply(json::parse(patch, patch + size));
+        if (rerendered) *rerendered = count;
+        return CMINJA_OK;
+    });
+}
+
+const char* cminja_patch_render_output(const cminja_patch_render* state, size_t* size) {
+    if (size) *size = state ? state->render.output().size() : 0;
+    return state ? state->render.output().data() : nullptr;
+}
+
+cminja_tokenizer* cminja_tokenizer_load(const char* json, size_t size) {
+    return guarded<cminja_tokenizer*>(nullptr, [&]() {
+        return new cminja_tokenizer { std::make_shared<const Tokenizer>(std::string_view(json, size)) };
+    });
+}
+
+void cminja_tokenizer_free(cminja_tokenizer* tokenizer) {
+    delete tokenizer;
+}
+
+int cminja_template_set_tokenizer(cminja_template* tmpl, const cminja_tokenizer* tokenizer) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        if (!tmpl || !tokenizer) throw std::runtime_error("Null template or tokenizer");
+        tmpl->tokens = std::make_shared<const TokenizedTemplate>(tokenizer->tokenizer, tmpl->root);
+        return CMINJA_OK;
+    });
+}
+
+int cminja_render_tokens(const cminja_template* tmpl, const cminja_data* data, int32_t* ids, size_t capacity, size_t* count) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        auto tokens = render_tokens(tmpl, data);
+        if (count) *count = tokens.size();
+        std::copy_n(tokens.begin(), std::min(tokens.size(), capacity), ids);
+        return tokens.size() > capacity ? CMINJA_BUFFER_TOO_SMALL : CMINJA_OK;
+    });
+}
+
+int cminja_render_tokens_to(const cminja_template* tmpl, const cminja_data* data, cminja_token_sink sink, void* user_data) {
+    return guarded<int>(CMINJA_ERROR, [&]() {
+        auto tokens = render_tokens(tmpl, data);
+        if (sink(user_data, tokens.data(), tokens.size()) != 0) {
+            last_error = "Render aborted by the sink";
+            return CMINJA_ERROR;
+        }
+        return CMINJA_OK;
+    });
+}
+
+} // extern "C"
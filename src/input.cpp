@@ -0,0 +1,127 @@
+#include "input.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CMINJA_POSIX_INPUT
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#include <iostream>
+#endif
+
+namespace {
+
+const size_t block_size = 1 << 20;
+
+#ifdef CMINJA_POSIX_INPUT
+// Appends everything left to read from `fd` to `out`.
+void read_blocks(int fd, std::string& out, const std::string& name) {
+    size_t used = out.size();
+    for (;;) {
+        if (out.size() - used < block_size) out.resize(used + block_size);
+        ssize_t n = read(fd, &out[used], out.size() - used);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Could not read " + name + ": " + std::strerror(errno));
+        }
+        used += size_t(n);
+    }
+    out.resize(used);
+}
+#endif
+
+} // namespace
+
+InputBuffer::InputBuffer(InputBuffer&& other)
+    : mapping_(other.mapping_), size_(other.size_), owned_(std::move(other.owned_)) {
+    other.mapping_ = nullptr;
+}
+
+InputBuffer::~InputBuffer() {
+#ifdef CMINJA_POSIX_INPUT
+    if (mapping_) munmap(mapping_, size_);
+#endif
+}
+
+#ifdef CMINJA_POSIX_INPUT
+
+InputBuffer InputBuffer::from_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    InputBuffer input;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, size_t(st.st_size), MADV_SEQUENTIAL);
+            input.mapping_ = mapping;
+            input.size_ = size_t(st.st_size);
+            close(fd);
+            return input;
+        }
+    }
+    try {
+        read_blocks(fd, input.owned_, path);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return input;
+}
+
+InputBuffer InputBuffer::from_stdin() {
+    InputBuffer input;
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // Redirected from a file: map it, from the current offset on.
+        auto offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (offset == 0) {
+            void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, size_t(st.st_size), MADV_SEQUENTIAL);
+                input.mapping_ = mapping;
+                input.size_ = size_t(st.st_size);
+                return input;
+            }
+        }
+    }
+    read_blocks(STDIN_FILENO, input.owned_, "stdin");
+    return input;
+}
+
+#else
+
+InputBuffer InputBuffer::from_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    InputBuffer input;
+    std::string block(block_size, '\0');
+    while (file.read(&block[0], block.size()) || file.gcount() > 0) {
+        input.owned_.append(block, 0, size_t(file.gcount()));
+    }
+    return input;
+}
+
+InputBuffer InputBuffer::from_stdin() {
+    std::ios::sync_with_stdio(false);
+    InputBuffer input;
+    std::string block(block_size, '\0');
+    while (std::cin.read(&block[0], block.size()) || std::cin.gcount() > 0) {
+        input.owned_.append(block, 0, size_t(std::cin.gcount()));
+    }
+    return input;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Contents of an input file or of stdin, read without per-character copies: regular files are
+// memory-mapped (where supported), pipes and terminals are read in large blocks.
+class InputBuffer {
+  public:
+    static InputBuffer from_file(const std::string& path);
+    static InputBuffer from_stdin();
+
+    InputBuffer(InputBuffer&& other);
+    InputBuffer(const InputBuffer&) = delete;
+    InputBuffer& operator=(const InputBuffer&) = delete;
+    ~InputBuffer();
+
+    // Valid as long as the buffer lives.
+    std::string_view view() const { return mapping_ ? std::string_view(static_cast<const char*>(mapping_), size_) : std::string_view(owned_); }
+
+  private:
+    InputBuffer() = default;
+
+    void* mapping_ = nullptr;
+    size_t size_ = 0;
+    std::string owned_;
+};
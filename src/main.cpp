@@ -1,12 +1,14 @@
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
-#include "json.hpp"
-#include "yaml.hpp"
+#include "cminja.h"
+#include "input.hpp"
 #include "minja.hpp"
-#include <sstream>
-
-using json = nlohmann::ordered_json;
+#include "server.hpp"
+#include "precompile.hpp"
+#include <filesystem>
 
 void print_help() {
     std::cout << "Usage: cminja <flags>\n"
@@ -17,39 +19,24 @@ void print_help() {
               << "\t-i path to minja file\n"
               << "\t-d path to data\n"
               << "\t-s read data from stdin\n"
-              << "\t-o save to file\n";
+              << "\t-o save to file\n"
+              << "\t-t path to a tokenizer.json: writes the token ids of the output (as a JSON array) instead of its text\n"
+              << "\t-g path to save the byte spans of the {% generation %} blocks and top-level loop iterations of the output (JSON)\n"
+              << "\t-p number of threads rendering the iterations of large loops in parallel (0: one per core; default: a single thread)\n"
+              << "\t--serve <socket> runs as a render daemon on a Unix socket\n"
+              << "\t--serve-shm <name> runs as a render daemon on a shared memory ring\n"
+              << "\t--templates <dir> (after --serve or --serve-shm) serves the templates of a directory by name, reloaded on change\n"
+              << "\t                 or of a bundle file written by --precompile-dir\n"
+              << "\t--timeout-ms <ms>, --max-output <bytes>, --max-steps <n>, --max-depth <n> (after --serve or --serve-shm)\n"
+              << "\t                 abort renders going over these limits: loop iterations, macro calls and range() items are steps,\n"
+              << "\t                 and nested macro / recursive loop() calls count for the depth\n"
+              << "\t--precompile-dir <dir> [-o <bundle>] compiles every template of a directory into a bundle (<dir>.bundle by default)\n";
 }
 
 void print_version() {
     std::cout << "cMinja v1.0.0\nlightweight-yaml-parser v1.0.0\nminja 78bf4a5\nnlohmann/json v3.11.3";
 }
 
-std::string read_file(const std::string& path) {
-    std::ifstream file(path);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file: " + path);
-    }
-    return std::string(std::istreambuf_iterator<char>(file),
-                      std::istreambuf_iterator<char>());
-}
-
-std::string read_stdin() {
-    return std::string(std::istreambuf_iterator<char>(std::cin),
-                      std::istreambuf_iterator<char>());
-}
-
-void write_output(const std::string& content, const std::string& output_path) {
-    if (!output_path.empty()) {
-        std::ofstream out(output_path);
-        if (!out.is_open()) {
-            throw std::runtime_error("Could not open output file: " + output_path);
-        }
-        out << content;
-    } else {
-        std::cout << content;
-    }
-}
-
 int main(int argc, char* argv[]) {
     bool use_json = false;
     bool use_yaml = false;
@@ -57,6 +44,87 @@ int main(int argc, char* argv[]) {
     std::string template_path;
     std::string data_path;
     std::string output_path;
+    std::string tokenizer_path;
+    std::string spans_path;
+    unsigned loop_threads = 0;
+    bool parallel_loops = false;
+
+    // Daemon mode.
+    if (argc > 1 && (std::string(argv[1]) == "--serve" || std::string(argv[1]) == "--serve-shm")) {
+        std::string mode = argv[1];
+        std::string templates_dir;
+        cminja_limits limits = {};
+        bool valid = argc >= 3 && argc % 2 == 1;
+        for (int i = 3; valid && i + 1 < argc; i += 2) {
+            std::string option = argv[i];
+            try {
+                if (option == "--templates") {
+                    templates_dir = argv[i + 1];
+                } else if (option == "--timeout-ms") {
+                    limits.timeout_ms = std::stoull(argv[i + 1]);
+                } else if (option == "--max-output") {
+                    limits.max_output = std::stoull(argv[i + 1]);
+                } else if (option == "--max-steps") {
+                    limits.max_steps = std::stoull(argv[i + 1]);
+                } else if (option == "--max-depth") {
+                    limits.max_depth = std::stoull(argv[i + 1]);
+                } else {
+                    valid = false;
+                }
+            } catch (const std::exception&) {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            std::cerr << "Error: " << mode << " requires " << (mode == "--serve" ? "a socket path" : "a shared memory name")
+                      << ", optionally followed by --templates <dir> and render limits (see -h)\n";
+            return 1;
+        }
+        return mode == "--serve" ? serve(argv[2], templates_dir, limits) : serve_shm(argv[2], templates_dir, limits);
+    }
+
+    // Precompilation.
+    if (argc > 1 && std::string(argv[1]) == "--precompile-dir") {
+        if (argc != 3 && !(argc == 5 && std::string(argv[3]) == "-o")) {
+            std::cerr << "Error: --precompile-dir requires a directory, optionally followed by -o <bundle>\n";
+            return 1;
+        }
+        std::string bundle_path = argc == 5 ? argv[4] : "";
+        if (bundle_path.empty()) {
+            std::filesystem::path dir(argv[2]);
+            if (!dir.has_filename()) dir = dir.parent_path();
+            bundle_path = dir.string() + ".bundle";
+        }
+        try {
+            minja::Options options;
+            options.trim_blocks = true;
+            options.lstrip_blocks = true;
+            options.keep_trailing_newline = false;
+            auto start = std::chrono::steady_clock::now();
+            auto templates = precompile_dir(argv[2], options);
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+            size_t errors = 0;
+            std::chrono::microseconds parse_time { 0 };
+            for (const auto& t : templates) {
+                if (t.root) {
+                    std::cout << t.parse_time.count() / 1000.0 << " ms\t" << t.name << "\n";
+                    parse_time += t.parse_time;
+                } else {
+                    std::cerr << "Error: " << t.name << ": " << t.error << "\n";
+                    errors++;
+                }
+            }
+            write_bundle(bundle_path, templates, options);
+            std::cout << templates.size() - errors << " templates compiled (" << errors << " errors) in "
+                      << elapsed.count() / 1000.0 << " ms (" << parse_time.count() / 1000.0 << " ms of parsing), written to "
+                      << bundle_path << "\n";
+            return errors ? 1 : 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n";
+            return 1;
+        }
+    }
 
     // CLI Args.
     for (int i = 1; i < argc; i++) {
@@ -103,6 +171,36 @@ int main(int argc, char* argv[]) {
                             return 1;
                         }
                         break;
+                    case 't':
+                        if (j == arg.length() - 1 && i + 1 < argc) {
+                            tokenizer_path = argv[++i];
+                        } else {
+                            std::cerr << "Error: -t requires a path argument\n";
+                            return 1;
+                        }
+                        break;
+                    case 'g':
+                        if (j == arg.length() - 1 && i + 1 < argc) {
+                            spans_path = argv[++i];
+                        } else {
+                            std::cerr << "Error: -g requires a path argument\n";
+                            return 1;
+                        }
+                        break;
+                    case 'p':
+                        if (j == arg.length() - 1 && i + 1 < argc) {
+                            try {
+                                loop_threads = static_cast<unsigned>(std::stoul(argv[++i]));
+                                parallel_loops = true;
+                            } catch (const std::exception&) {
+                                std::cerr << "Error: -p requires a number of threads\n";
+                                return 1;
+                            }
+                        } else {
+                            std::cerr << "Error: -p requires a number of threads\n";
+                            return 1;
+                        }
+                        break;
                     default:
                         std::cerr << "Error: Unknown flag -" << arg[j] << "\n";
                         print_help();
@@ -133,93 +231,102 @@ int main(int argc, char* argv[]) {
         std::cerr << "Error: Must specify data path with -d or use -s for stdin\n";
         return 1;
     }
+    if (!tokenizer_path.empty() && !spans_path.empty()) {
+        std::cerr << "Error: Cannot specify both -t and -g (spans are byte offsets in the text)\n";
+        return 1;
+    }
 
+    // Inputs are mapped (or read in large blocks) and parsed in place.
+    std::unique_ptr<InputBuffer> template_input;
+    std::unique_ptr<InputBuffer> data_input;
+    std::unique_ptr<InputBuffer> tokenizer_input;
     try {
-        std::string template_content = read_file(template_path);
-        
-        std::string data_content;
-        if (use_stdin) {
-            data_content = read_stdin();
-        } else {
-            data_content = read_file(data_path);
-        }
+        template_input = std::make_unique<InputBuffer>(InputBuffer::from_file(template_path));
+        data_input = std::make_unique<InputBuffer>(use_stdin ? InputBuffer::from_stdin() : InputBuffer::from_file(data_path));
+        if (!tokenizer_path.empty()) tokenizer_input = std::make_unique<InputBuffer>(InputBuffer::from_file(tokenizer_path));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    auto template_content = template_input->view();
+    auto data_content = data_input->view();
 
-        nlohmann::ordered_json data;
-        if (use_json) {
-            data = json::parse(data_content);
-        } else {
-            // Parse YAML and convert to JSON.
-            data = nlohmann::ordered_json::object();
-            
-            // Create temporary file for stdin if needed, I chose the wrong library lol.
-            std::string yaml_path = use_stdin ? "temp.yaml" : data_path;
-            if (use_stdin) {
-                std::ofstream temp(yaml_path);
-                temp << data_content;
-                temp.close();
-            }
+    // Loops over many items render their iterations concurrently when asked to: off by default, as in the library.
+    if (parallel_loops) cminja_set_parallel_loops(1024, loop_threads);
 
-            yaml::YAML yaml_file(yaml_path);
+    // Process the template.
+    cminja_template* tmpl = cminja_template_compile(template_content.data(), template_content.size(), CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS);
+    if (tmpl && tokenizer_input) {
+        // The template's constant text is tokenized once here, only the rendered values are tokenized while rendering.
+        auto tokenizer_content = tokenizer_input->view();
+        cminja_tokenizer* tokenizer = cminja_tokenizer_load(tokenizer_content.data(), tokenizer_content.size());
+        if (!tokenizer || cminja_template_set_tokenizer(tmpl, tokenizer) != CMINJA_OK) {
+            cminja_template_free(tmpl);
+            tmpl = nullptr;
+        }
+        cminja_tokenizer_free(tokenizer);
+    }
+    cminja_data* data = nullptr;
+    if (tmpl) {
+        data = use_json ? cminja_data_from_json(data_content.data(), data_content.size())
+                        : cminja_data_from_yaml(data_content.data(), data_content.size());
+    }
+    // The output is only written (and its file created) once the whole render succeeded.
+    struct Output {
+        std::string path;
+        std::string text;
 
-            // Helper function to convert YAML value to JSON, fml.
-            std::function<json(yaml::TypedValue&)> convert_value;
-            convert_value = [&convert_value](yaml::TypedValue& value) -> json {
-                switch (value.type) {
-                    case yaml::YAMLType::Int_:
-                        return value.cast<int>();
-                    case yaml::YAMLType::Double_:
-                        return value.cast<double>();
-                    case yaml::YAMLType::String_:
-                        return value.cast<std::string>();
-                    case yaml::YAMLType::Bool_:
-                        return value.cast<bool>();
-                    case yaml::YAMLType::Array_: {
-                        auto arr = value.cast<yaml::Array>();
-                        json result = json::array();
-                        for (auto& elem : arr) {
-                            result.push_back(convert_value(elem));
-                        }
-                        return result;
-                    }
-                    case yaml::YAMLType::Object_: {
-                        auto obj = value.cast<yaml::Object>();
-                        json result = json::object();
-                        for (auto& [k, v] : obj) {
-                            result[k] = convert_value(v);
-                        }
-                        return result;
-                    }
-                    default:
-                        return nullptr;
-                }
-            };
+        explicit Output(const std::string& path) : path(path) {}
 
-            // Convert YAML to JSON.
-            for (auto& [key, value] : yaml_file.data) {
-                data[key] = convert_value(value);
-            }
+        int write(const char* chunk, size_t size) {
+            text.append(chunk, size);
+            return 0;
+        }
 
-            // Remove the temporary file if used, lmao.
-            if (use_stdin) {
-                std::remove(yaml_path.c_str());
+        bool flush() {
+            if (path.empty()) {
+                std::cout.write(text.data(), text.size());
+                return static_cast<bool>(std::cout.flush());
             }
+            std::ofstream file(path);
+            file.write(text.data(), text.size());
+            file.close();
+            return !file.fail();
         }
-
-        // Process the template.
-        minja::Options options;
-        options.trim_blocks = true;
-        options.lstrip_blocks = true;
-        auto tmpl = minja::Parser::parse(template_content, options);
-        auto context = minja::Context::make(minja::Value(data));
-        std::ostringstream out;
-        tmpl->render(out, context);
-        std::string result = out.str();
-
-        write_output(result, output_path);
-
-        return 0;
-    } catch (const std::exception& e) {
-        std::cerr << "Error: " << e.what() << "\n";
-        return 1;
+    } output { output_path }, spans_output { spans_path };
+    int status = CMINJA_ERROR;
+    if (data && tokenizer_input) {
+        status = cminja_render_tokens_to(tmpl, data, [](void* user_data, const int32_t* ids, size_t count) {
+            std::string text = "[";
+            for (size_t i = 0; i < count; i++) {
+                if (i) text += ",";
+                text += std::to_string(ids[i]);
+            }
+            text += "]\n";
+            return static_cast<Output*>(user_data)->write(text.data(), text.size());
+        }, &output);
+    } else if (data && !spans_path.empty()) {
+        Output* outputs[] = { &output, &spans_output };
+        status = cminja_render_spans(tmpl, data, [](void* user_data, const char* chunk, size_t size) {
+            return static_cast<Output**>(user_data)[0]->write(chunk, size);
+        }, [](void* user_data, const char* chunk, size_t size) {
+            return static_cast<Output**>(user_data)[1]->write(chunk, size);
+        }, outputs);
+    } else if (data) {
+        status = cminja_render_to(tmpl, data, [](void* user_data, const char* chunk, size_t size) {
+            return static_cast<Output*>(user_data)->write(chunk, size);
+        }, &output);
+    }
+    if (status != CMINJA_OK) {
+        std::cerr << "Error: " << cminja_last_error() << "\n";
+    } else if (!output.flush()) {
+        std::cerr << "Error: Could not write output file: " << output_path << "\n";
+        status = CMINJA_ERROR;
+    } else if (!spans_path.empty() && !spans_output.flush()) {
+        std::cerr << "Error: Could not write output file: " << spans_path << "\n";
+        status = CMINJA_ERROR;
     }
+    cminja_data_free(data);
+    cminja_template_free(tmpl);
+    return status == CMINJA_OK ? 0 : 1;
 }
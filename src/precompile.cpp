@@ -0,0 +1,102 @@
+#include "precompile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const std::string bundle_magic = "cminja-bundle";
+const uint64_t bundle_version = 3;
+
+uint8_t option_flags(const minja::Options& options) {
+    return (options.trim_blocks ? 1 : 0) | (options.lstrip_blocks ? 2 : 0) | (options.keep_trailing_newline ? 4 : 0);
+}
+
+} // namespace
+
+std::vector<CompiledTemplate> precompile_dir(const std::string& directory, const minja::Options& options, unsigned threads) {
+    if (!fs::is_directory(directory)) {
+        throw std::runtime_error("Not a directory: " + directory);
+    }
+    std::vector<CompiledTemplate> templates;
+    std::vector<fs::path> paths;
+    for (const auto& file : fs::recursive_directory_iterator(directory, fs::directory_options::skip_permission_denied)) {
+        if (!file.is_regular_file()) continue;
+        paths.push_back(file.path());
+    }
+    std::sort(paths.begin(), paths.end());
+    templates.resize(paths.size());
+
+    // Workers take the next file from a shared index until there's none left.
+    std::atomic<size_t> next { 0 };
+    auto work = [&]() {
+        for (size_t i; (i = next++) < paths.size();) {
+            auto& result = templates[i];
+            result.name = fs::relative(paths[i], directory).generic_string();
+            try {
+                std::ifstream in(paths[i], std::ios::binary);
+                if (!in.is_open()) throw std::runtime_error("Could not open file: " + paths[i].string());
+                std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                auto start = std::chrono::steady_clock::now();
+                result.root = minja::Parser::parse(source, options);
+                result.parse_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            } catch (const std::exception& e) {
+                result.error = e.what();
+            }
+        }
+    };
+
+    if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = unsigned(std::min<size_t>(threads, std::max<size_t>(paths.size(), 1)));
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) pool.emplace_back(work);
+    work();
+    for (auto& thread : pool) thread.join();
+    return templates;
+}
+
+void write_bundle(const std::string& path, const std::vector<CompiledTemplate>& templates, const minja::Options& options) {
+    std::string out;
+    minja::AstWriter w(out);
+    w.str(bundle_magic);
+    w.varint(bundle_version);
+    w.u8(option_flags(options));
+    w.varint(std::count_if(templates.begin(), templates.end(), [](const CompiledTemplate& t) { return t.root != nullptr; }));
+    for (const auto& t : templates) {
+        if (!t.root) continue;
+        w.str(t.name);
+        minja::write_template(*t.root, out);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open output file: " + path);
+    }
+    file.write(out.data(), out.size());
+    if (!file) throw std::runtime_error("Could not write " + path);
+}
+
+std::unordered_map<std::string, std::shared_ptr<minja::TemplateNode>> read_bundle(const std::string& path, const minja::Options& options) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file: " + path);
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string_view in(data);
+    minja::AstReader r(in, nullptr);
+    if (r.str() != bundle_magic) throw std::runtime_error(path + " is not a template bundle");
+    if (r.varint() != bundle_version) throw std::runtime_error(path + ": unsupported bundle version");
+    if (r.u8() != option_flags(options)) throw std::runtime_error(path + " was compiled with different options");
+
+    std::unordered_map<std::string, std::shared_ptr<minja::TemplateNode>> templates;
+    for (auto n = r.count(); n > 0; n--) {
+        auto name = r.str();
+        templates[name] = minja::read_template(in);
+    }
+    return templates;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "minja.hpp"
+
+// Ahead-of-time compilation of a whole template directory, and bundles of the compiled trees.
+
+struct CompiledTemplate {
+    std::string name;  // Path relative to the directory.
+    std::shared_ptr<minja::TemplateNode> root;  // Null if it failed to compile (see error).
+    std::string error;
+    std::chrono::microseconds parse_time { 0 };
+};
+
+// Reads and parses every file under `directory` on `threads` threads (0 = one per core).
+// Returns them sorted by name; a template that fails to parse has its error instead of a tree.
+std::vector<CompiledTemplate> precompile_dir(const std::string& directory, const minja::Options& options, unsigned threads = 0);
+
+// Writes the compiled templates (those without errors) to a single bundle file.
+void write_bundle(const std::string& path, const std::vector<CompiledTemplate>& templates, const minja::Options& options);
+
+// Loads a bundle written by write_bundle; throws if it's invalid or compiled with other options.
+std::unordered_map<std::string, std::shared_ptr<minja::TemplateNode>> read_bundle(const std::string& path, const minja::Options& options);
@@ -0,0 +1,92 @@
+#include "registry.hpp"
+
+#include <fstream>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+std::atomic<uint64_t> TemplateRegistry::next_id_ { 0 };
+
+TemplateRegistry::TemplateRegistry(const std::string& directory, const minja::Options& options,
+                                   std::chrono::milliseconds poll_interval)
+    : directory_(directory), options_(options), table_(std::make_shared<const Table>()), id_(next_id_.fetch_add(1)) {
+    if (!fs::is_directory(directory_)) {
+        throw std::runtime_error("Not a directory: " + directory);
+    }
+    reload();
+    watcher_ = std::thread([this, poll_interval]() {
+        std::unique_lock<std::mutex> lock(stop_mutex_);
+        while (!stop_.wait_for(lock, poll_interval, [this]() { return stopping_; })) {
+            lock.unlock();
+            try {
+                reload();
+            } catch (const std::exception& e) {
+                std::cerr << "Error: reloading " << directory_.string() << ": " << e.what() << "\n";
+            }
+            lock.lock();
+        }
+    });
+}
+
+TemplateRegistry::~TemplateRegistry() {
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        stopping_ = true;
+    }
+    stop_.notify_all();
+    watcher_.join();
+}
+
+std::shared_ptr<const minja::TemplateNode> TemplateRegistry::get(const std::string& name) const {
+    // Table of the last generation this thread read, if it was from this registry.
+    struct Cache {
+        uint64_t id = UINT64_MAX;
+        uint64_t generation = 0;
+        std::shared_ptr<const Table> table;
+    };
+    static thread_local Cache cache;
+    auto generation = generation_.load(std::memory_order_acquire);
+    if (cache.id != id_ || cache.generation != generation) {
+        // May already be a newer table than `generation`: it's then loaded again on the next read.
+        cache.table = std::atomic_load(&table_);
+        cache.id = id_;
+        cache.generation = generation;
+    }
+    const auto& table = cache.table;
+    auto it = table->find(name);
+    return it == table->end() ? nullptr : it->second.root;
+}
+
+void TemplateRegistry::reload() {
+    std::lock_guard<std::mutex> lock(reload_mutex_);
+    auto current = std::atomic_load(&table_);
+    auto next = std::make_shared<Table>();
+    bool changed = false;
+
+    for (const auto& file : fs::recursive_directory_iterator(directory_, fs::directory_options::skip_permission_denied)) {
+        if (!file.is_regular_file()) continue;
+        auto name = fs::relative(file.path(), directory_).generic_string();
+        auto mtime = file.last_write_time();
+        auto size = file.file_size();
+
+        auto it = current->find(name);
+        if (it != current->end() && it->second.mtime == mtime && it->second.size == size) {
+            next->emplace(name, it->second);
+            continue;
+        }
+        changed = true;
+        try {
+            std::ifstream in(file.path());
+            std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            next->emplace(name, Entry { mtime, size, minja::Parser::parse(source, options_) });
+        } catch (const std::exception& e) {
+            // Keep serving the last good version of a template that fails to parse.
+            std::cerr << "Error: " << name << ": " << e.what() << "\n";
+            next->emplace(name, Entry { mtime, size, it != current->end() ? it->second.root : nullptr });
+        }
+    }
+    if (!changed && next->size() == current->size()) return;
+
+    std::atomic_store(&table_, std::shared_ptr<const Table>(std::move(next)));
+    generation_.fetch_add(1, std::memory_order_release);
+}
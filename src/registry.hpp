@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "minja.hpp"
+
+// Named templates parsed from the files of a directory (named by their path relative to it), kept up
+// to date by a background thread that polls modification times.
+//
+// A reload parses the changed files, then publishes a new table and bumps a generation counter
+// (read-copy-update). Each reader thread keeps the table of the last generation it saw: it only loads
+// the shared pointer again (which takes a lock in the standard library) once per reload, and other
+// reads are a single atomic load. Renders already running keep the tree they started with until they
+// release it; an idle thread holds on to the table it last read until its next read.
+class TemplateRegistry {
+  public:
+    TemplateRegistry(const std::string& directory, const minja::Options& options,
+                     std::chrono::milliseconds poll_interval = std::chrono::milliseconds(1000));
+    ~TemplateRegistry();
+
+    // Current tree of the template, or null if there's no such (valid) template.
+    std::shared_ptr<const minja::TemplateNode> get(const std::string& name) const;
+
+    // Picks up changed, added and removed files now (the watcher does it every poll interval).
+    void reload();
+
+  private:
+    struct Entry {
+        std::filesystem::file_time_type mtime;
+        uintmax_t size;
+        std::shared_ptr<const minja::TemplateNode> root;
+    };
+    using Table = std::unordered_map<std::string, Entry>;
+
+    std::filesystem::path directory_;
+    minja::Options options_;
+    std::shared_ptr<const Table> table_; // Only accessed through std::atomic_load / std::atomic_store.
+    std::atomic<uint64_t> generation_ { 0 }; // Bumped after each new table_ is stored.
+    const uint64_t id_;                      // Tells the registries apart in the per-thread caches.
+    static std::atomic<uint64_t> next_id_;
+
+    std::mutex reload_mutex_; // Serializes reloads (never taken by readers).
+    std::mutex stop_mutex_;
+    std::condition_variable stop_;
+    bool stopping_ = false;
+    std::thread watcher_;
+};
@@ -0,0 +1,572 @@
+#include "server.hpp"
+
+#include <iostream>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "json.hpp"
+#include "minja.hpp"
+#include "precompile.hpp"
+#include "registry.hpp"
+#include "shm_ring.hpp"
+
+using json = nlohmann::ordered_json;
+
+namespace {
+
+// Bigger requests are rejected and the connection is closed.
+const uint32_t max_field_size = 256u << 20;
+
+// Shared memory ring: request + output must fit in a slot.
+const uint32_t shm_slot_count = 64;
+const uint32_t shm_slot_size = 1u << 20;
+
+uint32_t read_u32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+}
+
+// Whether `in` starts with a whole request (fields too large to ever complete count as whole: they are rejected).
+bool has_request(const std::string& in) {
+    if (in.size() < 4) return false;
+    auto path_size = read_u32(in.data());
+    if (path_size > max_field_size) return true;
+    if (in.size() < 8 + size_t(path_size)) return false;
+    auto data_size = read_u32(in.data() + 4 + path_size);
+    return data_size > max_field_size || in.size() >= 8 + size_t(path_size) + data_size;
+}
+
+void append_u32(std::string& out, uint32_t v) {
+    char b[4] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+    out.append(b, 4);
+}
+
+minja::Options render_options() {
+    minja::Options options;
+    options.trim_blocks = true;
+    options.lstrip_blocks = true;
+    options.keep_trailing_newline = false;
+    return options;
+}
+
+// Templates known to the daemon: a bundle or a registry (optional) first, then the files of the templates directory
+// (or of the directory the daemon runs in, without one), parsed again only when their modification time or size changes.
+struct Templates {
+    struct File {
+        timespec mtime;
+        off_t size;
+        std::shared_ptr<const minja::TemplateNode> root;
+    };
+
+    std::unordered_map<std::string, std::shared_ptr<minja::TemplateNode>> bundle;
+    std::unique_ptr<TemplateRegistry> registry;
+    std::filesystem::path root_dir;  // Canonical: files outside of it aren't served
+    minja::TemplateCache cache { 256 };
+    std::mutex files_mutex;
+    std::unordered_map<std::string, File> files;  // By canonical path
+
+    explicit Templates(const std::string& templates_dir) {
+        root_dir = std::filesystem::current_path();
+        if (templates_dir.empty()) return;
+        if (std::filesystem::is_regular_file(templates_dir)) {
+            bundle = read_bundle(templates_dir, render_options());
+        } else {
+            registry = std::make_unique<TemplateRegistry>(templates_dir, render_options());
+            root_dir = std::filesystem::canonical(templates_dir);
+        }
+    }
+
+    std::shared_ptr<const minja::TemplateNode> get(const std::string& template_path) {
+        auto it = bundle.find(template_path);
+        if (it != bundle.end()) return it->second;
+        if (registry) {
+            if (auto root = registry->get(template_path)) return root;
+        }
+        std::error_code error;
+        auto path = std::filesystem::weakly_canonical(root_dir / template_path, error);
+        auto outside = std::mismatch(root_dir.begin(), root_dir.end(), path.begin(), path.end()).first != root_dir.end();
+        if (error || outside) {
+            throw std::runtime_error("Template outside of the templates directory: " + template_path);
+        }
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            throw std::runtime_error("Could not open file: " + template_path);
+        }
+        {
+            std::lock_guard<std::mutex> lock(files_mutex);
+            auto cached = files.find(path.native());
+            if (cached != files.end() && cached->second.size == info.st_size &&
+                cached->second.mtime.tv_sec == info.st_mtim.tv_sec && cached->second.mtime.tv_nsec == info.st_mtim.tv_nsec) {
+                return cached->second.root;
+            }
+        }
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open file: " + template_path);
+        }
+        std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        auto root = cache.get(source, render_options());
+        std::lock_guard<std::mutex> lock(files_mutex);
+        files[path.native()] = File { info.st_mtim, info.st_size, root };
+        return root;
+    }
+};
+
+// Status of a response to a request that failed.
+char error_status(const std::exception& e) {
+    return dynamic_cast<const minja::RenderLimitExceeded*>(&e) ? 2 : 1;
+}
+
+// Renders the template named `template_path` with the JSON in [data, data + size) into `out`, within `limits`.
+void render_request(Templates& templates, const cminja_limits& limits, const std::string& template_path, const char* data, size_t size,
+                    std::ostringstream& out) {
+    auto tmpl = templates.get(template_path);
+    auto context = minja::Context::make(minja::Value::from_json(std::make_shared<const json>(json::parse(data, data + size))));
+    minja::RenderBudget budget;
+    if (limits.timeout_ms) budget.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(limits.timeout_ms);
+    budget.max_output = limits.max_output;
+    budget.max_steps = limits.max_steps;
+    budget.max_depth = limits.max_depth;
+    auto previous = minja::RenderBudget::apply(&budget);
+    try {
+        tmpl->render(out, context);
+    } catch (...) {
+        minja::RenderBudget::apply(previous);
+        throw;
+    }
+    minja::RenderBudget::apply(previous);
+}
+
+// Output stream buffer over the free part of a shared memory slot: the output is rendered straight into the slot.
+// Throws once it's full.
+class SlotBuffer : public std::streambuf {
+  public:
+    SlotBuffer(char* begin, size_t capacity) { setp(begin, begin + capacity); }
+
+    size_t size() const { return size_t(pptr() - pbase()); }
+    bool full() const { return full_; }
+
+  protected:
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        full_ = true;
+        throw std::length_error("Output too large for a shared memory slot");
+    }
+    // Only tells the position (tellp), which renders use to measure their output.
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+        return pos_type(off_type(size()));
+    }
+
+  private:
+    bool full_ = false;
+};
+
+// Blocks termination signals so that they're only received through the returned signalfd.
+int termination_signal_fd(int flags) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    sigdelset(&signals, SIGPIPE);
+    return signalfd(-1, &signals, flags);
+}
+
+struct Connection {
+    int fd;
+    std::string in;    // Received bytes not yet framed into a request.
+    std::string out;   // Response bytes not yet sent.
+    bool busy = false; // A worker is rendering a request: responses are sent in request order.
+    bool peer_closed = false; // Nothing more to read, but pending responses are still sent.
+    uint32_t events = EPOLLIN;
+};
+
+struct Task {
+    std::shared_ptr<Connection> connection;
+    std::string template_path;
+    std::string data;
+    std::string response;
+};
+
+class Server {
+  public:
+    Server(const std::string& templates_dir, const cminja_limits& limits) : templates_(templates_dir), limits_(limits) {}
+
+    int run(const std::string& socket_path) {
+        // Handle termination signals in the event loop to remove the socket file on exit.
+        signal_fd_ = termination_signal_fd(SFD_NONBLOCK | SFD_CLOEXEC);
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) return fail("socket");
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: socket path too long: " << socket_path << "\n";
+            return 1;
+        }
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        struct stat st;
+        if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(socket_path.c_str());
+        }
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) return fail("bind");
+        if (listen(listen_fd_, SOMAXCONN) < 0) return fail("listen");
+
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (wake_fd_ < 0 || epoll_fd_ < 0) return fail("epoll");
+        watch(listen_fd_, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wake_fd_, EPOLLIN, EPOLL_CTL_ADD);
+        watch(signal_fd_, EPOLLIN, EPOLL_CTL_ADD);
+
+        auto worker_count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < worker_count; i++) {
+            workers_.emplace_back([this]() { work(); });
+        }
+
+        event_loop();
+
+        {
+            std::lock_guard<std::mutex> lock(tasks_mutex_);
+            stopping_ = true;
+        }
+        tasks_ready_.notify_all();
+        for (auto& worker : workers_) worker.join();
+        for (auto& [fd, connection] : connections_) close(fd);
+        close(listen_fd_);
+        close(wake_fd_);
+        close(epoll_fd_);
+        close(signal_fd_);
+        unlink(socket_path.c_str());
+        return 0;
+    }
+
+  private:
+    Templates templates_;
+    cminja_limits limits_;
+    int listen_fd_ = -1, wake_fd_ = -1, epoll_fd_ = -1, signal_fd_ = -1;
+    std::unordered_map<int, std::shared_ptr<Connection>> connections_; // Event loop thread only.
+
+    std::vector<std::thread> workers_;
+    std::mutex tasks_mutex_;
+    std::condition_variable tasks_ready_;
+    std::deque<Task> tasks_;
+    bool stopping_ = false;
+
+    std::mutex done_mutex_;
+    std::vector<Task> done_;
+
+    int fail(const char* what) {
+        std::cerr << "Error: " << what << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd_, op, fd, &event);
+    }
+
+    void event_loop() {
+        epoll_event events[64];
+        for (;;) {
+            int n = epoll_wait(epoll_fd_, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                fail("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == signal_fd_) {
+                    return;
+                } else if (fd == listen_fd_) {
+                    accept_connections();
+                } else if (fd == wake_fd_) {
+                    uint64_t count;
+                    while (read(wake_fd_, &count, sizeof(count)) > 0) {}
+                    complete_tasks();
+                } else {
+                    auto it = connections_.find(fd);
+                    if (it == connections_.end()) continue;
+                    auto connection = it->second;
+                    if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                        // The client is gone: responses can't be delivered anymore.
+                        drop(connection);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLOUT) flush(connection);
+                    if (events[i].events & EPOLLIN) receive(connection);
+                }
+            }
+        }
+    }
+
+    void accept_connections() {
+        for (;;) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            auto connection = std::make_shared<Connection>();
+            connection->fd = fd;
+            connections_[fd] = connection;
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+    void receive(const std::shared_ptr<Connection>& connection) {
+        char buffer[64 * 1024];
+        for (;;) {
+            auto n = read(connection->fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                connection->in.append(buffer, n);
+                // Requests are handled one at a time: the rest is left in the socket until this one is taken.
+                if (has_request(connection->in)) break;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n == 0) {
+                connection->peer_closed = true;
+                update_events(connection);
+                break;
+            } else {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return drop(connection);
+                break;
+            }
+        }
+        dispatch(connection);
+    }
+
+    // Hands the next complete request of the connection to the workers, unless one is already in flight.
+    void dispatch(const std::shared_ptr<Connection>& connection) {
+        if (connection->busy) return;
+        auto& in = connection->in;
+        if (in.size() >= 4) {
+            auto path_size = read_u32(in.data());
+            if (path_size > max_field_size) return drop(connection);
+            if (in.size() >= 8 + size_t(path_size)) {
+                auto data_size = read_u32(in.data() + 4 + path_size);
+                if (data_size > max_field_size) return drop(connection);
+                if (in.size() >= 8 + size_t(path_size) + data_size) {
+                    Task task;
+                    task.connection = connection;
+                    task.template_path = in.substr(4, path_size);
+                    task.data = in.substr(8 + path_size, data_size);
+                    in.erase(0, 8 + size_t(path_size) + data_size);
+                    connection->busy = true;
+                    update_events(connection);
+                    {
+                        std::lock_guard<std::mutex> lock(tasks_mutex_);
+                        tasks_.push_back(std::move(task));
+                    }
+                    tasks_ready_.notify_one();
+                    return;
+                }
+            }
+        }
+        if (connection->peer_closed && connection->out.empty()) drop(connection);
+    }
+
+    // Reads only until a whole request is waiting for the one in flight, and writes while responses are pending.
+    void update_events(const std::shared_ptr<Connection>& connection) {
+        auto reading = !connection->peer_closed && !(connection->busy && has_request(connection->in));
+        uint32_t events = (reading ? uint32_t(EPOLLIN) : 0) | (connection->out.empty() ? 0 : uint32_t(EPOLLOUT));
+        if (events != connection->events) {
+            connection->events = events;
+            watch(connection->fd, events, EPOLL_CTL_MOD);
+        }
+    }
+
+    void complete_tasks() {
+        std::vector<Task> done;
+        {
+            std::lock_guard<std::mutex> lock(done_mutex_);
+            done.swap(done_);
+        }
+        for (auto& task : done) {
+            auto& connection = task.connection;
+            connection->busy = false;
+            auto it = connections_.find(connection->fd);
+            if (it == connections_.end() || it->second != connection) continue;
+            connection->out += task.response;
+            flush(connection);
+            dispatch(connection);
+        }
+    }
+
+    void flush(const std::shared_ptr<Connection>& connection) {
+        auto& out = connection->out;
+        size_t sent = 0;
+        while (sent < out.size()) {
+            auto n = send(connection->fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                sent += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return drop(connection);
+            }
+        }
+        out.erase(0, sent);
+        update_events(connection);
+        // Pipelined requests received before the peer closed its end are still answered.
+        if (out.empty() && connection->peer_closed && !connection->busy && !has_request(connection->in)) drop(connection);
+    }
+
+    void drop(const std::shared_ptr<Connection>& connection) {
+        auto it = connections_.find(connection->fd);
+        if (it != connections_.end() && it->second == connection) {
+            connections_.erase(it);
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd, nullptr);
+            close(connection->fd);
+        }
+    }
+
+    void work() {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(tasks_mutex_);
+                tasks_ready_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+                if (stopping_) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            std::string body;
+            char status = 0;
+            try {
+                std::ostringstream out;
+                render_request(templates_, limits_, task.template_path, task.data.data(), task.data.size(), out);
+                body = out.str();
+            } catch (const std::exception& e) {
+                status = error_status(e);
+                body = e.what();
+            }
+            task.response.push_back(status);
+            append_u32(task.response, uint32_t(body.size()));
+            task.response += body;
+            task.data.clear();
+            {
+                std::lock_guard<std::mutex> lock(done_mutex_);
+                done_.push_back(std::move(task));
+            }
+            uint64_t one = 1;
+            (void) !write(wake_fd_, &one, sizeof(one));
+        }
+    }
+};
+
+} // namespace
+
+int serve(const std::string& socket_path, const std::string& templates_dir, const cminja_limits& limits) {
+    try {
+        Server server(templates_dir, limits);
+        return server.run(socket_path);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
+
+int serve_shm(const std::string& name, const std::string& templates_dir, const cminja_limits& limits) {
+    int signal_fd = termination_signal_fd(SFD_CLOEXEC);
+    std::unique_ptr<shm_ring::Ring> ring;
+    std::unique_ptr<Templates> templates;
+    try {
+        templates = std::make_unique<Templates>(templates_dir);
+        ring = std::make_unique<shm_ring::Ring>(shm_ring::Ring::create(name, shm_slot_count, shm_slot_size));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    std::vector<std::thread> workers;
+    auto worker_count = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < worker_count; i++) {
+        workers.emplace_back([&]() {
+            while (auto slot = ring->next_request()) {
+                // The JSON data is parsed in place; the output is rendered after the request in the same slot.
+                // The sizes are read once and checked, as the producer can still write to the slot.
+                auto data = ring->data(slot);
+                uint32_t path_size = slot->path_size, data_size = slot->data_size;
+                uint32_t status = 0;
+                size_t offset = 0, size = 0;
+                std::string error;
+                if (size_t(path_size) + data_size > ring->slot_size()) {
+                    status = 1;
+                    error = "Request too large for a shared memory slot";
+                } else {
+                    offset = std::min(shm_ring::align(size_t(path_size) + data_size), size_t(ring->slot_size()));
+                    SlotBuffer buffer(data + offset, ring->slot_size() - offset);
+                    try {
+                        std::ostringstream out;
+                        static_cast<std::ostream&>(out).rdbuf(&buffer);
+                        out.exceptions(std::ios::badbit);  // Rethrows the exception of a full slot
+                        render_request(*templates, limits, std::string(data, path_size), data + path_size, data_size, out);
+                        size = buffer.size();
+                    } catch (const std::exception& e) {
+                        status = buffer.full() ? 1 : error_status(e);
+                        error = buffer.full() ? "Output too large for a shared memory slot" : e.what();
+                    }
+                }
+                if (status != 0) {
+                    offset = 0;
+                    size = std::min(error.size(), size_t(ring->slot_size()));
+                    std::memcpy(data, error.data(), size);
+                }
+                ring->complete(slot, status, uint32_t(offset), uint32_t(size));
+            }
+        });
+    }
+
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) < 0 && errno == EINTR) {}
+    ring->shutdown();
+    for (auto& worker : workers) worker.join();
+    ring->fail_pending();
+    close(signal_fd);
+    shm_unlink(name.c_str());
+    return 0;
+}
+
+#else
+
+int serve(const std::string&, const std::string&, const cminja_limits&) {
+    std::cerr << "Error: --serve is only supported on Linux\n";
+    return 1;
+}
+
+int serve_shm(const std::string&, const std::string&, const cminja_limits&) {
+    std::cerr << "Error: --serve-shm is only supported on Linux\n";
+    return 1;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+#include "cminja.h"
+
+// Render daemon: listens on a Unix domain socket and renders (template path, JSON data) requests
+// with templates kept parsed in memory.
+// If `templates_dir` isn't empty, templates are first looked up by name in a registry of that directory,
+// reloaded in the background when its files change (see registry.hpp).
+//
+// Every field is prefixed by its length as a 32-bit big-endian integer.
+// Request:  <template path> <JSON data>
+// Response: one status byte (0 = rendered, 1 = error, 2 = over a limit) then <rendered text or error message>
+//
+// Each render is aborted as soon as it goes over one of `limits` (0: no limit), so that a runaway template only costs
+// its own request.
+// Runs until SIGINT / SIGTERM and returns the process exit code.
+int serve(const std::string& socket_path, const std::string& templates_dir = "", const cminja_limits& limits = {});
+
+// Same requests through a ring of slots in the shared memory region /dev/shm/<name> (see shm_ring.hpp),
+// for co-located producers. Runs until SIGINT / SIGTERM and returns the process exit code.
+int serve_shm(const std::string& name, const std::string& templates_dir = "", const cminja_limits& limits = {});
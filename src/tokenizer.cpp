@@ -0,0 +1,485 @@
+#include "tokenizer.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+
+#include "json.hpp"
+#include "unicode_classes.hpp"
+
+namespace {
+
+// Not ordered_json: vocabularies have 100k+ keys.
+using Config = nlohmann::json;
+
+// Split patterns of the Llama 3 and Qwen2 tokenizers (they only differ in the length of digit runs).
+const char* const llama3_pattern =
+    R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+)";
+const char* const qwen2_pattern =
+    R"((?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+)";
+
+enum class CharClass { Letter, Number, Space, Newline, Other, End };
+
+template <size_t N>
+bool in_ranges(const CodepointRange (&ranges)[N], uint32_t c) {
+    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), c,
+                               [](uint32_t c, const CodepointRange& range) { return c < range.first; });
+    return it != std::begin(ranges) && c <= std::prev(it)->last;
+}
+
+// \s of the patterns: the Unicode White_Space property.
+bool is_space(uint32_t c) {
+    return (c >= 0x09 && c <= 0x0D) || c == 0x20 || c == 0x85 || c == 0xA0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200A) ||
+           c == 0x2028 || c == 0x2029 || c == 0x202F || c == 0x205F || c == 0x3000;
+}
+
+CharClass classify(uint32_t c) {
+    if (c == '\r' || c == '\n') return CharClass::Newline;
+    if (c < 0x80) {
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return CharClass::Letter;
+        if (c >= '0' && c <= '9') return CharClass::Number;
+        return is_space(c) ? CharClass::Space : CharClass::Other;
+    }
+    if (is_space(c)) return CharClass::Space;
+    if (in_ranges(unicode_letters, c)) return CharClass::Letter;
+    if (in_ranges(unicode_numbers, c)) return CharClass::Number;
+    return CharClass::Other;
+}
+
+// Code point at text[i] and its size; an invalid byte reads as U+FFFD of size 1.
+uint32_t decode(std::string_view text, size_t i, size_t& size) {
+    auto byte = [&](size_t k) { return static_cast<uint8_t>(text[k]); };
+    uint8_t b = byte(i);
+    size = b < 0x80 ? 1 : b >= 0xF0 && b < 0xF8 ? 4 : b >= 0xE0 ? 3 : b >= 0xC0 ? 2 : 0;
+    if (size == 0 || i + size > text.size()) {
+        size = 1;
+        return b < 0x80 ? b : 0xFFFD;
+    }
+    uint32_t c = size == 1 ? b : b & (0x7F >> size);
+    for (size_t k = 1; k < size; ++k) {
+        if ((byte(i + k) & 0xC0) != 0x80) {
+            size = 1;
+            return 0xFFFD;
+        }
+        c = (c << 6) | (byte(i + k) & 0x3F);
+    }
+    return c;
+}
+
+std::string encode_utf8(uint32_t c) {
+    std::string s;
+    if (c < 0x80) {
+        s += static_cast<char>(c);
+    } else if (c < 0x800) {
+        s += static_cast<char>(0xC0 | (c >> 6));
+        s += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+        s += static_cast<char>(0xE0 | (c >> 12));
+        s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        s += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    return s;
+}
+
+// Matches the pre-tokenizer patterns on a piece of text (up to the next added token), noting how far it looked.
+// Hand-written rather than a regex engine: std::regex has neither \p{..} nor lookaheads on code points.
+struct Cursor {
+    struct Char {
+        uint32_t c;
+        CharClass type;
+        size_t pos;
+        size_t next;
+    };
+
+    std::string_view text;
+    size_t end;
+    size_t extent;
+
+    Char at(size_t i) {
+        if (i >= end) {
+            extent = (std::max)(extent, end + 1);
+            return { 0, CharClass::End, end, end };
+        }
+        size_t size;
+        uint32_t c = decode(text, i, size);
+        extent = (std::max)(extent, i + size);
+        return { c, classify(c), i, i + size };
+    }
+
+    // End of the run of up to `max` characters of the class of `first`.
+    size_t run(const Char& first, size_t max = SIZE_MAX) {
+        size_t pos = first.next;
+        for (size_t count = 1; count < max; ++count) {
+            auto c = at(pos);
+            if (c.type != first.type) break;
+            pos = c.next;
+        }
+        return pos;
+    }
+
+    // 's, 't, 're, 've, 'm, 'll or 'd: its end, or 0.
+    size_t contraction(const Char& apostrophe, bool ignore_case) {
+        auto lower = [&](uint32_t c) { return ignore_case && c >= 'A' && c <= 'Z' ? c + 32 : c; };
+        auto first = at(apostrophe.next);
+        uint32_t a = lower(first.c);
+        if (a == 's' || a == 't' || a == 'm' || a == 'd') return first.next;
+        if (a == 'r' || a == 'v' || a == 'l') {
+            auto second = at(first.next);
+            if (lower(second.c) == (a == 'l' ? 'l' : 'e')) return second.next;
+        }
+        return 0;
+    }
+
+    // Whitespace: `\s*[\r\n]+` (if `newlines`), then `\s+(?!\S)`, then `\s+`.
+    size_t spaces(const Char& first, bool newlines) {
+        size_t last = first.pos;
+        size_t after_newline = 0;
+        size_t count = 0;
+        auto c = first;
+        for (; c.type == CharClass::Space || c.type == CharClass::Newline; c = at(c.next), ++count) {
+            if (c.type == CharClass::Newline) after_newline = c.next;
+            last = c.pos;
+        }
+        if (newlines && after_newline) return after_newline;
+        return c.type == CharClass::End || count == 1 ? c.pos : last;
+    }
+
+    // 's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+    size_t gpt2(size_t pos) {
+        auto c = at(pos);
+        if (c.c == '\'') {
+            if (size_t end = contraction(c, false)) return end;
+        }
+        auto word = c;
+        if (c.c == ' ') {
+            auto next = at(c.next);
+            if (next.type == CharClass::Letter || next.type == CharClass::Number || next.type == CharClass::Other) word = next;
+        }
+        if (word.type == CharClass::Letter || word.type == CharClass::Number || word.type == CharClass::Other) return run(word);
+        return spaces(c, false);
+    }
+
+    // The Llama 3 / Qwen2 pattern, with runs of up to `max_digits` digits.
+    size_t llama3(size_t pos, size_t max_digits) {
+        auto c = at(pos);
+        if (c.c == '\'') {
+            if (size_t end = contraction(c, true)) return end;
+        }
+        if (c.type == CharClass::Letter) return run(c);
+        if (c.type == CharClass::Space || c.type == CharClass::Other) {
+            auto next = at(c.next);
+            if (next.type == CharClass::Letter) return run(next);
+        }
+        if (c.type == CharClass::Number) return run(c, max_digits);
+        auto word = c;
+        if (c.c == ' ') {
+            auto next = at(c.next);
+            if (next.type == CharClass::Other) word = next;
+        }
+        if (word.type == CharClass::Other) {
+            auto next = at(run(word));
+            while (next.type == CharClass::Newline) next = at(next.next);
+            return next.pos;
+        }
+        return spaces(c, true);
+    }
+};
+
+const Config& field(const Config& object, const char* key) {
+    static const Config null;
+    if (!object.is_object()) return null;
+    auto it = object.find(key);
+    return it == object.end() ? null : *it;
+}
+
+// ByteLevel without a prefix space, splitting on the GPT-2 pattern or not.
+bool is_byte_level(const Config& pre_tokenizer, bool use_regex) {
+    return field(pre_tokenizer, "type") == "ByteLevel" && !pre_tokenizer.value("add_prefix_space", true) &&
+           pre_tokenizer.value("use_regex", true) == use_regex;
+}
+
+uint64_t pair_key(int32_t left, int32_t right) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32) | static_cast<uint32_t>(right);
+}
+
+// Collects the TextNodes of a template.
+class TextNodes : public minja::AstVisitor {
+public:
+    std::vector<const minja::TextNode*> nodes;
+
+    void visit(const minja::TemplateNode& node) override {
+        if (auto text = dynamic_cast<const minja::TextNode*>(&node)) nodes.push_back(text);
+        node.visit_children(*this);
+    }
+};
+
+} // namespace
+
+Tokenizer::Tokenizer(std::string_view config) {
+    auto root = Config::parse(config.begin(), config.end());
+
+    auto& normalizer = field(root, "normalizer");
+    if (!normalizer.is_null() && field(normalizer, "type") != "NFC") {
+        throw std::runtime_error("Unsupported tokenizer normalizer: " + normalizer.dump());
+    }
+
+    auto& model = field(root, "model");
+    auto unset = [&](const char* key) { return field(model, key).is_null() || field(model, key) == ""; };
+    if (field(model, "type") != "BPE" || !unset("dropout") || !unset("continuing_subword_prefix") || !unset("end_of_word_suffix")) {
+        throw std::runtime_error("Unsupported tokenizer model (only BPE without dropout or subword prefixes / suffixes is)");
+    }
+
+    auto& pre_tokenizer = field(root, "pre_tokenizer");
+    auto& steps = field(pre_tokenizer, "pretokenizers");
+    if (is_byte_level(pre_tokenizer, true)) {
+        pattern_ = Pattern::Gpt2;
+    } else if (field(pre_tokenizer, "type") == "Sequence" && steps.is_array() && steps.size() == 2 &&
+               field(steps[0], "type") == "Split" && field(steps[0], "behavior") == "Isolated" &&
+               !steps[0].value("invert", false) && is_byte_level(steps[1], false) &&
+               (field(field(steps[0], "pattern"), "Regex") == llama3_pattern ||
+                field(field(steps[0], "pattern"), "Regex") == qwen2_pattern)) {
+        pattern_ = field(field(steps[0], "pattern"), "Regex") == llama3_pattern ? Pattern::Llama3 : Pattern::Qwen2;
+    } else {
+        throw std::runtime_error("Unsupported pre-tokenizer: " + pre_tokenizer.dump());
+    }
+
+    ignore_merges_ = model.value("ignore_merges", false);
+    for (const auto& [symbol, id] : field(model, "vocab").items()) {
+        vocab_.emplace(symbol, id.get<int32_t>());
+    }
+
+    // GPT-2's byte-level alphabet: printable bytes stand for themselves, the others for code points from U+0100 on.
+    uint32_t unprintable = 0;
+    for (int b = 0; b < 256; ++b) {
+        bool printable = (b >= 0x21 && b <= 0x7E) || (b >= 0xA1 && b <= 0xAC) || b >= 0xAE;
+        byte_symbols_[b] = encode_utf8(printable ? b : 0x100 + unprintable++);
+        auto it = vocab_.find(byte_symbols_[b]);
+        if (it == vocab_.end()) throw std::runtime_error("Tokenizer vocabulary lacks the byte " + std::to_string(b));
+        byte_ids_[b] = it->second;
+    }
+
+    uint32_t rank = 0;
+    for (const auto& merge : field(model, "merges")) {
+        std::string left, right;
+        if (merge.is_array() && merge.size() == 2) {
+            left = merge[0].get<std::string>();
+            right = merge[1].get<std::string>();
+        } else {
+            auto text = merge.get<std::string>();
+            auto space = text.find(' ');
+            if (space == std::string::npos) throw std::runtime_error("Invalid tokenizer merge: " + text);
+            left = text.substr(0, space);
+            right = text.substr(space + 1);
+        }
+        auto a = vocab_.find(left), b = vocab_.find(right), merged = vocab_.find(left + right);
+        if (a == vocab_.end() || b == vocab_.end() || merged == vocab_.end()) {
+            throw std::runtime_error("Invalid tokenizer merge: " + left + " " + right);
+        }
+        merges_[pair_key(a->second, b->second)] = { rank++, merged->second };
+    }
+
+    for (const auto& token : field(root, "added_tokens")) {
+        auto content = token.at("content").get<std::string>();
+        if (token.value("lstrip", false) || token.value("rstrip", false) || token.value("single_word", false)) {
+            throw std::runtime_error("Unsupported added token options: " + content);
+        }
+        if (content.empty()) continue;
+        added_[static_cast<uint8_t>(content[0])].push_back({ content, token.at("id").get<int32_t>() });
+        max_added_size_ = (std::max)(max_added_size_, content.size());
+    }
+    for (auto& tokens : added_) {
+        std::stable_sort(tokens.begin(), tokens.end(),
+                         [](const AddedToken& a, const AddedToken& b) { return a.content.size() > b.content.size(); });
+    }
+}
+
+std::vector<int32_t> Tokenizer::encode(std::string_view text) const {
+    std::vector<int32_t> ids;
+    Scan scan { text };
+    append_until(scan, 0, text.size(), ids);
+    return ids;
+}
+
+Tokenizer::Unit Tokenizer::next(Scan& scan, size_t pos) const {
+    if (scan.pos == std::string_view::npos || scan.pos < pos) find_added(scan, pos);
+    if (scan.pos == pos) return { pos + scan.size, pos + 1, scan.token };
+
+    Cursor cursor { scan.text, scan.pos, pos };
+    size_t end = pattern_ == Pattern::Gpt2 ? cursor.gpt2(pos) : cursor.llama3(pos, pattern_ == Pattern::Llama3 ? 3 : 1);
+    return { end, cursor.extent, -1 };
+}
+
+void Tokenizer::append(Scan& scan, size_t pos, const Unit& unit, std::vector<int32_t>& ids) const {
+    if (unit.token >= 0) {
+        ids.push_back(unit.token);
+        return;
+    }
+    auto word = scan.text.substr(pos, unit.end - pos);
+    auto [it, added] = scan.words.try_emplace(word, ids.size(), 0);
+    if (!added) {
+        for (size_t i = 0; i < it->second.second; ++i) ids.push_back(ids[it->second.first + i]);
+        return;
+    }
+    encode_word(word, ids);
+    it->second.second = ids.size() - it->second.first;
+}
+
+size_t Tokenizer::append_until(Scan& scan, size_t pos, size_t end, std::vector<int32_t>& ids) const {
+    while (pos < end) {
+        auto unit = next(scan, pos);
+        append(scan, pos, unit, ids);
+        pos = unit.end;
+    }
+    return pos;
+}
+
+size_t Tokenizer::open_suffix(std::string_view text) const {
+    size_t pos = text.size() > max_added_size_ ? text.size() - max_added_size_ + 1 : 0;
+    for (; pos < text.size(); ++pos) {
+        auto rest = text.substr(pos);
+        for (const auto& token : added_[static_cast<uint8_t>(text[pos])]) {
+            if (token.content.size() > rest.size() && token.content.compare(0, rest.size(), rest) == 0) return pos;
+        }
+    }
+    return text.size();
+}
+
+// Leftmost-longest added token at or after `pos`.
+void Tokenizer::find_added(Scan& scan, size_t pos) const {
+    auto text = scan.text;
+    for (; pos < text.size(); ++pos) {
+        for (const auto& token : added_[static_cast<uint8_t>(text[pos])]) {
+            if (text.compare(pos, token.content.size(), token.content) == 0) {
+                scan.pos = pos;
+                scan.size = token.content.size();
+                scan.token = token.id;
+                return;
+            }
+        }
+    }
+    scan.pos = text.size();
+    scan.size = 0;
+    scan.token = -1;
+}
+
+void Tokenizer::encode_word(std::string_view word, std::vector<int32_t>& ids) const {
+    if (word.size() == 1) {
+        ids.push_back(byte_ids_[static_cast<uint8_t>(word[0])]);
+        return;
+    }
+    if (ignore_merges_) {
+        std::string symbols;
+        for (char b : word) symbols += byte_symbols_[static_cast<uint8_t>(b)];
+        auto it = vocab_.find(symbols);
+        if (it != vocab_.end()) {
+            ids.push_back(it->second);
+            return;
+        }
+    }
+
+    // Applies the merges from the lowest rank, leftmost first, over a linked list of the bytes' symbols.
+    struct Symbol {
+        int32_t id;  // -1 once merged into the previous one
+        int prev;
+        int next;
+    };
+    struct Candidate {
+        uint32_t rank;
+        int left;
+        int right;
+        int32_t left_id;
+        int32_t right_id;
+        int32_t merged;
+    };
+    int size = static_cast<int>(word.size());
+    std::vector<Symbol> symbols(size);
+    for (int i = 0; i < size; ++i) {
+        symbols[i] = { byte_ids_[static_cast<uint8_t>(word[i])], i - 1, i + 1 < size ? i + 1 : -1 };
+    }
+    auto later = [](const Candidate& a, const Candidate& b) { return a.rank != b.rank ? a.rank > b.rank : a.left > b.left; };
+    std::priority_queue<Candidate, std::vector<Candidate>, decltype(later)> queue(later);
+    auto consider = [&](int left) {
+        if (left < 0 || symbols[left].next < 0) return;
+        int right = symbols[left].next;
+        auto it = merges_.find(pair_key(symbols[left].id, symbols[right].id));
+        if (it != merges_.end()) {
+            queue.push({ it->second.rank, left, right, symbols[left].id, symbols[right].id, it->second.id });
+        }
+    };
+    for (int i = 0; i + 1 < size; ++i) consider(i);
+    while (!queue.empty()) {
+        auto merge = queue.top();
+        queue.pop();
+        auto& left = symbols[merge.left];
+        auto& right = symbols[merge.right];
+        if (left.id != merge.left_id || left.next != merge.right || right.id != merge.right_id) continue;
+        left.id = merge.merged;
+        left.next = right.next;
+        if (right.next >= 0) symbols[right.next].prev = merge.left;
+        right.id = -1;
+        consider(left.prev);
+        consider(merge.left);
+    }
+    for (int i = 0; i >= 0; i = symbols[i].next) ids.push_back(symbols[i].id);
+}
+
+TokenizedTemplate::TokenizedTemplate(std::shared_ptr<const Tokenizer> tokenizer, std::shared_ptr<const minja::TemplateNode> root)
+    : tokenizer_(std::move(tokenizer)), root_(std::move(root)) {
+    TextNodes collector;
+    collector.visit(*root_);
+    for (auto node : collector.nodes) {
+        auto text = node->get_text();
+        auto open = tokenizer_->open_suffix(text);
+        StaticText tokens;
+        Tokenizer::Scan scan { text };
+        for (size_t pos = 0; pos < text.size(); pos = tokens.end) {
+            auto unit = tokenizer_->next(scan, pos);
+            if (unit.extent > open) break;
+            tokens.starts.push_back(pos);
+            tokens.first_ids.push_back(tokens.ids.size());
+            tokenizer_->append(scan, pos, unit, tokens.ids);
+            tokens.end = unit.end;
+        }
+        if (!tokens.starts.empty()) texts_.emplace(node, std::move(tokens));
+    }
+}
+
+std::vector<int32_t> TokenizedTemplate::render(const std::shared_ptr<minja::Context>& context) const {
+    std::ostringstream out;
+    minja::TextNode::TextOffsets offsets { &out, {} };
+    auto previous = minja::TextNode::record_text(&offsets);
+    try {
+        root_->render(out, context);
+    } catch (...) {
+        minja::TextNode::record_text(previous);
+        throw;
+    }
+    minja::TextNode::record_text(previous);
+    auto text = out.str();
+
+    // Tokenizes the text written by expressions up to a TextNode, and on into its text until reaching the start of one
+    // of its units tokenized ahead of time (the units after a position only depend on the text from there): from there,
+    // takes their ids.
+    std::vector<int32_t> ids;
+    Tokenizer::Scan scan { text };
+    size_t pos = 0;
+    for (const auto& [node, offset] : offsets.offsets) {
+        pos = tokenizer_->append_until(scan, pos, offset, ids);
+        auto it = texts_.find(node);
+        if (it == texts_.end()) continue;
+        const auto& tokens = it->second;
+        while (pos < offset + tokens.end) {
+            auto unit = std::lower_bound(tokens.starts.begin(), tokens.starts.end(), pos - offset);
+            if (unit != tokens.starts.end() && *unit == pos - offset) {
+                ids.insert(ids.end(), tokens.ids.begin() + tokens.first_ids[unit - tokens.starts.begin()], tokens.ids.end());
+                pos = offset + tokens.end;
+                break;
+            }
+            pos = tokenizer_->append_until(scan, pos, pos + 1, ids);
+        }
+    }
+    tokenizer_->append_until(scan, pos, text.size(), ids);
+    return ids;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "minja.hpp"
+
+// Byte-level BPE tokenizer read from a Hugging Face tokenizer.json, and rendering of templates straight to token ids.
+//
+// Supports the tokenizers of the GPT-2, Llama 3 and Qwen2 families: a BPE model over byte-level symbols, added tokens
+// (without lstrip / rstrip / single_word), no normalizer or NFC (the text is taken to be in NFC already), and either the
+// ByteLevel pre-tokenizer or a Split on the Llama 3 / Qwen2 pattern followed by ByteLevel. Others throw when loaded.
+// Like encode(text, add_special_tokens=False), the post-processor isn't applied: chat templates write their own BOS.
+
+class Tokenizer {
+public:
+    // Parses the contents of a tokenizer.json.
+    explicit Tokenizer(std::string_view config);
+
+    std::vector<int32_t> encode(std::string_view text) const;
+
+    // A text is tokenized as a chain of units, each an added token or a pre-tokenized word encoded on its own.
+    // The unit starting at a position only depends on the text from there.
+    struct Unit {
+        size_t end;
+        size_t extent;   // End of the text looked at to choose the unit; past the end of the text if it looked for more.
+        int32_t token;   // Id of the added token, -1 for a word.
+    };
+
+    // State of the tokenization of a text: where the next added token is, and the words already encoded (as
+    // [first, first + count) in the ids appended to, which must be the same vector for the whole scan).
+    struct Scan {
+        std::string_view text;
+        size_t pos = std::string_view::npos;  // Searched again when the scan goes past it; text.size() if there's none.
+        size_t size = 0;
+        int32_t token = -1;
+        std::unordered_map<std::string_view, std::pair<size_t, size_t>> words;
+
+        explicit Scan(std::string_view text) : text(text) {}
+    };
+
+    // Unit starting at `pos`, which must be the end of the previous one (or 0).
+    Unit next(Scan& scan, size_t pos) const;
+    // Appends the ids of the unit at [pos, unit.end) of the scanned text.
+    void append(Scan& scan, size_t pos, const Unit& unit, std::vector<int32_t>& ids) const;
+    // Appends the ids of the units from `pos` on, up to the first one that ends at or after `end`. Returns its end.
+    size_t append_until(Scan& scan, size_t pos, size_t end, std::vector<int32_t>& ids) const;
+    // Smallest position from which the end of `text` could be the start of an added token continued by the text after it
+    // (text.size() if none): units chosen looking at the text before it are the same whatever follows.
+    size_t open_suffix(std::string_view text) const;
+
+private:
+    enum class Pattern { Gpt2, Llama3, Qwen2 };
+    struct Merge {
+        uint32_t rank;
+        int32_t id;
+    };
+    struct AddedToken {
+        std::string content;
+        int32_t id;
+    };
+
+    void find_added(Scan& scan, size_t pos) const;
+    void encode_word(std::string_view word, std::vector<int32_t>& ids) const;
+
+    Pattern pattern_;
+    bool ignore_merges_ = false;
+    std::unordered_map<std::string, int32_t> vocab_;
+    std::unordered_map<uint64_t, Merge> merges_;  // Keyed by the ids of the pair.
+    std::string byte_symbols_[256];               // Byte-level symbol of each byte
+    int32_t byte_ids_[256];
+    std::vector<AddedToken> added_[256];          // By first byte, longest first
+    size_t max_added_size_ = 0;
+};
+
+// A template with its constant text tokenized ahead of time: renders straight to token ids, tokenizing only the text
+// written by expressions and the few units of constant text around it that can be tokenized with it.
+class TokenizedTemplate {
+public:
+    TokenizedTemplate(std::shared_ptr<const Tokenizer> tokenizer, std::shared_ptr<const minja::TemplateNode> root);
+
+    // Same ids as tokenizer->encode() of the rendered text.
+    std::vector<int32_t> render(const std::shared_ptr<minja::Context>& context) const;
+
+private:
+    // Leading units of a TextNode's text tokenized on its own that are the same wherever the text is rendered.
+    struct StaticText {
+        std::vector<size_t> starts;     // Start of each unit in the text
+        std::vector<size_t> first_ids;  // Index of its first id in ids
+        std::vector<int32_t> ids;
+        size_t end = 0;                 // End of the last unit
+    };
+
+    std::shared_ptr<const Tokenizer> tokenizer_;
+    std::shared_ptr<const minja::TemplateNode> root_;
+    std::unordered_map<const minja::TextNode*, StaticText> texts_;
+};
@@ -0,0 +1,201 @@
+// Smoke test of the C API: rendering to a buffer and to a sink, render limits, output spans and token ids.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cminja.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if (!ok) {
+        std::printf("FAIL %s (last error: %s)\n", what, cminja_last_error());
+        failures++;
+    }
+}
+
+cminja_template* compile(const std::string& source) {
+    return cminja_template_compile(source.data(), source.size(), CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS);
+}
+
+cminja_data* load(const std::string& json) {
+    return cminja_data_from_json(json.data(), json.size());
+}
+
+int append(void* user_data, const char* chunk, size_t size) {
+    static_cast<std::string*>(user_data)->append(chunk, size);
+    return 0;
+}
+
+int abort_sink(void*, const char*, size_t) {
+    return 1;
+}
+
+// A byte-level BPE tokenizer.json: each byte's symbol has the byte as id, "hi" is merged, <|im_start|> is added.
+std::string tokenizer_config() {
+    std::string vocab;
+    unsigned unprintable = 0;
+    for (int b = 0; b < 256; ++b) {
+        bool printable = (b >= 0x21 && b <= 0x7E) || (b >= 0xA1 && b <= 0xAC) || b >= 0xAE;
+        unsigned c = printable ? b : 0x100 + unprintable++;
+        std::string symbol;
+        if (c == '"' || c == '\\') symbol = std::string("\\") + char(c);
+        else if (c < 0x80) symbol = char(c);
+        else symbol = { char(0xC0 | (c >> 6)), char(0x80 | (c & 0x3F)) };
+        vocab += "\"" + symbol + "\": " + std::to_string(b) + ", ";
+    }
+    vocab += "\"hi\": 256";
+    return R"({"normalizer": null, "pre_tokenizer": {"type": "ByteLevel", "add_prefix_space": false, "use_regex": true},
+               "added_tokens": [{"id": 300, "content": "<|im_start|>"}],
+               "model": {"type": "BPE", "vocab": {)" + vocab + R"(}, "merges": ["h i"]}})";
+}
+
+void test_render() {
+    auto tmpl = compile("{% for m in ms %}{{ m }};{% endfor %}");
+    auto data = load(R"({"ms": ["a", "b"]})");
+    check(tmpl && data, "compile and load");
+
+    size_t size = 0;
+    check(cminja_render(tmpl, data, nullptr, 0, &size) == CMINJA_BUFFER_TOO_SMALL && size == 4, "render size query");
+    char buffer[4];
+    check(cminja_render(tmpl, data, buffer, sizeof(buffer), &size) == CMINJA_OK && std::string(buffer, size) == "a;b;", "render to a buffer");
+
+    std::string output;
+    check(cminja_render_to(tmpl, data, append, &output) == CMINJA_OK && output == "a;b;", "render to a sink");
+    check(cminja_render_to(tmpl, data, abort_sink, nullptr) == CMINJA_ERROR, "render aborted by the sink");
+
+    // The output is streamed in chunks, and the render stops at the first one the sink refuses.
+    auto large = compile("{% for i in range(100000) %}{{ i }},{% endfor %}");
+    struct Chunks {
+        size_t count = 0, size = 0;
+    } chunks;
+    auto count_sink = [](void* user_data, const char*, size_t size) {
+        auto chunks = static_cast<Chunks*>(user_data);
+        chunks->count++;
+        chunks->size += size;
+        return chunks->count == 2 ? 1 : 0;
+    };
+    check(cminja_render_to(large, data, count_sink, &chunks) == CMINJA_ERROR, "large render aborted by the sink");
+    check(chunks.count == 2 && chunks.size < 100000, "render stopped at the refused chunk");
+    check(std::string(cminja_last_error()) == "Render aborted by the sink", "sink abort message");
+    check(cminja_render(large, data, buffer, sizeof(buffer), &size) == CMINJA_BUFFER_TOO_SMALL && size == 588890
+          && std::string(buffer, sizeof(buffer)) == "0,1,", "start of a large render in a small buffer");
+    cminja_template_free(large);
+
+    check(!compile("{% for %}"), "compile error");
+    check(std::strlen(cminja_last_error()) > 0, "compile error message");
+    check(!load("{"), "invalid JSON");
+
+    const char yaml[] = "ms: [c, d]\n";
+    auto yaml_data = cminja_data_from_yaml(yaml, sizeof(yaml) - 1);
+    output.clear();
+    check(yaml_data && cminja_render_to(tmpl, yaml_data, append, &output) == CMINJA_OK && output == "c;d;", "render YAML data");
+
+    cminja_data_free(yaml_data);
+    cminja_data_free(data);
+    cminja_template_free(tmpl);
+}
+
+void test_limits() {
+    auto data = load("{}");
+    struct Case {
+        const char* source;
+        cminja_limits limits;
+        const char* what;
+    };
+    const Case cases[] = {
+        { "{% for i in range(100) %}{{ i }}{% endfor %}", { 0, 0, 10, 0 }, "max_steps" },
+        { "{% for i in range(100) %}{{ i }}{% endfor %}", { 0, 50, 0, 0 }, "max_output" },
+        { "{% macro f(n) %}{% if n > 0 %}{{ f(n - 1) }}{% endif %}{% endmacro %}{{ f(20) }}", { 0, 0, 0, 5 }, "max_depth" },
+        { "{% for i in range(1000000000) %}{% endfor %}", { 50, 0, 0, 0 }, "timeout_ms" },
+        { "{{ range(1000000000) | list | length }}", { 0, 0, 1000, 0 }, "max_steps of a list" },
+        { "{{ (range(1000000000) | list)[0] }}", { 0, 0, 1000, 0 }, "max_steps of an indexed list" },
+    };
+    for (const auto& c : cases) {
+        auto tmpl = compile(c.source);
+        std::string output;
+        check(cminja_render_limited(tmpl, data, &c.limits, append, &output) == CMINJA_LIMIT_EXCEEDED && output.empty(), c.what);
+        cminja_template_free(tmpl);
+    }
+
+    auto tmpl = compile("{% for i in range(3) %}{{ i }}{% endfor %}");
+    cminja_limits limits = { 1000, 3, 6, 1 };  // range() items and iterations are steps
+    std::string output;
+    check(cminja_render_limited(tmpl, data, &limits, append, &output) == CMINJA_OK && output == "012", "within limits");
+    cminja_template_free(tmpl);
+    cminja_data_free(data);
+}
+
+void test_spans() {
+    auto tmpl = compile("{% for m in ms %}<{% generation %}{{ m }}{% endgeneration %}>{% endfor %}");
+    auto data = load(R"({"ms": ["ab", "c"]})");
+    struct Outputs {
+        std::string text, spans;
+    } outputs;
+    auto text_sink = [](void* user_data, const char* chunk, size_t size) {
+        static_cast<Outputs*>(user_data)->text.append(chunk, size);
+        return 0;
+    };
+    auto spans_sink = [](void* user_data, const char* chunk, size_t size) {
+        static_cast<Outputs*>(user_data)->spans.append(chunk, size);
+        return 0;
+    };
+    check(cminja_render_spans(tmpl, data, text_sink, spans_sink, &outputs) == CMINJA_OK, "render spans");
+    check(outputs.text == "<ab><c>", "text with spans");
+    check(outputs.spans == R"({"generation":[[1,3],[5,6]],"loops":[{"line":1,"iterations":[[0,4],[4,7]]}]})", "spans");
+    cminja_data_free(data);
+    cminja_template_free(tmpl);
+}
+
+void test_tokens() {
+    auto config = tokenizer_config();
+    auto tokenizer = cminja_tokenizer_load(config.data(), config.size());
+    check(tokenizer, "load tokenizer");
+    auto constant = compile("<|im_start|>hi hi");
+    auto dynamic = compile("<|im_start|>{{ w }} {{ w }}");
+    auto data = load(R"({"w": "hi"})");
+    check(cminja_template_set_tokenizer(constant, tokenizer) == CMINJA_OK, "tokenize the constant template");
+    check(cminja_template_set_tokenizer(dynamic, tokenizer) == CMINJA_OK, "tokenize the template");
+    cminja_tokenizer_free(tokenizer);
+
+    // "<|im_start|>", "hi", " " (its byte as id), "hi"
+    const std::vector<int32_t> expected { 300, 256, 32, 256 };
+    for (auto tmpl : { constant, dynamic }) {
+        size_t count = 0;
+        check(cminja_render_tokens(tmpl, data, nullptr, 0, &count) == CMINJA_BUFFER_TOO_SMALL && count == expected.size(), "token count query");
+        std::vector<int32_t> ids(count);
+        check(cminja_render_tokens(tmpl, data, ids.data(), ids.size(), &count) == CMINJA_OK && ids == expected, "token ids");
+        std::vector<int32_t> partial(2);
+        check(cminja_render_tokens(tmpl, data, partial.data(), partial.size(), &count) == CMINJA_BUFFER_TOO_SMALL && count == expected.size() &&
+              partial == std::vector<int32_t>(expected.begin(), expected.begin() + 2), "first token ids");
+    }
+    std::vector<int32_t> ids;
+    auto token_sink = [](void* user_data, const int32_t* chunk, size_t count) {
+        auto& ids = *static_cast<std::vector<int32_t>*>(user_data);
+        ids.insert(ids.end(), chunk, chunk + count);
+        return 0;
+    };
+    check(cminja_render_tokens_to(dynamic, data, token_sink, &ids) == CMINJA_OK && ids == expected, "token ids to a sink");
+
+    auto untokenized = compile("hi");
+    check(cminja_render_tokens(untokenized, data, nullptr, 0, nullptr) == CMINJA_ERROR, "tokens without a tokenizer");
+    cminja_template_free(untokenized);
+    cminja_data_free(data);
+    cminja_template_free(dynamic);
+    cminja_template_free(constant);
+}
+
+} // namespace
+
+int main() {
+    test_render();
+    test_limits();
+    test_spans();
+    test_tokens();
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+// Incremental renders (appended messages) and patch renders (JSON Patch updates) give the output of a full render.
+
+#include <cstdio>
+#include <string>
+
+#include "cminja.h"
+#include "json.hpp"
+
+using json = nlohmann::ordered_json;
+
+namespace {
+
+const char chat_template[] = R"({% macro header(role) %}<|im_start|>{{ role }}
+{% endmacro %}
+{% set ns = namespace(tools=0) %}
+{% if system is defined %}{{ header('system') }}{{ system }}<|im_end|>
+{% endif %}
+{% for message in messages %}
+{% if message.role == 'tool' %}{% set ns.tools = ns.tools + 1 %}{% endif %}
+{{ header(message.role) }}{{ message.content }}<|im_end|>
+{% endfor %}
+tools: {{ ns.tools }}
+{% if add_generation_prompt %}{{ header('assistant') }}{% endif %})";
+
+// Renders in full every time: the output before the last message depends on the number of messages.
+const char counting_template[] = R"({% for message in messages %}{{ message.content }}{% if not loop.last %} {{ loop.revindex }} {% endif %}{% endfor %})";
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::printf("FAIL %s (last error: %s)\n", what.c_str(), cminja_last_error());
+        failures++;
+    }
+}
+
+int append(void* user_data, const char* chunk, size_t size) {
+    static_cast<std::string*>(user_data)->append(chunk, size);
+    return 0;
+}
+
+std::string full_render(const cminja_template* tmpl, const json& data) {
+    auto text = data.dump();
+    auto loaded = cminja_data_from_json(text.data(), text.size());
+    std::string output;
+    if (!loaded || cminja_render_to(tmpl, loaded, append, &output) != CMINJA_OK) output = std::string("error: ") + cminja_last_error();
+    cminja_data_free(loaded);
+    return output;
+}
+
+json message(const char* role, const std::string& content) {
+    return { { "role", role }, { "content", content } };
+}
+
+void test_incremental(const cminja_template* tmpl, bool resumes) {
+    auto state = cminja_incremental_new();
+    json data = { { "system", "Be brief." }, { "messages", json::array() }, { "add_generation_prompt", true } };
+    std::string output;
+    auto render = [&](const std::string& step) {
+        auto text = data.dump();
+        auto loaded = cminja_data_from_json(text.data(), text.size());
+        size_t kept = 0;
+        std::string rest;
+        check(cminja_render_incremental(state, tmpl, loaded, &kept, append, &rest) == CMINJA_OK, step);
+        cminja_data_free(loaded);
+        check(kept <= output.size(), step + ": stable prefix within the previous output");
+        output = output.substr(0, kept) + rest;
+        check(output == full_render(tmpl, data), step + ": same output as a full render");
+        return kept;
+    };
+
+    render("no messages");
+    const char* roles[] = { "user", "assistant", "tool", "assistant", "user" };
+    for (int i = 0; i < 5; ++i) {
+        data["messages"].push_back(message(roles[i], "message " + std::to_string(i)));
+        auto kept = render("append message " + std::to_string(i));
+        if (i > 0) check((kept > 0) == resumes, "append message " + std::to_string(i) + ": resumed or not");
+    }
+    data["messages"].push_back(message("tool", "a"));
+    data["messages"].push_back(message("user", "b"));
+    render("append two messages");
+    data["messages"][1]["content"] = "edited";
+    render("edit a message");
+    data["messages"].erase(data["messages"].size() - 1);
+    render("remove a message");
+    data["add_generation_prompt"] = false;
+    render("change another variable");
+    cminja_incremental_free(state);
+}
+
+void test_patch(const cminja_template* tmpl) {
+    json data = { { "messages", { message("user", "a"), message("assistant", "b") } }, { "add_generation_prompt", false } };
+    auto text = data.dump();
+    auto state = cminja_patch_render_new(tmpl, text.data(), text.size());
+    check(state, "patch render");
+
+    const char* patches[] = {
+        R"([{"op": "replace", "path": "/messages/1/content", "value": "c"}])",
+        R"([{"op": "add", "path": "/messages/-", "value": {"role": "tool", "content": "d"}}])",
+        R"([{"op": "add", "path": "/system", "value": "s"}])",
+        R"([{"op": "replace", "path": "/add_generation_prompt", "value": true}])",
+        R"([{"op": "remove", "path": "/messages/0"}, {"op": "replace", "path": "/system", "value": "t"}])",
+    };
+    for (const char* patch : patches) {
+        data = data.patch(json::parse(patch));
+        size_t rerendered = 0;
+        check(cminja_patch_render_apply(state, patch, std::char_traits<char>::length(patch), &rerendered) == CMINJA_OK, patch);
+        size_t size = 0;
+        auto output = cminja_patch_render_output(state, &size);
+        check(std::string(output, size) == full_render(tmpl, data), std::string(patch) + ": same output as a full render");
+    }
+    // The template doesn't read it: nothing to render again.
+    const char unread[] = R"([{"op": "add", "path": "/unused", "value": 1}])";
+    size_t rerendered = 1;
+    check(cminja_patch_render_apply(state, unread, sizeof(unread) - 1, &rerendered) == CMINJA_OK && rerendered == 0, unread);
+    cminja_patch_render_free(state);
+}
+
+} // namespace
+
+int main() {
+    auto tmpl = cminja_template_compile(chat_template, sizeof(chat_template) - 1, CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS);
+    auto counting = cminja_template_compile(counting_template, sizeof(counting_template) - 1, CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS);
+    check(tmpl && counting, "compile");
+    test_incremental(tmpl, true);
+    test_incremental(counting, false);
+    test_patch(tmpl);
+    test_patch(counting);
+    cminja_template_free(counting);
+    cminja_template_free(tmpl);
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
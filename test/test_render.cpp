@@ -0,0 +1,134 @@
+// Template output against the expected output, rendered through the C API like the cminja CLI does (trim_blocks and
+// lstrip_blocks), serially and with loop iterations rendered in parallel.
+
+#include <cstdio>
+#include <string>
+
+#include "cminja.h"
+
+namespace {
+
+struct Case {
+    const char* name;
+    const char* source;
+    const char* data;
+    const char* expected;
+};
+
+const Case cases[] = {
+    // Basics
+    { "text", "Hello {{ name }}!", R"({"name": "world"})", "Hello world!" },
+    { "chatml",
+      "{% for message in messages %}{{ '<|im_start|>' + message['role'] + '\\n' + message['content'] + '<|im_end|>\\n' }}{% endfor %}",
+      R"({"messages": [{"role": "user", "content": "Hi"}, {"role": "assistant", "content": "Hello"}]})",
+      "<|im_start|>user\nHi<|im_end|>\n<|im_start|>assistant\nHello<|im_end|>\n" },
+    { "trim blocks", "{% if true %}\n  a\n{% endif %}\nb", "{}", "  a\nb" },
+    { "tojson", "{{ d | tojson }}|{{ d.l }}|{{ d.s }}", R"({"d": {"l": [1, "x"], "s": "it's"}})",
+      R"({"l": [1, "x"], "s": "it's"}|[1, 'x']|it's)" },
+    { "tojson indent", "{{ d | tojson(indent=2) }}", R"({"d": {"a": [1]}})", "{\n  \"a\": [\n    1\n  ]\n}" },
+    { "tojson nested indent", "{{ d.t | tojson(indent=2) }}|{{ [d.t] | tojson(indent=2) }}|{{ d.t | tojson(indent=2) }}",
+      R"({"d": {"t": {"f": [1, {"b": null}]}}})",
+      "{\n  \"f\": [\n    1,\n    {\n      \"b\": null\n    }\n  ]\n}|"
+      "[\n  {\n    \"f\": [\n      1,\n      {\n        \"b\": null\n      }\n    ]\n  }\n]|"
+      "{\n  \"f\": [\n    1,\n    {\n      \"b\": null\n    }\n  ]\n}" },
+
+    // Copy-on-write: mutations of the input are seen through every reference to it during the render
+    { "append through alias", "{% set l = d.l %}{% set _ = l.append(2) %}{{ d.l }}{{ l }}", R"({"d": {"l": [1]}})", "[1, 2][1, 2]" },
+    { "append then dump", "{{ d | tojson }}{% set _ = d.l.append(2) %}{{ d | tojson }}", R"({"d": {"l": [1]}})",
+      R"({"l": [1]}{"l": [1, 2]})" },
+    { "pop", "{% set _ = xs.pop() %}{{ xs | length }}{{ xs }}", R"({"xs": [1, 2, 3]})", "2[1, 2]" },
+    { "mutated in a loop", "{% for m in ms %}{% set _ = m.tags.append('x') %}{% endfor %}{{ ms | map(attribute='tags') | list }}",
+      R"({"ms": [{"tags": []}, {"tags": ["a"]}]})", "[['x'], ['a', 'x']]" },
+    { "loop over a mutated list", "{% for x in xs %}{% if loop.first %}{% set _ = xs.append(9) %}{% endif %}{{ x }}{% endfor %}{{ xs }}",
+      R"({"xs": [1, 2]})", "12[1, 2, 9]" },
+    { "namespace", "{% set ns = namespace(n=0) %}{% for x in xs %}{% set ns.n = ns.n + x %}{% endfor %}{{ ns.n }}",
+      R"({"xs": [1, 2, 3]})", "6" },
+
+    // Lazy sequences and filter chains
+    { "range", "{% for i in range(3) %}{{ i }}{{ loop.length }}{% endfor %}", "{}", "031323" },
+    { "range step", "{{ range(10, 0, -3) | list }}", "{}", "[10, 7, 4, 1]" },
+    { "items", "{% for k, v in d.items() %}{{ k }}={{ v }};{% endfor %}", R"({"d": {"b": 1, "a": 2}})", "b=1;a=2;" },
+    { "select map join", "{{ xs | reject('equalto', 2) | map('string') | join(',') }}", R"({"xs": [1, 2, 3, 2, 5]})", "1,3,5" },
+    { "select length", "{{ xs | select('equalto', 2) | list | length }}", R"({"xs": [1, 2, 3, 2]})", "2" },
+    { "selectattr", "{{ ms | selectattr('role', 'equalto', 'user') | map(attribute='content') | join }}",
+      R"({"ms": [{"role": "user", "content": "a"}, {"role": "tool", "content": "b"}, {"role": "user", "content": "c"}]})", "ac" },
+    { "slices", "{{ xs[1:] }}{{ xs[:2] | join }}{{ (xs | map('string'))[1:] | join }}", R"({"xs": [1, 2, 3]})", "[2, 3]1223" },
+    { "loop attributes", "{% for x in xs | reject('equalto', 2) %}{{ loop.index }}/{{ loop.length }}{% if not loop.last %},{% endif %}{% endfor %}",
+      R"({"xs": [1, 2, 3]})", "1/2,2/2" },
+    { "loop over a sequence twice", "{% set s = xs | map('string') %}{% for x in s %}{{ x }}{% endfor %}{% for x in s %}{{ x }}{% endfor %}",
+      R"({"xs": [1, 2]})", "1212" },
+
+    // Macros: frames of their own, memoized when pure
+    { "macro", "{% macro greet(name, punct='!') %}Hi {{ name }}{{ punct }}{% endmacro %}{{ greet('a') }} {{ greet('b', '?') }}", "{}",
+      "Hi a! Hi b?" },
+    { "macro default from a parameter", "{% macro m(x, y=x) %}{{ y }}{% endmacro %}{{ m(1) }}{{ m(1, 2) }}", "{}", "12" },
+    { "macro frame", "{% set x = 1 %}{% macro m() %}{% set x = 2 %}{{ x }}{% endmacro %}{{ m() }}{{ x }}", "{}", "21" },
+    { "macro caller scope", "{% macro m() %}{{ y is defined }}{% endmacro %}{% for y in [1] %}{{ m() }}{% endfor %}", "{}", "False" },
+    { "macro reads the defining scope", "{% set p = '>' %}{% macro m(x) %}{{ p }}{{ x }}{% endmacro %}{{ m(1) }}{% set p = '<' %}{{ m(1) }}",
+      "{}", ">1<1" },
+    { "recursive macro", "{% macro f(n) %}{% if n > 0 %}{{ n }}{{ f(n - 1) }}{% endif %}{% endmacro %}{{ f(3) }}", "{}", "321" },
+    { "macros calling macros", "{% macro a(x) %}[{{ x }}]{% endmacro %}{% macro b(x) %}{{ a(x) }}{{ a(x) }}{% endmacro %}{{ b(1) }}{{ b(2) }}",
+      "{}", "[1][1][2][2]" },
+    { "memoized macro with JSON argument", "{% macro show(m) %}{{ m.role }}:{{ m.content }};{% endmacro %}{% for m in ms %}{{ show(m) }}{% endfor %}",
+      R"({"ms": [{"role": "user", "content": "a"}, {"role": "user", "content": "a"}, {"role": "bot", "content": "b"}]})",
+      "user:a;user:a;bot:b;" },
+    { "memoized macro after a mutation", "{% macro show(m) %}{{ m.l }}{% endmacro %}{{ show(d) }}{% set alias = d.l %}{% set _ = alias.append(2) %}{{ show(d) }}",
+      R"({"d": {"l": [1]}})", "[1][1, 2]" },
+    { "memoized macro dumping after a mutation", "{% macro show(m) %}{{ m }}{{ m | tojson }}{% endmacro %}{{ show(d) }}{% set alias = d.l %}{% set _ = alias.append(2) %}{{ show(d) }}",
+      R"({"d": {"l": [1]}})", R"({'l': [1]}{"l": [1]}{'l': [1, 2]}{"l": [1, 2]})" },
+    { "memoized macro reading an attribute named like a variable", "{% macro show(m) %}{{ m.l }}{{ m['l'] }}{% endmacro %}{{ show(d) }}{{ show(d) }}",
+      R"({"d": {"l": [1]}, "l": [2]})", "[1][1][1][1]" },
+    { "memoized macro mapping with a macro", "{% macro twice(x) %}{{ x }}{{ x }}{% endmacro %}{% macro m(xs) %}{{ xs | map('twice') | join(',') }}{% endmacro %}{{ m([1, 2]) }}{{ m([1, 2]) }}",
+      "{}", "11,2211,22" },
+    { "macro in a loop", "{% for x in xs %}{% macro m() %}{{ x }}{% endmacro %}{{ m() }}{% endfor %}", R"({"xs": [1, 2]})", "12" },
+    { "macro stored from a loop", "{% set ns = namespace(m=none) %}{% for x in [1, 2] %}{% macro m() %}<{{ x }}>{% endmacro %}{% set ns.m = m %}{% endfor %}{{ ns.m() }}",
+      "{}", "<2>" },
+    { "macro stored from a macro", "{% set ns = namespace(f=none) %}{% macro outer(p) %}{% macro inner(x) %}{{ p }}{{ x }}{% endmacro %}{% set ns.f = inner %}{% endmacro %}{{ outer('a') }}{{ ns.f(1) }}{{ ns.f(2) }}",
+      "{}", "a1a2" },
+    { "macro through a filter", "{% macro twice(x) %}{{ x }}{{ x }}{% endmacro %}{{ xs | map('twice') | join(',') }}", R"({"xs": [1, 2]})",
+      "11,22" },
+
+    // Loops
+    { "loop else", "{% for x in [] %}{{ x }}{% else %}empty{% endfor %}", "{}", "empty" },
+    { "loop condition", "{% for x in xs if x > 1 %}{{ x }}{% endfor %}", R"({"xs": [1, 2, 3]})", "23" },
+    { "break continue", "{% for x in xs %}{% if x == 2 %}{% continue %}{% endif %}{% if x == 4 %}{% break %}{% endif %}{{ x }}{% endfor %}",
+      R"({"xs": [1, 2, 3, 4, 5]})", "13" },
+    { "large loop", "{% for i in range(40) %}{{ i % 10 }}{% endfor %}", "{}", "0123456789012345678901234567890123456789" },
+    { "large loop with sets", "{% for m in ms %}{% set r = m.role | lower %}{{ r }}{% endfor %}",
+      R"({"ms": [{"role": "A"}, {"role": "B"}, {"role": "C"}, {"role": "D"}, {"role": "E"}, {"role": "F"}, {"role": "G"}, {"role": "H"}]})",
+      "abcdefgh" },
+};
+
+int sink(void* user_data, const char* chunk, size_t size) {
+    static_cast<std::string*>(user_data)->append(chunk, size);
+    return 0;
+}
+
+// Renders `c` twice with the same data: the second render mustn't see the mutations of the first.
+int check(const Case& c, const char* mode) {
+    auto tmpl = cminja_template_compile(c.source, std::char_traits<char>::length(c.source), CMINJA_TRIM_BLOCKS | CMINJA_LSTRIP_BLOCKS);
+    auto data = cminja_data_from_json(c.data, std::char_traits<char>::length(c.data));
+    int failures = 0;
+    for (int i = 1; i <= 2; ++i) {
+        std::string output;
+        if (!tmpl || !data || cminja_render_to(tmpl, data, sink, &output) != CMINJA_OK) output = std::string("error: ") + cminja_last_error();
+        if (output != c.expected) {
+            std::printf("FAIL %s (%s, render %d)\n  expected: %s\n  got:      %s\n", c.name, mode, i, c.expected, output.c_str());
+            failures++;
+        }
+    }
+    cminja_data_free(data);
+    cminja_template_free(tmpl);
+    return failures;
+}
+
+} // namespace
+
+int main() {
+    int failures = 0;
+    for (const auto& c : cases) failures += check(c, "serial");
+    cminja_set_parallel_loops(2, 4);
+    for (const auto& c : cases) failures += check(c, "parallel");
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
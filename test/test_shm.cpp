@@ -0,0 +1,105 @@
+// Round trip through the shared-memory ring: starts `cminja --serve-shm` (its path is the first argument), renders
+// through the producer API of shm_ring.hpp, then stops the daemon.
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shm_ring.hpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::printf("FAIL %s\n", what.c_str());
+        failures++;
+    }
+}
+
+// Waits for the daemon to create and initialize the ring.
+std::unique_ptr<shm_ring::Ring> open_ring(const std::string& name) {
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        try {
+            return std::make_unique<shm_ring::Ring>(shm_ring::Ring::open(name));
+        } catch (const std::exception&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    return nullptr;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::printf("Usage: %s <path to cminja>\n", argv[0]);
+        return 2;
+    }
+    char dir_template[] = "/tmp/cminja-test-XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    std::ofstream(dir + "/greet.m2") << "Hello {{ name }}!";
+    std::ofstream(dir + "/count.m2") << "{% for i in range(n) %}{{ i }}{% endfor %}";
+    std::ofstream(dir + "/loop.m2") << "{% for i in range(n) %}{% endfor %}";
+    std::ofstream(dir + "/large.m2") << "{% for i in range(n) %}{{ i }},{% endfor %}";
+    auto name = "/cminja-test-" + std::to_string(getpid());
+
+    auto daemon = fork();
+    if (daemon == 0) {
+        execl(argv[1], argv[1], "--serve-shm", name.c_str(), "--templates", dir.c_str(), "--max-steps", "1000000", (char*) nullptr);
+        _exit(127);
+    }
+
+    auto ring = open_ring(name);
+    check(!!ring, "open the ring");
+    if (ring) {
+        std::string output;
+        check(ring->render("greet.m2", R"({"name": "shm"})", output) == 0 && output == "Hello shm!", "render: " + output);
+        check(ring->render("missing.m2", "{}", output) == 1, "missing template: " + output);
+        check(ring->render("greet.m2", "{", output) == 1, "invalid JSON: " + output);
+        check(ring->render("loop.m2", R"({"n": 1000000})", output) == 2, "over the step limit: " + output);
+        // Rendered straight into the slot, which it doesn't fit in.
+        check(ring->render("large.m2", R"({"n": 200000})", output) == 1 && output == "Output too large for a shared memory slot",
+              "output too large: " + output);
+        check(ring->render("large.m2", R"({"n": 100000})", output) == 0 && output.size() == 588890, "output filling most of a slot");
+
+        // More producers than slots would be needed for: each waits for a free one.
+        std::vector<std::thread> producers;
+        std::vector<int> ok(8);
+        for (int i = 0; i < 8; ++i) {
+            producers.emplace_back([&, i]() {
+                for (int j = 0; j < 50 && (j == 0 || ok[i]); ++j) {
+                    std::string out;
+                    auto n = std::to_string(j % 12);
+                    std::string expected;
+                    for (int k = 0; k < j % 12; ++k) expected += std::to_string(k);
+                    ok[i] = ring->render("count.m2", R"({"n": )" + n + "}", out) == 0 && out == expected;
+                }
+            });
+        }
+        for (auto& producer : producers) producer.join();
+        for (int i = 0; i < 8; ++i) check(ok[i], "concurrent producer " + std::to_string(i));
+        ring.reset();
+    }
+
+    kill(daemon, SIGTERM);
+    int status = 0;
+    waitpid(daemon, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "daemon exit status");
+    check(shm_open(name.c_str(), O_RDWR, 0) < 0, "ring removed on exit");
+
+    std::remove((dir + "/greet.m2").c_str());
+    for (const char* file : { "/count.m2", "/loop.m2", "/large.m2" }) std::remove((dir + file).c_str());
+    rmdir(dir.c_str());
+    std::printf("%d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}